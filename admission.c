@@ -0,0 +1,107 @@
+#include "admission.h"
+#include <stdlib.h>
+
+static void list_append(struct admission_list *list, struct admission_node *node) {
+    node->prev = list->tail;
+    node->next = NULL;
+    if (list->tail != NULL) {
+        list->tail->next = node;
+    } else {
+        list->head = node;
+    }
+    list->tail = node;
+}
+static void list_remove(struct admission_list *list, struct admission_node *node) {
+    if (node->prev != NULL) {
+        node->prev->next = node->next;
+    } else {
+        list->head = node->next;
+    }
+    if (node->next != NULL) {
+        node->next->prev = node->prev;
+    } else {
+        list->tail = node->prev;
+    }
+    node->prev = node->next = NULL;
+}
+int admission_init(struct admission_queue *q, int capacity, int limit, int owners) {
+    q->granted = calloc(owners, sizeof(struct admission_list));
+    if (q->granted == NULL) {
+        return -1;
+    }
+    pthread_mutex_init(&q->lock, NULL);
+    q->capacity = capacity;
+    q->limit = limit;
+    q->seated = q->waiting = 0;
+    q->next_ticket = 1;
+    q->queue.head = q->queue.tail = NULL;
+    return 0;
+}
+enum admission_result admission_enter(struct admission_queue *q, struct admission_node *node, int owner) {
+    enum admission_result result;
+    pthread_mutex_lock(&q->lock);
+    node->owner = owner;
+    // Someone waiting means there is no free seat, the check on waiting only keeps newcomers from cutting in line.
+    if (q->seated < q->capacity && q->waiting == 0) {
+        q->seated++;
+        node->state = NODE_SEATED;
+        result = ADMISSION_SEATED;
+    } else if (q->waiting < q->limit) {
+        q->waiting++;
+        node->state = NODE_QUEUED;
+        node->ticket = q->next_ticket++;
+        list_append(&q->queue, node);
+        result = ADMISSION_QUEUED;
+    } else {
+        node->state = NODE_OUTSIDE;
+        result = ADMISSION_REJECTED;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return result;
+}
+struct admission_node *admission_leave(struct admission_queue *q, struct admission_node *node) {
+    struct admission_node *granted = NULL;
+    pthread_mutex_lock(&q->lock);
+    switch (node->state) {
+    case NODE_QUEUED:
+        list_remove(&q->queue, node);
+        q->waiting--;
+        break;
+    case NODE_GRANTED:
+        list_remove(&q->granted[node->owner], node);
+        q->seated--;
+        break;
+    case NODE_SEATED:
+        q->seated--;
+        break;
+    default:
+        break;
+    }
+    node->state = NODE_OUTSIDE;
+    // Hand the free seat to the longest waiting user.
+    if (q->seated < q->capacity && (granted = q->queue.head) != NULL) {
+        list_remove(&q->queue, granted);
+        q->waiting--;
+        q->seated++;
+        granted->state = NODE_GRANTED;
+        list_append(&q->granted[granted->owner], granted);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return granted;
+}
+struct admission_node *admission_take_granted(struct admission_queue *q, int owner) {
+    pthread_mutex_lock(&q->lock);
+    struct admission_node *list = q->granted[owner].head;
+    for (struct admission_node *node = list; node != NULL; node = node->next) {
+        node->state = NODE_SEATED;
+    }
+    q->granted[owner].head = q->granted[owner].tail = NULL;
+    pthread_mutex_unlock(&q->lock);
+    return list;
+}
+unsigned long long admission_head(struct admission_queue *q) {
+    pthread_mutex_lock(&q->lock);
+    unsigned long long head = (q->queue.head != NULL) ? q->queue.head->ticket : q->next_ticket;
+    pthread_mutex_unlock(&q->lock);
+    return head;
+}
@@ -0,0 +1,68 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <pthread.h>
+#include <stdbool.h>
+
+#define DEFAULT_ROOM_CAPACITY 10000 // Members in the room at once
+#define DEFAULT_QUEUE_LIMIT 1000    // Users waiting for a seat at once
+
+/*
+    Where a user is in the admission process:
+    - NODE_OUTSIDE: Not seated and not waiting, either still in the handshake or gone.
+    - NODE_QUEUED: Waiting in the room's FIFO queue.
+    - NODE_GRANTED: Given a seat that freed up, the shard owning the user hasn't seated it yet.
+    - NODE_SEATED: In the room.
+*/
+enum admission_state { NODE_OUTSIDE, NODE_QUEUED, NODE_GRANTED, NODE_SEATED };
+
+/*
+    Embedded in every client. prev/next link the node into the queue while NODE_QUEUED and into its owner's granted
+    list while NODE_GRANTED, so leaving either is O(1). ticket numbers queued users in arrival order.
+*/
+struct admission_node {
+    struct admission_node *prev, *next;
+    enum admission_state state;
+    int owner;
+    unsigned long long ticket;
+};
+
+struct admission_list {
+    struct admission_node *head, *tail;
+};
+
+/*
+    The room's seats and its waiting queue, shared by all shards. Joins and leaves are rare next to messages,
+    so one mutex is enough.
+    - capacity/seated: Seats in the room and how many are taken, granted seats count as taken.
+    - limit/waiting: Most users that may wait and how many do.
+    - queue: Waiting users, first come first served.
+    - granted[owner]: Users given a seat, per shard, until that shard picks them up with admission_take_granted().
+*/
+struct admission_queue {
+    pthread_mutex_t lock;
+    int capacity;
+    int seated;
+    int limit;
+    int waiting;
+    unsigned long long next_ticket;
+    struct admission_list queue;
+    struct admission_list *granted;
+};
+
+enum admission_result { ADMISSION_SEATED, ADMISSION_QUEUED, ADMISSION_REJECTED };
+
+int admission_init(struct admission_queue *q, int capacity, int limit, int owners); // returns -1 if allocation failed
+// Seats the user if there is a free seat and nobody waiting, otherwise queues it, or rejects it if the queue is full.
+enum admission_result admission_enter(struct admission_queue *q, struct admission_node *node, int owner);
+/*
+    Called when a user disconnects, whatever its state. If that frees a seat, it goes to the head of the queue and the
+    granted user is returned, so the caller can wake the shard owning it. Returns NULL otherwise.
+*/
+struct admission_node *admission_leave(struct admission_queue *q, struct admission_node *node);
+// Detaches the users granted a seat on this shard, returned as a list linked through next. They are NODE_SEATED from now on.
+struct admission_node *admission_take_granted(struct admission_queue *q, int owner);
+// Ticket of the user at the head of the queue, a user's position is its ticket minus this plus one.
+unsigned long long admission_head(struct admission_queue *q);
+
+#endif
@@ -0,0 +1,431 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+    Load generator for the chat server. Opens many simulated clients from one thread, does the username handshake,
+    sends chat messages at a fixed total rate and measures:
+    - fan-out latency: from the moment a sender wrote a message to the moment each other client read it,
+    - throughput: messages sent and deliveries received per second,
+    - join replay time: from sending the handshake to receiving the whole history page asked for with --history.
+    Every message carries the sender's CLOCK_MONOTONIC send time and a run id, so the generator and the server must
+    run on the same machine, and messages of earlier runs replayed from history aren't mistaken for this run's.
+    Build: gcc -O2 -o load_generator bench/load_generator.c
+*/
+#define MAX_EVENTS 256
+#define READ_CHUNK 65536
+#define MARKER "lg:" // Start of every message text the generator sends: lg:<run>:<send time in ns>:<padding>
+
+// Log-linear latency histogram in microseconds: 16 linear sub-buckets per power of two, about 6% precision.
+#define SUB_BUCKETS 16
+#define HISTOGRAM_BUCKETS (40 * SUB_BUCKETS)
+struct histogram {
+    unsigned long long counts[HISTOGRAM_BUCKETS];
+    unsigned long long total;
+    unsigned long long max;
+};
+
+enum lg_state { CONNECTING, JOINING, CHATTING, CLOSED };
+
+/*
+    One simulated client.
+    - history_left: History lines still expected before the join counts as complete.
+    - slow: Never reads after the handshake, to exercise the server's slow consumer policy.
+    - out, out_length: Bytes that didn't fit into the socket yet.
+*/
+struct lg_client {
+    int fd;
+    enum lg_state state;
+    bool slow;
+    bool sender;
+    int history_left;
+    uint64_t join_started;
+    char *in;
+    size_t in_length;
+    char *out;
+    size_t out_length;
+    size_t out_capacity;
+};
+
+static struct {
+    const char *host;
+    int port;
+    int clients;
+    int senders;
+    int slow;
+    double rate;
+    int size;
+    double duration;
+    double connect_rate;
+    int history;
+    const char *prefix;
+} options = {"127.0.0.1", 8080, 100, 0, 0, 100, 64, 10, 0, 0, "lg"};
+
+static struct lg_client *clients;
+static int epoll_fd;
+static unsigned run_id;
+static struct histogram latency, join_time;
+static unsigned long long sent, delivered, queued, rejected, dropped, connected, joined;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+static void histogram_record(struct histogram *h, uint64_t value) {
+    int bucket;
+    if (value < SUB_BUCKETS) {
+        bucket = (int)value;
+    } else {
+        int msb = 63 - __builtin_clzll(value);
+        bucket = (msb - 3) * SUB_BUCKETS + (int)((value >> (msb - 4)) & (SUB_BUCKETS - 1));
+    }
+    if (bucket >= HISTOGRAM_BUCKETS) {
+        bucket = HISTOGRAM_BUCKETS - 1;
+    }
+    h->counts[bucket]++;
+    h->total++;
+    if (value > h->max) {
+        h->max = value;
+    }
+}
+// Upper bound of a bucket, what a percentile is reported as.
+static uint64_t bucket_limit(int bucket) {
+    if (bucket < SUB_BUCKETS) {
+        return (uint64_t)bucket;
+    }
+    int msb = bucket / SUB_BUCKETS + 3;
+    uint64_t sub = bucket % SUB_BUCKETS;
+    return ((SUB_BUCKETS + sub + 1) << (msb - 4)) - 1;
+}
+static double histogram_percentile(const struct histogram *h, double percentile) {
+    unsigned long long rank = (unsigned long long)(percentile / 100.0 * h->total + 0.5), seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank && seen > 0) {
+            uint64_t limit = bucket_limit(i);
+            return (limit < h->max ? limit : h->max) / 1000.0;
+        }
+    }
+    return h->max / 1000.0;
+}
+static void histogram_print(const char *name, const struct histogram *h) {
+    if (h->total == 0) {
+        printf("%-16s no samples\n", name);
+        return;
+    }
+    printf("%-16s p50 %.2f ms  p99 %.2f ms  p99.9 %.2f ms  max %.2f ms  (%llu samples)\n", name, histogram_percentile(h, 50),
+           histogram_percentile(h, 99), histogram_percentile(h, 99.9), h->max / 1000.0, h->total);
+}
+
+static void close_client(struct lg_client *client) {
+    if (client->state == CLOSED) {
+        return;
+    }
+    if (client->state != CONNECTING) {
+        dropped++;
+    }
+    close(client->fd);
+    client->state = CLOSED;
+}
+// Writes what's buffered, keeps the rest for EPOLLOUT.
+static void flush_out(struct lg_client *client) {
+    while (client->out_length > 0) {
+        ssize_t written = send(client->fd, client->out, client->out_length, MSG_NOSIGNAL);
+        if (written < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                close_client(client);
+            }
+            return;
+        }
+        memmove(client->out, client->out + written, client->out_length - written);
+        client->out_length -= written;
+    }
+}
+static void queue_out(struct lg_client *client, const char *data, size_t length) {
+    if (client->out_length + length > client->out_capacity) {
+        size_t capacity = client->out_capacity ? client->out_capacity : 1024;
+        while (capacity < client->out_length + length) {
+            capacity *= 2;
+        }
+        char *grown = realloc(client->out, capacity);
+        if (grown == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        client->out = grown;
+        client->out_capacity = capacity;
+    }
+    memcpy(client->out + client->out_length, data, length);
+    client->out_length += length;
+    flush_out(client);
+}
+static void start_connect(int index, const struct sockaddr_in *address) {
+    struct lg_client *client = &clients[index];
+    client->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (client->fd < 0) {
+        perror("socket");
+        exit(EXIT_FAILURE);
+    }
+    int one = 1;
+    setsockopt(client->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(client->fd, (const struct sockaddr *)address, sizeof(*address)) < 0 && errno != EINPROGRESS) {
+        perror("connect");
+        exit(EXIT_FAILURE);
+    }
+    client->state = CONNECTING;
+    client->slow = index < options.slow;
+    client->sender = !client->slow && (options.senders == 0 || index - options.slow < options.senders);
+    struct epoll_event event = {EPOLLIN | EPOLLOUT | EPOLLET, {.u32 = (uint32_t)index}};
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client->fd, &event);
+}
+static void send_handshake(int index) {
+    struct lg_client *client = &clients[index];
+    char handshake[256];
+    int length;
+    if (options.history > 0) {
+        length = snprintf(handshake, sizeof(handshake), "{\"username\":\"%s%u_%d\",\"history\":{\"last\":%d}}\n", options.prefix,
+                          run_id, index, options.history);
+    } else {
+        length = snprintf(handshake, sizeof(handshake), "{\"username\":\"%s%u_%d\"}\n", options.prefix, run_id, index);
+    }
+    connected++;
+    client->state = JOINING;
+    client->history_left = options.history;
+    client->join_started = now_ns();
+    queue_out(client, handshake, length);
+    if (options.history == 0 && client->state == JOINING) {
+        client->state = CHATTING;
+        joined++;
+    }
+}
+static void handle_line(struct lg_client *client, char *line, uint64_t now) {
+    if (strncmp(line, "{\"queue\":", 9) == 0) {
+        queued++;
+        return;
+    }
+    if (strncmp(line, "{\"error\":", 9) == 0) {
+        rejected++;
+        return;
+    }
+    if (client->state == JOINING && client->history_left > 0 && --client->history_left == 0) {
+        histogram_record(&join_time, (now - client->join_started) / 1000);
+        client->state = CHATTING;
+        joined++;
+    }
+    char *marker = strstr(line, "\"message\":\"" MARKER);
+    if (marker == NULL) {
+        return;
+    }
+    char *end;
+    unsigned long run = strtoul(marker + 11 + strlen(MARKER), &end, 10);
+    if (run != run_id || *end != ':') {
+        return;
+    }
+    uint64_t sent_at = strtoull(end + 1, NULL, 10);
+    // Messages sent before the client joined came with its history, the join time already covers them.
+    if (sent_at >= client->join_started && now >= sent_at) {
+        histogram_record(&latency, (now - sent_at) / 1000);
+        delivered++;
+    }
+}
+static void read_client(struct lg_client *client) {
+    if (client->slow) {
+        return;
+    }
+    while (client->state != CLOSED) {
+        char *grown = realloc(client->in, client->in_length + READ_CHUNK + 1);
+        if (grown == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        client->in = grown;
+        ssize_t received = recv(client->fd, client->in + client->in_length, READ_CHUNK, 0);
+        if (received <= 0) {
+            if (received == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+                close_client(client);
+            }
+            return;
+        }
+        client->in_length += received;
+        client->in[client->in_length] = '\0';
+
+        uint64_t now = now_ns();
+        char *line = client->in, *newline;
+        while ((newline = memchr(line, '\n', client->in + client->in_length - line)) != NULL) {
+            *newline = '\0';
+            handle_line(client, line, now);
+            line = newline + 1;
+        }
+        client->in_length -= line - client->in;
+        memmove(client->in, line, client->in_length);
+        if (received < READ_CHUNK) {
+            return;
+        }
+    }
+}
+static void send_message(struct lg_client *client, const char *padding) {
+    char message[128 + 65536];
+    int length = snprintf(message, sizeof(message), "{\"time\":\"2024-01-01T00:00:00.000Z\",\"message\":\"" MARKER "%u:%llu:%s\"}\n", run_id,
+                          (unsigned long long)now_ns(), padding);
+    queue_out(client, message, length);
+    sent++;
+}
+static void handle_events(int timeout_ms) {
+    struct epoll_event events[MAX_EVENTS];
+    int ready = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout_ms);
+    for (int i = 0; i < ready; i++) {
+        struct lg_client *client = &clients[events[i].data.u32];
+        if (client->state == CLOSED) {
+            continue;
+        }
+        if (client->state == CONNECTING && (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+            int error = 0;
+            socklen_t length = sizeof(error);
+            getsockopt(client->fd, SOL_SOCKET, SO_ERROR, &error, &length);
+            if (error != 0) {
+                fprintf(stderr, "connect: %s\n", strerror(error));
+                close_client(client);
+                continue;
+            }
+            send_handshake(events[i].data.u32);
+        }
+        if (events[i].events & EPOLLOUT) {
+            flush_out(client);
+        }
+        if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+            read_client(client);
+        }
+    }
+}
+static void usage(const char *name) {
+    fprintf(stderr,
+            "Usage: %s [--host=IP] [--port=N] [--clients=N] [--senders=N] [--slow=N] [--rate=MSGS_PER_SEC] [--size=BYTES]\n"
+            "          [--duration=SECONDS] [--connect-rate=PER_SEC] [--history=N] [--prefix=NAME]\n",
+            name);
+    exit(EXIT_FAILURE);
+}
+/*
+    Options:
+        --clients=N          Simulated clients (default 100).
+        --senders=N          How many of them send, the others only receive (default: all but the slow ones).
+        --slow=N             Clients that never read after the handshake (default 0).
+        --rate=N             Messages per second over all senders (default 100, 0 for none).
+        --size=BYTES         Padding in each message text (default 64).
+        --duration=SECONDS   How long to send once every client joined (default 10).
+        --connect-rate=N     New connections per second (default: all at once).
+        --history=N          Ask for the newest N messages on join and time their replay. The server must have at
+                             least N stored messages, see CHAT_STUB_HISTORY in database_stub.c (default: don't ask).
+        --prefix=NAME        Start of the usernames, the run id and the client number follow.
+*/
+static void parse_options(int argc, char *argv[]) {
+    static const struct option long_options[] = {
+        {"host", required_argument, NULL, 'h'},   {"port", required_argument, NULL, 'p'},
+        {"clients", required_argument, NULL, 'c'}, {"senders", required_argument, NULL, 's'},
+        {"slow", required_argument, NULL, 'w'},   {"rate", required_argument, NULL, 'r'},
+        {"size", required_argument, NULL, 'z'},   {"duration", required_argument, NULL, 'd'},
+        {"connect-rate", required_argument, NULL, 'C'}, {"history", required_argument, NULL, 'H'},
+        {"prefix", required_argument, NULL, 'P'}, {NULL, 0, NULL, 0}};
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'h': options.host = optarg; break;
+        case 'p': options.port = atoi(optarg); break;
+        case 'c': options.clients = atoi(optarg); break;
+        case 's': options.senders = atoi(optarg); break;
+        case 'w': options.slow = atoi(optarg); break;
+        case 'r': options.rate = atof(optarg); break;
+        case 'z': options.size = atoi(optarg); break;
+        case 'd': options.duration = atof(optarg); break;
+        case 'C': options.connect_rate = atof(optarg); break;
+        case 'H': options.history = atoi(optarg); break;
+        case 'P': options.prefix = optarg; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (options.clients < 1 || options.slow < 0 || options.slow > options.clients || options.size < 0 || options.size > 65000) {
+        usage(argv[0]);
+    }
+}
+int main(int argc, char *argv[]) {
+    parse_options(argc, argv);
+    run_id = (unsigned)(now_ns() % 1000000);
+    struct sockaddr_in address = {0};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(options.port);
+    if (inet_pton(AF_INET, options.host, &address.sin_addr) != 1) {
+        fprintf(stderr, "Bad --host %s\n", options.host);
+        return EXIT_FAILURE;
+    }
+    if ((clients = calloc(options.clients, sizeof(struct lg_client))) == NULL || (epoll_fd = epoll_create1(0)) < 0) {
+        perror("setup");
+        return EXIT_FAILURE;
+    }
+    char *padding = malloc(options.size + 1);
+    memset(padding, 'x', options.size);
+    padding[options.size] = '\0';
+
+    // Connect phase: open every client (paced by --connect-rate) and wait until all of them joined, at most 60 seconds.
+    uint64_t start = now_ns();
+    int opened = 0;
+    while (now_ns() - start < 60000000000ull) {
+        double elapsed = (now_ns() - start) / 1e9;
+        int due = (options.connect_rate > 0) ? (int)(elapsed * options.connect_rate) + 1 : options.clients;
+        while (opened < options.clients && opened < due) {
+            start_connect(opened++, &address);
+        }
+        handle_events(1);
+        unsigned long long settled = joined + rejected + dropped + queued;
+        if (opened == options.clients && settled >= (unsigned long long)(options.clients - options.slow)) {
+            break;
+        }
+    }
+    double connect_seconds = (now_ns() - start) / 1e9;
+
+    // Send phase: every millisecond, send whatever the rate says is due, round robin over the senders.
+    uint64_t send_start = now_ns();
+    int next_sender = 0;
+    while (options.rate > 0 && now_ns() - send_start < (uint64_t)(options.duration * 1e9)) {
+        unsigned long long due = (unsigned long long)((now_ns() - send_start) / 1e9 * options.rate);
+        for (int tries = 0; sent < due && tries < options.clients; tries++) {
+            struct lg_client *client = &clients[next_sender];
+            next_sender = (next_sender + 1) % options.clients;
+            if (client->sender && client->state == CHATTING) {
+                send_message(client, padding);
+                tries = -1;
+            }
+        }
+        handle_events(1);
+    }
+    double send_seconds = (now_ns() - send_start) / 1e9;
+    // Let the last messages arrive.
+    uint64_t drain_start = now_ns();
+    while (now_ns() - drain_start < 1000000000ull) {
+        handle_events(10);
+    }
+
+    printf("clients %d: connected %llu, joined %llu, queue notices %llu, errors %llu, closed by server %llu, connect phase %.2f s\n",
+           options.clients, connected, joined, queued, rejected, dropped, connect_seconds);
+    if (options.rate > 0) {
+        printf("sent %llu messages in %.2f s (%.0f/s), %llu deliveries (%.0f/s)\n", sent, send_seconds, sent / send_seconds, delivered,
+               delivered / send_seconds);
+        histogram_print("fan-out latency", &latency);
+    }
+    if (options.history > 0) {
+        histogram_print("join replay", &join_time);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,107 @@
+#!/bin/sh
+# Builds the chat server and the load generator, then runs fixed load scenarios against the server on this machine.
+#
+#   bench/run_scenarios.sh [--storage=memory|log|postgres] [scenario ...]
+#
+# Scenarios (all by default):
+#   idle-scale       5000 clients connect and stay idle: connect time and server memory per connection.
+#   broadcast-storm  500 clients, all of them sending, 2000 messages per second in total: fan-out latency and throughput.
+#   join-storm       2000 clients join at once, each replaying 100 messages of history: join replay time.
+#   slow-consumers   300 clients of which 30 never read, 500 messages per second: latency of the healthy clients
+#                    while the server drops or evicts the slow ones.
+#
+# By default the server runs with --storage=memory (database_stub.c, nothing stored, no PostgreSQL needed).
+# --storage=log uses the embedded message log in $OUT/log, --storage=postgres needs the database from the README.
+# Compiler flags can be changed with CFLAGS, and LIBS for where cJSON comes from (default -lcjson). Needs a file
+# descriptor limit above 5000 (ulimit -n).
+set -e
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+OUT=${BENCH_OUT:-/tmp/chat-bench}
+CFLAGS=${CFLAGS:--O2 -I/usr/include/postgresql -I/usr/include/cjson}
+LIBS=${LIBS:--lcjson}
+PORT=8080
+STORAGE=memory
+SHARDS=${SHARDS:-$(nproc)}
+
+case $1 in
+--storage=*)
+    STORAGE=${1#--storage=}
+    shift
+    ;;
+esac
+SCENARIOS=${*:-idle-scale broadcast-storm join-storm slow-consumers}
+
+mkdir -p "$OUT"
+cd "$ROOT"
+echo "Building into $OUT"
+# shellcheck disable=SC2086
+gcc -std=gnu11 -pthread $CFLAGS -o "$OUT/chat_server" *.c $LIBS -lpq -lz
+gcc -std=gnu11 -O2 -o "$OUT/load_generator" bench/load_generator.c
+
+SERVER_PID=
+stop_server() {
+    if [ -n "$SERVER_PID" ]; then
+        kill "$SERVER_PID" 2>/dev/null || true
+        wait "$SERVER_PID" 2>/dev/null || true
+        SERVER_PID=
+    fi
+}
+trap stop_server EXIT
+
+# start_server [server options...], with CHAT_STUB_HISTORY taken from the environment
+start_server() {
+    rm -rf "$OUT/log"
+    "$OUT/chat_server" --shards="$SHARDS" --storage="$STORAGE" --log-dir="$OUT/log" "$@" > "$OUT/server.log" 2>&1 &
+    SERVER_PID=$!
+    for _ in $(seq 50); do
+        # Listening on PORT (0x1F90) yet?
+        if grep -q ":1F90 00000000:0000 0A" /proc/net/tcp 2>/dev/null; then
+            sleep 0.2
+            return
+        fi
+        sleep 0.1
+    done
+    echo "Server did not start, see $OUT/server.log" >&2
+    exit 1
+}
+server_memory() {
+    grep VmRSS "/proc/$SERVER_PID/status" | awk '{print "server resident memory " $2 " kB"}'
+}
+# scenario NAME [load generator options...]
+run() {
+    name=$1
+    shift
+    echo
+    echo "== $name"
+    "$OUT/load_generator" --port=$PORT --prefix="$name" "$@"
+    server_memory
+    stop_server
+}
+
+for scenario in $SCENARIOS; do
+    case $scenario in
+    idle-scale)
+        start_server --room-capacity=10000
+        run idle-scale --clients=5000 --connect-rate=2000 --rate=0
+        ;;
+    broadcast-storm)
+        start_server
+        run broadcast-storm --clients=500 --rate=2000 --size=128 --duration=10
+        ;;
+    join-storm)
+        export CHAT_STUB_HISTORY=100000
+        start_server
+        unset CHAT_STUB_HISTORY
+        run join-storm --clients=2000 --history=100 --rate=0
+        ;;
+    slow-consumers)
+        start_server --outbound-limit=65536 --slow-consumer=evict
+        run slow-consumers --clients=300 --slow=30 --rate=500 --size=1024 --duration=10
+        ;;
+    *)
+        echo "Unknown scenario $scenario" >&2
+        exit 1
+        ;;
+    esac
+done
@@ -0,0 +1,153 @@
+#define _GNU_SOURCE
+#include "binary_protocol.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+static uint16_t get16(const uint8_t *p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+static uint32_t get32(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+static uint64_t get64(const uint8_t *p) {
+    return (uint64_t)get32(p) << 32 | get32(p + 4);
+}
+static void put16(uint8_t *p, uint16_t v) {
+    p[0] = (uint8_t)(v >> 8);
+    p[1] = (uint8_t)v;
+}
+static void put32(uint8_t *p, uint32_t v) {
+    put16(p, (uint16_t)(v >> 16));
+    put16(p + 2, (uint16_t)v);
+}
+static void put64(uint8_t *p, uint64_t v) {
+    put32(p, (uint32_t)(v >> 32));
+    put32(p + 4, (uint32_t)v);
+}
+int varint_decode(const uint8_t *data, size_t length, uint64_t *value) {
+    *value = 0;
+    for (int i = 0; i < BINARY_MAX_VARINT; i++) {
+        if ((size_t)i >= length) {
+            return 0;
+        }
+        *value |= (uint64_t)(data[i] & 0x7F) << (7 * i);
+        if (!(data[i] & 0x80)) {
+            return i + 1;
+        }
+    }
+    return -1;
+}
+static int varint_encode(uint8_t *out, uint64_t value) {
+    int i = 0;
+    do {
+        out[i] = (uint8_t)(value & 0x7F);
+        value >>= 7;
+        if (value != 0) {
+            out[i] |= 0x80;
+        }
+        i++;
+    } while (value != 0);
+    return i;
+}
+int binary_next_message(struct read_buffer *buffer, struct binary_message *message) {
+    char *data;
+    size_t pending = read_buffer_pending(buffer, &data);
+    uint64_t length;
+    int prefix = varint_decode((const uint8_t *)data, pending, &length);
+    if (prefix < 0 || (prefix > 0 && (length < BINARY_HEADER_SIZE || length > MAX_FRAME_SIZE - BINARY_MAX_VARINT))) {
+        return -1;
+    }
+    if (prefix == 0 || pending < prefix + length) {
+        return 0;
+    }
+    read_buffer_consume(buffer, prefix + length);
+
+    // Move the message over its length prefix, which frees a byte behind the payload for the terminator.
+    memmove(data, data + prefix, length);
+    data[length] = '\0';
+    const uint8_t *header = (const uint8_t *)data;
+    message->type = header[0];
+    message->flags = header[1];
+    message->name_length = get16(header + 2);
+    message->room = get32(header + 4);
+    message->user = get32(header + 8);
+    message->id = (int64_t)get64(header + 12);
+    message->timestamp = (int64_t)get64(header + 20);
+    if (message->name_length > length - BINARY_HEADER_SIZE) {
+        return -1;
+    }
+    message->name = data + BINARY_HEADER_SIZE;
+    message->payload = data + BINARY_HEADER_SIZE + message->name_length;
+    message->payload_length = length - BINARY_HEADER_SIZE - message->name_length;
+    return 1;
+}
+size_t binary_encoded_size(const struct binary_message *message) {
+    uint8_t prefix[10];
+    size_t length = BINARY_HEADER_SIZE + message->name_length + message->payload_length;
+    return varint_encode(prefix, length) + length;
+}
+size_t binary_encode_into(uint8_t *out, const struct binary_message *message) {
+    size_t length = BINARY_HEADER_SIZE + message->name_length + message->payload_length;
+    int prefix_length = varint_encode(out, length);
+    out += prefix_length;
+    out[0] = message->type;
+    out[1] = message->flags;
+    put16(out + 2, (uint16_t)message->name_length);
+    put32(out + 4, message->room);
+    put32(out + 8, message->user);
+    put64(out + 12, (uint64_t)message->id);
+    put64(out + 20, (uint64_t)message->timestamp);
+    memcpy(out + BINARY_HEADER_SIZE, message->name, message->name_length);
+    memcpy(out + BINARY_HEADER_SIZE + message->name_length, message->payload, message->payload_length);
+    return prefix_length + length;
+}
+struct frame *binary_encode_message(const struct binary_message *message) {
+    struct frame *frame = frame_alloc(binary_encoded_size(message));
+    if (frame != NULL) {
+        binary_encode_into((uint8_t *)frame->data, message);
+    }
+    return frame;
+}
+int64_t timestamp_parse(const char *text) {
+    struct tm tm;
+    int milliseconds = 0, consumed = 0;
+    memset(&tm, 0, sizeof(tm));
+    if (sscanf(text, "%4d-%2d-%2d%*1[T ]%2d:%2d:%2d%n", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &consumed) != 6) {
+        return 0;
+    }
+    text += consumed;
+    if (*text == '.') {
+        // Only the first three fraction digits matter.
+        int scale = 100;
+        for (text++; *text >= '0' && *text <= '9'; text++) {
+            milliseconds += (*text - '0') * scale;
+            scale /= 10;
+        }
+    }
+    // Clients send UTC ("Z"), PostgreSQL prints timestamptz with an offset ("+00" or "+05:30").
+    int offset_minutes = 0;
+    if (*text == '+' || *text == '-') {
+        int hours = 0, minutes = 0;
+        if (sscanf(text + 1, "%2d:%2d", &hours, &minutes) < 1) {
+            return 0;
+        }
+        offset_minutes = (*text == '-' ? -1 : 1) * (hours * 60 + minutes);
+    } else if (*text != 'Z') {
+        return 0;
+    }
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    return ((int64_t)timegm(&tm) - offset_minutes * 60) * 1000 + milliseconds;
+}
+void timestamp_format(int64_t milliseconds, char text[32]) {
+    if (milliseconds == 0) {
+        text[0] = '\0';
+        return;
+    }
+    time_t seconds = (time_t)(milliseconds / 1000);
+    struct tm tm;
+    gmtime_r(&seconds, &tm);
+    size_t length = strftime(text, 32, "%Y-%m-%dT%H:%M:%S", &tm);
+    snprintf(text + length, 32 - length, ".%03dZ", (int)(milliseconds % 1000));
+}
@@ -0,0 +1,77 @@
+#ifndef BINARY_PROTOCOL_H
+#define BINARY_PROTOCOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "framing.h"
+#include "outbound.h"
+
+/*
+    Optional binary wire protocol for bots and bridges, picked with "protocol": "binary" in the username handshake
+    (which itself is still a JSON line). From then on every message in either direction is
+
+        varint length | header (BINARY_HEADER_SIZE bytes) | payload
+
+    The length is an unsigned LEB128 varint counting header and payload. Header fields are big-endian:
+
+        offset 0  uint8   type         enum binary_type
+        offset 1  uint8   flags        history mode for BINARY_HISTORY requests, 0 otherwise
+        offset 2  uint16  name_length  bytes of the payload that are the sender's username (server to client only)
+        offset 4  uint32  room         0 is the room every client is in
+        offset 8  uint32  user         the sender's user id (server to client only)
+        offset 12 int64   id           message id, the anchor of a history request, or the queue position
+        offset 20 int64   timestamp    milliseconds since the Unix epoch, 0 if unknown
+
+    The payload is raw UTF-8: the username (name_length bytes) followed by the message text.
+*/
+#define BINARY_HEADER_SIZE 28
+#define BINARY_MAX_VARINT 5 // Bytes a length varint may take, more than enough for MAX_FRAME_SIZE
+
+/*
+    - BINARY_CHAT: A chat message. Sent by clients with just the text as payload, received with the sender's name in front.
+      The text can't contain NUL bytes, JSON clients get the same message as a C string. A client sending one is
+      dropped like for a malformed message.
+    - BINARY_HISTORY: A history page request, flags holds the enum history_mode, id the anchor and the payload an optional
+      varint limit. The rows come back as BINARY_CHAT messages.
+    - BINARY_QUEUE: The room is full, id is the client's position in the admission queue.
+    - BINARY_ERROR: The payload is the error code, e.g. username_taken or room_full.
+    - BINARY_HISTORY_BLOCK: A whole history page compressed, for clients that asked for "compress": "deflate" in the
+      handshake (see history_block.h). flags is HISTORY_BLOCK_DEFLATE, user the Adler-32 of the preset dictionary,
+      id the number of messages and the payload a zlib stream of the page's BINARY_CHAT messages.
+*/
+enum binary_type { BINARY_CHAT = 1, BINARY_HISTORY = 2, BINARY_QUEUE = 3, BINARY_ERROR = 4, BINARY_HISTORY_BLOCK = 5 };
+#define HISTORY_BLOCK_DEFLATE 1 // flags of a BINARY_HISTORY_BLOCK: zlib with the preset dictionary
+
+// One decoded message. name and payload point into the read buffer (or the caller's strings when encoding).
+struct binary_message {
+    uint8_t type;
+    uint8_t flags;
+    uint32_t room;
+    uint32_t user;
+    int64_t id;
+    int64_t timestamp;
+    const char *name;
+    size_t name_length;
+    char *payload;
+    size_t payload_length;
+};
+
+/*
+    Takes the next complete message off the buffer. The payload is null-terminated in place and stays valid until the
+    next read_buffer_fill. Returns 1 for a message, 0 if none is complete yet, -1 for a malformed or oversized one.
+*/
+int binary_next_message(struct read_buffer *buffer, struct binary_message *message);
+// Encodes one message into a new frame, NULL if allocation failed.
+struct frame *binary_encode_message(const struct binary_message *message);
+// The same into a caller's buffer of at least binary_encoded_size() bytes, returns the bytes written.
+size_t binary_encoded_size(const struct binary_message *message);
+size_t binary_encode_into(uint8_t *out, const struct binary_message *message);
+// Reads a varint from at most length bytes. Returns the bytes it took, 0 if it is incomplete, -1 if it is too long.
+int varint_decode(const uint8_t *data, size_t length, uint64_t *value);
+
+// Converts between the JSON protocol's ISO 8601 timestamps ("2024-05-01T12:00:00.000Z") and epoch milliseconds.
+int64_t timestamp_parse(const char *text); // 0 if text isn't an ISO 8601 timestamp with a zone
+void timestamp_format(int64_t milliseconds, char text[32]); // empty if milliseconds is 0
+
+#endif
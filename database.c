@@ -1,158 +1,357 @@
 #include "database.h"
+#include "storage.h"
+#include "memory_pool.h"
 
-PGconn *db_conn = NULL;
+/*
+    Connection pool. Every connection prepares the statements below once, right after connecting, and
+    from then on only sends their name and parameters, so the server doesn't parse and plan the SQL per call.
+    - connections: All pooled connections.
+    - idle: Stack of the connections currently checked in, idle_count is its height.
+    - lock/available: Guard the stack, db_checkout waits on available while every connection is in use.
+*/
+static PGconn **connections;
+static PGconn **idle;
+static int pool_size;
+static int idle_count;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t available = PTHREAD_COND_INITIALIZER;
 
-void init_database() {
-    // Connect to the PostgreSQL database given its name and the user/password of its creator. Note that the connection stays.
-    db_conn = PQconnectdb("dbname=chat_history user=your_username password=your_password");
-    //Check that the connection was successful, otherwise pop an error.
-    if (PQstatus(db_conn) != CONNECTION_OK) {
-        fprintf(stderr, "Connection to database failed: %s", PQerrorMessage(db_conn));
-        PQfinish(db_conn);
-        exit(EXIT_FAILURE);
+/*
+    The prepared statements: name, SQL text and number of parameters.
+    All parameters are sent in text format: they arrive as strings (the timestamp is the client's ISO string), so
+    a binary encoding would only move the conversion from the server to us.
+*/
+static const struct {
+    const char *name;
+    const char *sql;
+    int params;
+} statements[] = {
+    {"insert_message", "INSERT INTO Messages (Id, Room, Timestamp, Username, Content) VALUES ($1, $2, $3, $4, $5);", 5},
+    // Several servers may register the same new name, the first one wins and the others skip it.
+    {"insert_username", "INSERT INTO Usernames (Username) VALUES ($1) ON CONFLICT DO NOTHING;", 1},
+    {"load_usernames", "SELECT Username FROM Usernames;", 0},
+    // Newest $2 messages of room $1, returned oldest first.
+    {"history_last", "SELECT Id, Timestamp, Username, Content FROM (SELECT * FROM Messages WHERE Room = $1 ORDER BY Id DESC LIMIT $2) page ORDER BY Id ASC;", 2},
+    // $3 messages of room $1 right before message $2, returned oldest first.
+    {"history_before", "SELECT Id, Timestamp, Username, Content FROM (SELECT * FROM Messages WHERE Room = $1 AND Id < $2 ORDER BY Id DESC LIMIT $3) page ORDER BY Id ASC;", 3},
+    // $3 messages of room $1 right after message $2.
+    {"history_after", "SELECT Id, Timestamp, Username, Content FROM Messages WHERE Room = $1 AND Id > $2 ORDER BY Id ASC LIMIT $3;", 3},
+};
+
+// Prepares every statement on a fresh connection. Returns false if one of them failed.
+static bool prepare_statements(PGconn *conn) {
+    for (size_t i = 0; i < sizeof(statements) / sizeof(statements[0]); i++) {
+        PGresult *res = PQprepare(conn, statements[i].name, statements[i].sql, statements[i].params, NULL);
+        bool ok = (PQresultStatus(res) == PGRES_COMMAND_OK);
+        PQclear(res);
+        if (!ok) {
+            fprintf(stderr, "Failed to prepare %s: %s", statements[i].name, PQerrorMessage(conn));
+            return false;
+        }
     }
-    // Create the necessary table if it doesn't exist
-    create_table();
+    return true;
 }
-void create_table() {
-    //SQL command to be run, written as raw string.
-    // Don't create the table if it does exist.
-    //Inserted with special PSQL value CURRENT_TIMESTAMP.
-    const char *sql = "CREATE TABLE IF NOT EXISTS Messages (Timestamp TIMESTAMP WITH TIME ZONE, Username TEXT PRIMARY KEY,Content TEXT); CREATE TABLE IF NOT EXISTS Usernames (Username TEXT PRIMARY KEY);";
-
-    PGresult *res = PQexec(db_conn, sql); // Excute the SQL query using the previously established connection.
-    //Error Handling if the execution failed.
-    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-        fprintf(stderr, "Failed to create table: %s", PQerrorMessage(db_conn));
-        PQclear(res);
+static void pg_open(int size, const char *path) {
+    (void)path;
+    pool_size = size;
+    connections = calloc(size, sizeof(PGconn *));
+    idle = calloc(size, sizeof(PGconn *));
+    if (connections == NULL || idle == NULL) {
+        perror("calloc");
         exit(EXIT_FAILURE);
     }
-    PQclear(res); // Free Memory.
+    for (int i = 0; i < size; i++) {
+        // Connect to the PostgreSQL database given its name and the user/password of its creator. Note that the connections stay.
+        connections[i] = PQconnectdb(DATABASE_CONNINFO);
+        //Check that the connection was successful, otherwise pop an error.
+        if (PQstatus(connections[i]) != CONNECTION_OK) {
+            fprintf(stderr, "Connection to database failed: %s", PQerrorMessage(connections[i]));
+            PQfinish(connections[i]);
+            exit(EXIT_FAILURE);
+        }
+        // Create or upgrade the tables, the statements can only be prepared once they are current
+        if (i == 0) {
+            migrate_schema(connections[0]);
+        }
+        if (!prepare_statements(connections[i])) {
+            exit(EXIT_FAILURE);
+        }
+        idle[idle_count++] = connections[i];
+    }
 }
-// Function to insert a message into the Messages table
-void insert_message(const char * time,const char *username, const char *message) {
-    // Construct the SQL query for inserting a message, with the current timestamp of execution.
-    const char *sql = "INSERT INTO Messages (Timestamp, Username, Content) VALUES ( $1, $2 , $3);";
+PGconn *db_checkout() {
+    pthread_mutex_lock(&lock);
+    while (idle_count == 0) {
+        pthread_cond_wait(&available, &lock);
+    }
+    PGconn *conn = idle[--idle_count];
+    pthread_mutex_unlock(&lock);
 
-    // Set up the parameter values for the query
-    const char *paramValues[3] = {time,username, message};
+    // A connection that dropped is re-established here, prepared statements don't survive a reset.
+    if (PQstatus(conn) != CONNECTION_OK) {
+        PQreset(conn);
+        if (PQstatus(conn) == CONNECTION_OK) {
+            prepare_statements(conn);
+        } else {
+            fprintf(stderr, "Reconnecting to database failed: %s", PQerrorMessage(conn));
+        }
+    }
+    return conn;
+}
+void db_checkin(PGconn *conn) {
+    pthread_mutex_lock(&lock);
+    idle[idle_count++] = conn;
+    pthread_cond_signal(&available);
+    pthread_mutex_unlock(&lock);
+}
+// Function to insert a message into the Messages table
+static void pg_insert_message(long long id, const char *room, const char *time, const char *username, const char *message) {
+    // Set up the parameter values for the query, a message without a time is stored with a NULL timestamp
+    char id_text[32];
+    snprintf(id_text, sizeof(id_text), "%lld", id);
+    const char *paramValues[5] = {id_text, room, (time[0] != '\0') ? time : NULL, username, message};
 
-    // Execute the SQL query with parameters
-    PGresult *res = PQexecParams(db_conn, sql, 3, NULL, paramValues, NULL, NULL, 0);
+    // Execute the prepared insert_message statement with parameters
+    PGconn *conn = db_checkout();
+    PGresult *res = PQexecPrepared(conn, "insert_message", 5, paramValues, NULL, NULL, 0);
 
     // Check if the query was successful
     if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-        fprintf(stderr, "Failed to insert message: %s", PQerrorMessage(db_conn));
+        fprintf(stderr, "Failed to insert message: %s", PQerrorMessage(conn));
     }
 
     // Clear the result
     PQclear(res);
+    db_checkin(conn);
 }
-// Function to insert a username into the Usernames table
-void insert_username(const char *username) {
-    // Construct the SQL query for inserting a message, with the current timestamp of execution.
-    const char *sql = "INSERT INTO Usernames (Username) VALUES ($1);";
+// Appends one field of a COPY text-format row followed by its separator ('\t' between columns, '\n' after the last).
+// Characters that have a meaning in that format are escaped, an empty value is written as NULL (\N) if null_if_empty is set.
+// Returns false if the buffer couldn't grow, *rows is left as it was then.
+static bool append_copy_field(char **rows, size_t *length, size_t *capacity, const char *value, bool null_if_empty, char separator) {
+    size_t needed = *length + 2 * strlen(value) + 3; // Worst case every character is escaped, plus \N and the separator
+    if (needed > *capacity) {
+        char *grown = realloc(*rows, needed * 2);
+        if (grown == NULL) {
+            perror("realloc");
+            return false;
+        }
+        *rows = grown;
+        *capacity = needed * 2;
+    }
+    char *out = *rows + *length;
+    if (value[0] == '\0' && null_if_empty) {
+        *out++ = '\\';
+        *out++ = 'N';
+    }
+    for (const char *c = value; *c; c++) {
+        switch (*c) {
+        case '\\': *out++ = '\\'; *out++ = '\\'; break;
+        case '\n': *out++ = '\\'; *out++ = 'n'; break;
+        case '\r': *out++ = '\\'; *out++ = 'r'; break;
+        case '\t': *out++ = '\\'; *out++ = 't'; break;
+        default: *out++ = *c;
+        }
+    }
+    *out++ = separator;
+    *length = out - *rows;
+    return true;
+}
+// Function to insert a batch of messages into the Messages table with a single COPY inside one transaction.
+// Returns false (after rolling back) if any row was rejected, the caller can then retry them one by one.
+static bool pg_insert_messages(const struct stored_message **messages, int count) {
+    PGconn *conn = db_checkout();
+    PGresult *res = PQexec(conn, "BEGIN;");
+    bool ok = (PQresultStatus(res) == PGRES_COMMAND_OK);
+    PQclear(res);
+    if (!ok) {
+        fprintf(stderr, "Failed to begin message batch: %s", PQerrorMessage(conn));
+        db_checkin(conn);
+        return false;
+    }
 
+    res = PQexec(conn, "COPY Messages (Id, Room, Timestamp, Username, Content) FROM STDIN;");
+    ok = (PQresultStatus(res) == PGRES_COPY_IN);
+    PQclear(res);
+    if (ok) {
+        // Build all rows in one buffer so the whole batch goes out in a single PQputCopyData call.
+        size_t length = 0, capacity = 0;
+        char *rows = NULL;
+        for (int i = 0; i < count && ok; i++) {
+            char id_text[32];
+            snprintf(id_text, sizeof(id_text), "%lld", messages[i]->id);
+            // A message without a time gets a NULL timestamp, same as insert_message.
+            ok = append_copy_field(&rows, &length, &capacity, id_text, false, '\t') &&
+                 append_copy_field(&rows, &length, &capacity, messages[i]->room, false, '\t') &&
+                 append_copy_field(&rows, &length, &capacity, messages[i]->timestamp, true, '\t') &&
+                 append_copy_field(&rows, &length, &capacity, messages[i]->username, false, '\t') &&
+                 append_copy_field(&rows, &length, &capacity, messages[i]->content, false, '\n');
+        }
+        // A batch that couldn't be built is aborted like one that couldn't be sent, and rolled back below.
+        ok = ok && (PQputCopyData(conn, rows, (int)length) == 1);
+        ok = (PQputCopyEnd(conn, ok ? NULL : "failed to send rows") == 1) && ok;
+        free(rows);
+        // Collect the result of the COPY itself, then make sure nothing else is pending on the connection.
+        while ((res = PQgetResult(conn)) != NULL) {
+            if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+                ok = false;
+            }
+            PQclear(res);
+        }
+    }
+    if (!ok) {
+        fprintf(stderr, "Failed to store message batch: %s", PQerrorMessage(conn));
+    }
+
+    res = PQexec(conn, ok ? "COMMIT;" : "ROLLBACK;");
+    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+        fprintf(stderr, "Failed to finish message batch: %s", PQerrorMessage(conn));
+        ok = false;
+    }
+    PQclear(res);
+    db_checkin(conn);
+    return ok;
+}
+// Function to insert a username into the Usernames table
+static void pg_insert_username(const char *username) {
     // Set up the parameter values for the query
     const char *paramValues[1] = {username};
 
-    // Execute the SQL query with parameters
-    PGresult *res = PQexecParams(db_conn, sql, 1, NULL, paramValues, NULL, NULL, 0);
+    // Execute the prepared insert_username statement with parameters
+    PGconn *conn = db_checkout();
+    PGresult *res = PQexecPrepared(conn, "insert_username", 1, paramValues, NULL, NULL, 0);
 
     // Check if the query was successful
     if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-        fprintf(stderr, "Failed to insert message: %s", PQerrorMessage(db_conn));
+        fprintf(stderr, "Failed to insert username: %s", PQerrorMessage(conn));
     }
 
     // Clear the result
     PQclear(res);
+    db_checkin(conn);
 }
-// Function to verify that the inserted username is unique
-bool verify_username(const char *username)
-{
-    // Check if the database connection is valid
-    if (!db_conn)
-    {
-        fprintf(stderr, "Database connection is not initialized.\n");
-        return false;
-    }
-
-    // Construct the SQL query to check if the username already exists
-    const char *sql = "SELECT Username FROM Usernames WHERE Username = $1;";
-    const char *paramValues[1] = {username};
-
-    // Execute the SQL query with parameters
-    PGresult *res = PQexecParams(db_conn, sql, 1, NULL, paramValues, NULL, NULL, 0);
-
-    // Check if the query was successful
-    if (PQresultStatus(res) != PGRES_TUPLES_OK)
-    {
-        fprintf(stderr, "Failed to execute query: %s", PQerrorMessage(db_conn));
+// Stores the names new to the username registry, one transaction for the whole batch.
+static bool pg_insert_usernames(const char **usernames, int count) {
+    PGconn *conn = db_checkout();
+    PGresult *res = PQexec(conn, "BEGIN;");
+    bool ok = (PQresultStatus(res) == PGRES_COMMAND_OK);
+    PQclear(res);
+    for (int i = 0; ok && i < count; i++) {
+        const char *paramValues[1] = {usernames[i]};
+        res = PQexecPrepared(conn, "insert_username", 1, paramValues, NULL, NULL, 0);
+        if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+            fprintf(stderr, "Failed to insert username: %s", PQerrorMessage(conn));
+            ok = false;
+        }
         PQclear(res);
-        return false;
     }
-
-    // Check if any rows were returned (username already exists)
-    bool exists = (PQntuples(res) > 0);
-
-    // Clear the result
+    res = PQexec(conn, ok ? "COMMIT;" : "ROLLBACK;");
+    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+        fprintf(stderr, "Failed to finish username batch: %s", PQerrorMessage(conn));
+        ok = false;
+    }
     PQclear(res);
-
-    // Return true if the username does not exist (unique), false otherwise
-    return !exists;
+    db_checkin(conn);
+    return ok;
 }
-//Function to send a specific message (all contained within the buffer) over a socket
-//Send all is better than send in that it doesn't get interrupted, sends all that is within the buffer.
-ssize_t send_all(int sockfd, const void *buf, size_t len, int flags) { //Parameters: socket file descriptor, buffer to read and send from, size of buffer in bytes, additional modification.
-    size_t total_sent = 0; //Total number of bytes sent
-    //While there are more bytes to be sent.
-    while (total_sent < len) {
-        ssize_t sent = send(sockfd, buf + total_sent, len - total_sent, flags); //Try to send remaining bytes to client
-        if (sent == -1) { //Send failed
-            if (errno == EINTR) { // Interrupted by signal, retry
-                continue;
-            } else { // Error occurred, return -1 to indicate failure
-                return -1;
-            }
+// Hands every stored username to the caller, streamed in single-row mode like the chat history.
+static bool pg_load_usernames(username_callback each, void *context) {
+    PGconn *conn = db_checkout();
+    if (!PQsendQueryPrepared(conn, "load_usernames", 0, NULL, NULL, NULL, 0) || !PQsetSingleRowMode(conn)) {
+        fprintf(stderr, "Failed to request usernames: %s", PQerrorMessage(conn));
+        PGresult *res;
+        while ((res = PQgetResult(conn)) != NULL) {
+            PQclear(res);
         }
-        if (sent == 0) { // Connection closed by peer, return total bytes sent
-            //Could do something different here.
-            return total_sent;
+        db_checkin(conn);
+        return false;
+    }
+
+    bool ok = true;
+    PGresult *res;
+    while ((res = PQgetResult(conn)) != NULL) {
+        ExecStatusType status = PQresultStatus(res);
+        if (status == PGRES_SINGLE_TUPLE) {
+            each(context, PQgetvalue(res, 0, 0));
+        } else if (status != PGRES_TUPLES_OK) {
+            fprintf(stderr, "Failed to load usernames: %s", PQresultErrorMessage(res));
+            ok = false;
         }
-        //Otherwise, we have successfully sent bytes, increment them to counter.
-        total_sent += sent;
+        PQclear(res);
     }
-    // All data sent successfully
-    return total_sent;
+    db_checkin(conn);
+    return ok;
 }
+// Function to retrieve a page of chat history and hand it to the caller one message at a time, oldest first.
+// Rows are streamed in libpq single-row mode, so only one row is held in memory at a time no matter how large the page or the table is.
+static bool pg_send_chat_history(const struct history_request *request, history_callback emit, void *context) {
+    // Pick the prepared statement for the requested page, all of them seek on the Id index instead of sorting the table.
+    char id[32], limit[16];
+    snprintf(id, sizeof(id), "%lld", request->id);
+    snprintf(limit, sizeof(limit), "%d", request->limit);
+    const char *statement;
+    const char *paramValues[3] = {request->room, id, limit};
+    int params = 3;
+    switch (request->mode) {
+    case HISTORY_BEFORE:
+        statement = "history_before";
+        break;
+    case HISTORY_AFTER:
+        statement = "history_after";
+        break;
+    default:
+        statement = "history_last";
+        paramValues[1] = limit;
+        params = 2;
+        break;
+    }
 
-// Function to retrieve chat history and send it to the client
-void send_chat_history(int client_socket) {
-    const char *sql = "SELECT * FROM Messages ORDER BY Timestamp ASC;"; // Query to get all of the chat currently.
-    PGresult *res = PQexec(db_conn, sql); // Execute query through connection.
-    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-        fprintf(stderr, "Failed to retrieve sorted messages: %s", PQerrorMessage(db_conn));
-        PQclear(res);
-        exit(EXIT_FAILURE);
+    PGconn *conn = db_checkout();
+    if (!PQsendQueryPrepared(conn, statement, params, paramValues, NULL, NULL, 0) || !PQsetSingleRowMode(conn)) {
+        fprintf(stderr, "Failed to request chat history: %s", PQerrorMessage(conn));
+        // Drain whatever was started so the connection is clean for the next user
+        PGresult *res;
+        while ((res = PQgetResult(conn)) != NULL) {
+            PQclear(res);
+        }
+        db_checkin(conn);
+        return false;
     }
-    // Iterate through the result and send each message to the client
-    int num_rows = PQntuples(res);
-    for (int i = 0; i < num_rows; ++i) {
-        // Create a cJSON object for the message
-        cJSON *message_obj = cJSON_CreateObject();
-        cJSON_AddStringToObject(message_obj, "timestamp", PQgetvalue(res, i, 0));
-        cJSON_AddStringToObject(message_obj, "username", PQgetvalue(res, i, 1));
-        cJSON_AddStringToObject(message_obj, "message", PQgetvalue(res, i, 2));
 
-        // Convert the cJSON object to a JSON string
-        char *json_str = cJSON_PrintUnformatted(message_obj);
+    // Every row arrives as its own PGRES_SINGLE_TUPLE result, the end of the page as an empty PGRES_TUPLES_OK.
+    bool ok = true;
+    PGresult *res;
+    while ((res = PQgetResult(conn)) != NULL) {
+        ExecStatusType status = PQresultStatus(res);
+        if (status == PGRES_SINGLE_TUPLE) {
+            // Create a cJSON object for the message, in an arena scope of its own so the page doesn't pile up in the arena
+            struct arena_mark mark = arena_begin();
+            cJSON *message_obj = cJSON_CreateObject();
+            cJSON_AddNumberToObject(message_obj, "id", (double)strtoll(PQgetvalue(res, 0, 0), NULL, 10));
+            cJSON_AddStringToObject(message_obj, "timestamp", PQgetvalue(res, 0, 1));
+            cJSON_AddStringToObject(message_obj, "username", PQgetvalue(res, 0, 2));
+            cJSON_AddStringToObject(message_obj, "message", PQgetvalue(res, 0, 3));
 
-        // Send the JSON string to the client
-        send_all(client_socket, json_str, strlen(json_str), 0);
+            // Convert the cJSON object to a JSON string and hand it over
+            char *json_str = cJSON_PrintUnformatted(message_obj);
+            if (json_str != NULL) {
+                emit(context, json_str, strlen(json_str));
+            }
 
-        // Free the cJSON object
-        cJSON_Delete(message_obj);
-        free(json_str); // Free the allocated memory for the JSON string
+            // Free the cJSON object
+            cJSON_Delete(message_obj);
+            cJSON_free(json_str); // Free the allocated memory for the JSON string
+            arena_end(mark);
+        } else if (status != PGRES_TUPLES_OK) {
+            fprintf(stderr, "Failed to retrieve sorted messages: %s", PQresultErrorMessage(res));
+            ok = false;
+        }
+        PQclear(res);
     }
-    PQclear(res);
-}
\ No newline at end of file
+    db_checkin(conn);
+    return ok;
+}
+
+const struct storage_backend postgres_storage = {
+    "postgres", true, pg_open, schema_maintenance_start, pg_send_chat_history, pg_insert_message,
+    pg_insert_messages, pg_insert_username, pg_insert_usernames, pg_load_usernames,
+};
@@ -1,3 +1,7 @@
+#ifndef DATABASE_H
+#define DATABASE_H
+
+#define _GNU_SOURCE // accept4, SOCK_NONBLOCK
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,15 +16,57 @@
 #include <sys/select.h>
 #include <errno.h>   // Add for errno
 #include <pthread.h>
-extern PGconn *db_conn;
+#include <netdb.h>     // gethostbyname
+#include <fcntl.h>     // O_NONBLOCK
+#include <poll.h>
+#include <time.h>
+#include <sys/epoll.h> // Event loop
+#include "schema.h"
+
+#define DATABASE_CONNINFO "dbname=chat_history user=your_username password=your_password"
+
+#define DEFAULT_ROOM "main"       // The server has one room, this is its name in the Room column
+#define DEFAULT_HISTORY_LIMIT 100 // Messages replayed on join when the client doesn't ask for a number
+#define MAX_HISTORY_LIMIT 1000    // Largest page of history a client can ask for
+
+/*
+    Which page of the chat history a client asked for, messages are identified by their Id.
+    - HISTORY_LAST: The newest limit messages (the default on join).
+    - HISTORY_BEFORE: The limit messages right before message id, to scroll back.
+    - HISTORY_AFTER: The limit messages right after message id, to catch up after a reconnect.
+*/
+enum history_mode { HISTORY_LAST, HISTORY_BEFORE, HISTORY_AFTER };
+struct history_request {
+    const char *room;
+    enum history_mode mode;
+    long long id;
+    int limit;
+};
+// Receives each history message as a JSON object (without the frame delimiter and not null-terminated), oldest first.
+typedef void (*history_callback)(void *context, const char *json, size_t length);
+// Receives each stored username while they are loaded at startup.
+typedef void (*username_callback)(void *context, const char *username);
+
+// One chat message as it is stored in the Messages table.
+struct stored_message {
+    long long id;
+    const char *room;
+    const char *timestamp;
+    const char *username;
+    const char *content;
+};
 
-void init_database();
-void create_table();
-ssize_t send_all(int sockfd, const void *buf, size_t len, int flags);
-void send_chat_history(int client_socket);
-void insert_message(const char * time,const char *username, const char *message);
-void insert_username(const char *username);
-bool verify_username(const char *username); //returns true if valid (unique).
+// Storage, answered by the backend opened with storage_init (see storage.h).
+bool send_chat_history(const struct history_request *request, history_callback emit, void *context); // false if the query failed
+void insert_message(long long id, const char *room, const char * time,const char *username, const char *message);
+bool insert_messages(const struct stored_message **messages, int count); // Stores a batch in one transaction, false if it was rolled back.
+void insert_username(const char *username); // Names that are already stored are skipped.
+bool insert_usernames(const char **usernames, int count); // Stores a batch of new names in one transaction.
+bool load_usernames(username_callback each, void *context); // Streams every stored username, false if the query failed.
+
+// The PostgreSQL backend's connection pool, opened with pool_size connections that each have the statements prepared.
+PGconn *db_checkout(); // Takes a connection out of the pool, waits if all of them are in use.
+void db_checkin(PGconn *conn); // Returns a connection taken with db_checkout.
 
 
 
@@ -28,4 +74,6 @@ bool verify_username(const char *username); //returns true if valid (unique).
     cJSON *username = cJSON_GetObjectItem(root, "username");
     cJSON *message = cJSON_GetObjectItem(root, "message");
     cJSON *time = cJSON_GetObjectItem(root, "time");
-*/
\ No newline at end of file
+*/
+
+#endif
@@ -0,0 +1,174 @@
+#include "storage.h"
+#include "memory_pool.h"
+
+/*
+    Storage backend without any storage, for benchmarks and load tests on a single machine (--storage=memory).
+    Messages and usernames live in memory for the lifetime of the process and history pages are served from
+    there, with the same JSON rows database.c produces.
+    CHAT_STUB_HISTORY=N seeds N old messages at startup, so joins and history pages have something to replay.
+*/
+#define STUB_TIMESTAMP "2024-01-01T00:00:00.000Z" // Timestamp of the seeded messages
+
+// One stored message, the strings live right after the struct.
+struct stub_message {
+    long long id;
+    const char *timestamp;
+    const char *username;
+    const char *content;
+};
+
+/*
+    - messages: Every stored message in id order, pages are found by binary search. The writer thread takes messages
+      from the shards' queues round robin, so they don't arrive in id order. Each one is inserted where it belongs,
+      which is close to the end.
+    - lock: Guards messages, the writer thread appends while shards read pages.
+*/
+static struct stub_message **messages;
+static size_t message_count;
+static size_t message_capacity;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool append_message(long long id, const char *time, const char *username, const char *content) {
+    size_t time_len = strlen(time) + 1, username_len = strlen(username) + 1, content_len = strlen(content) + 1;
+    struct stub_message *message = malloc(sizeof(struct stub_message) + time_len + username_len + content_len);
+    if (message == NULL) {
+        return false;
+    }
+    char *strings = (char *)(message + 1);
+    message->id = id;
+    message->timestamp = memcpy(strings, time, time_len);
+    message->username = memcpy(strings + time_len, username, username_len);
+    message->content = memcpy(strings + time_len + username_len, content, content_len);
+
+    pthread_mutex_lock(&lock);
+    if (message_count == message_capacity) {
+        size_t capacity = message_capacity ? message_capacity * 2 : 1024;
+        struct stub_message **grown = realloc(messages, capacity * sizeof(struct stub_message *));
+        if (grown == NULL) {
+            pthread_mutex_unlock(&lock);
+            free(message);
+            return false;
+        }
+        messages = grown;
+        message_capacity = capacity;
+    }
+    size_t at = message_count;
+    while (at > 0 && messages[at - 1]->id > id) {
+        at--;
+    }
+    memmove(&messages[at + 1], &messages[at], (message_count - at) * sizeof(struct stub_message *));
+    messages[at] = message;
+    message_count++;
+    pthread_mutex_unlock(&lock);
+    return true;
+}
+static void memory_open(int size, const char *path) {
+    (void)size;
+    (void)path;
+    const char *seed = getenv("CHAT_STUB_HISTORY");
+    long long rows = (seed != NULL) ? atoll(seed) : 0;
+    char content[48];
+    for (long long id = 1; id <= rows; id++) {
+        snprintf(content, sizeof(content), "seeded message %lld", id);
+        if (!append_message(id, STUB_TIMESTAMP, "seed", content)) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    printf("Using the in-memory storage stub, %lld seeded message(s)\n", rows);
+}
+static void memory_maintenance_start(int retention_days, bool archive) {
+    (void)retention_days;
+    (void)archive;
+}
+static void memory_insert_message(long long id, const char *room, const char *time, const char *username, const char *message) {
+    (void)room;
+    if (!append_message(id, time, username, message)) {
+        perror("malloc");
+    }
+}
+static bool memory_insert_messages(const struct stored_message **batch, int count) {
+    for (int i = 0; i < count; i++) {
+        memory_insert_message(batch[i]->id, batch[i]->room, batch[i]->timestamp, batch[i]->username, batch[i]->content);
+    }
+    return true;
+}
+static void memory_insert_username(const char *username) {
+    // The registry itself is the only copy of the names, nothing survives a restart.
+    (void)username;
+}
+static bool memory_insert_usernames(const char **usernames, int count) {
+    for (int i = 0; i < count; i++) {
+        memory_insert_username(usernames[i]);
+    }
+    return true;
+}
+static bool memory_load_usernames(username_callback each, void *context) {
+    (void)each;
+    (void)context;
+    return true;
+}
+// Index of the first message with an id of at least id.
+static size_t lower_bound(long long id) {
+    size_t low = 0, high = message_count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (messages[middle]->id < id) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+static bool memory_send_chat_history(const struct history_request *request, history_callback emit, void *context) {
+    pthread_mutex_lock(&lock);
+    size_t first, last; // The page is messages[first, last)
+    switch (request->mode) {
+    case HISTORY_BEFORE:
+        last = lower_bound(request->id);
+        first = (last > (size_t)request->limit) ? last - request->limit : 0;
+        break;
+    case HISTORY_AFTER:
+        first = lower_bound(request->id + 1);
+        last = (message_count - first > (size_t)request->limit) ? first + request->limit : message_count;
+        break;
+    default:
+        last = message_count;
+        first = (last > (size_t)request->limit) ? last - request->limit : 0;
+        break;
+    }
+    // The array may move when the writer thread appends, the messages themselves never do.
+    struct stub_message **page = malloc((last - first) * sizeof(struct stub_message *) + 1);
+    if (page == NULL) {
+        pthread_mutex_unlock(&lock);
+        return false;
+    }
+    if (last > first) {
+        memcpy(page, messages + first, (last - first) * sizeof(struct stub_message *));
+    }
+    pthread_mutex_unlock(&lock);
+
+    for (size_t i = 0; i < last - first; i++) {
+        struct arena_mark mark = arena_begin();
+        cJSON *message_obj = cJSON_CreateObject();
+        cJSON_AddNumberToObject(message_obj, "id", (double)page[i]->id);
+        cJSON_AddStringToObject(message_obj, "timestamp", page[i]->timestamp);
+        cJSON_AddStringToObject(message_obj, "username", page[i]->username);
+        cJSON_AddStringToObject(message_obj, "message", page[i]->content);
+        char *json_str = cJSON_PrintUnformatted(message_obj);
+        if (json_str != NULL) {
+            emit(context, json_str, strlen(json_str));
+        }
+        cJSON_Delete(message_obj);
+        cJSON_free(json_str);
+        arena_end(mark);
+    }
+    free(page);
+    return true;
+}
+
+const struct storage_backend memory_storage = {
+    "memory", false, memory_open, memory_maintenance_start, memory_send_chat_history, memory_insert_message,
+    memory_insert_messages, memory_insert_username, memory_insert_usernames, memory_load_usernames,
+};
@@ -0,0 +1,97 @@
+#include "framing.h"
+#include "memory_pool.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+// Moves the unconsumed bytes to the front and makes sure there is room to read into.
+static bool make_room(struct read_buffer *buffer) {
+    if (buffer->start > 0) {
+        size_t pending = buffer->length - buffer->start;
+        memmove(buffer->data, buffer->data + buffer->start, pending);
+        buffer->length = pending;
+        buffer->scanned -= buffer->start;
+        buffer->start = 0;
+    }
+    if (buffer->length < buffer->capacity) {
+        return true;
+    }
+    // The pending frame is already as long as the buffer, grow it (up to one maximum frame plus its delimiter).
+    if (buffer->capacity > MAX_FRAME_SIZE) {
+        errno = EMSGSIZE;
+        return false;
+    }
+    size_t capacity = buffer->capacity ? buffer->capacity * 2 : READ_BUFFER_INITIAL;
+    if (capacity > MAX_FRAME_SIZE + 1) {
+        capacity = MAX_FRAME_SIZE + 1;
+    }
+    // Buffers that fit a slab come from the thread's pool, only the rare long frame grows past it with realloc.
+    char *data;
+    if (buffer->capacity > SLAB_MAX_SIZE) {
+        data = realloc(buffer->data, capacity);
+    } else if ((data = slab_alloc(capacity)) != NULL && buffer->data != NULL) {
+        memcpy(data, buffer->data, buffer->length);
+        slab_free(buffer->data, buffer->capacity);
+    }
+    if (data == NULL) {
+        return false;
+    }
+    buffer->data = data;
+    buffer->capacity = capacity;
+    return true;
+}
+ssize_t read_buffer_fill(int sockfd, struct read_buffer *buffer, bool *full_read) {
+    if (!make_room(buffer)) {
+        return -1;
+    }
+    size_t space = buffer->capacity - buffer->length;
+    ssize_t received = recv(sockfd, buffer->data + buffer->length, space, 0);
+    if (received > 0) {
+        buffer->length += received;
+    }
+    *full_read = (received == (ssize_t)space);
+    return received;
+}
+bool read_buffer_next_frame(struct read_buffer *buffer, char **frame, size_t *length) {
+    while (buffer->scanned < buffer->length) {
+        char *begin = buffer->data + buffer->start;
+        char *end = memchr(buffer->data + buffer->scanned, FRAME_DELIMITER, buffer->length - buffer->scanned);
+        if (end == NULL) {
+            buffer->scanned = buffer->length;
+            return false;
+        }
+        size_t frame_length = end - begin;
+        *end = '\0';
+        buffer->start = buffer->scanned = (end - buffer->data) + 1;
+        if (frame_length > 0 && begin[frame_length - 1] == '\r') { // Tolerate CRLF line endings
+            begin[--frame_length] = '\0';
+        }
+        if (frame_length == 0) { // Skip empty lines
+            continue;
+        }
+        *frame = begin;
+        *length = frame_length;
+        return true;
+    }
+    return false;
+}
+size_t read_buffer_pending(const struct read_buffer *buffer, char **data) {
+    *data = buffer->data + buffer->start;
+    return buffer->length - buffer->start;
+}
+void read_buffer_consume(struct read_buffer *buffer, size_t length) {
+    buffer->start += length;
+    if (buffer->scanned < buffer->start) {
+        buffer->scanned = buffer->start;
+    }
+}
+void read_buffer_free(struct read_buffer *buffer) {
+    slab_free(buffer->data, buffer->capacity);
+    memset(buffer, 0, sizeof(*buffer));
+}
+void read_buffer_release_idle(struct read_buffer *buffer) {
+    if (buffer->start == buffer->length) {
+        read_buffer_free(buffer);
+    }
+}
@@ -0,0 +1,54 @@
+#ifndef FRAMING_H
+#define FRAMING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+    Wire framing: every message in either direction is one JSON object followed by '\n'.
+    JSON text never contains a raw newline (it is escaped inside strings), so the delimiter can't be part of a message.
+*/
+#define FRAME_DELIMITER '\n'
+#define READ_BUFFER_INITIAL 4096    // First allocation of a connection's read buffer
+#define MAX_FRAME_SIZE (64 * 1024)  // Longest accepted message, a connection sending more without a newline is dropped
+
+/*
+    Growable per-connection read buffer. Bytes are appended by read_buffer_fill and complete frames are taken
+    off the front by read_buffer_next_frame; a partial frame stays in the buffer until the rest of it arrives.
+    - data: The buffer, allocated on first use.
+    - length: Bytes currently held.
+    - capacity: Size of data.
+    - start: Offset of the first byte that hasn't been handed out as part of a frame yet.
+    - scanned: Offset up to which the pending bytes are known not to contain a delimiter, so a frame split over
+      many reads isn't searched from the beginning every time.
+*/
+struct read_buffer {
+    char *data;
+    size_t length;
+    size_t capacity;
+    size_t start;
+    size_t scanned;
+};
+
+/*
+    Reads once from the socket into the free space of the buffer, growing it if needed.
+    Returns the number of bytes read, 0 if the peer closed the connection, -1 with errno set on error,
+    or -1 with errno set to EMSGSIZE if a pending frame is longer than MAX_FRAME_SIZE.
+    *full_read tells whether the read filled all the space it was given (more data may be waiting).
+*/
+ssize_t read_buffer_fill(int sockfd, struct read_buffer *buffer, bool *full_read);
+/*
+    Takes the next complete frame off the buffer. The delimiter is replaced by '\0' in place, so the frame is
+    a valid C string that stays valid until the next read_buffer_fill. Returns false if no complete frame is buffered.
+*/
+bool read_buffer_next_frame(struct read_buffer *buffer, char **frame, size_t *length);
+// Bytes buffered but not handed out yet, for protocols that aren't newline-delimited. Valid until the next read_buffer_fill.
+size_t read_buffer_pending(const struct read_buffer *buffer, char **data);
+// Marks the first length pending bytes as handled.
+void read_buffer_consume(struct read_buffer *buffer, size_t length);
+void read_buffer_free(struct read_buffer *buffer);
+// Frees the buffer if nothing is pending, so idle connections don't hold one. The next read_buffer_fill takes a new one.
+void read_buffer_release_idle(struct read_buffer *buffer);
+
+#endif
@@ -0,0 +1,124 @@
+#include "history_block.h"
+#include "binary_protocol.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+/*
+    Built-in dictionary. deflate finds matches closest to the data most cheaply, so the most frequent strings come
+    last: common words first, then the pieces of every history row in the order they appear in it.
+*/
+static const char default_dictionary[] =
+    "the you and to is it that of in for on this what have with be not are was but just so can do my me your all "
+    "like know think will get about there they would how when out up if or we no yes ok okay lol thanks hello hi hey "
+    "T00:00:00.000Z"
+    "\",\"username\":\"bot\",\"message\":\"\"}\n"
+    "{\"id\":1,\"timestamp\":\"2025-01-01T12:00:00.000Z\",\"username\":\"user\",\"message\":\"";
+
+static char *dictionary = (char *)default_dictionary;
+static size_t dictionary_length = sizeof(default_dictionary) - 1;
+static uint32_t dictionary_id;
+
+int history_block_init(const char *path) {
+    if (path != NULL) {
+        FILE *file = fopen(path, "rb");
+        if (file == NULL) {
+            return -1;
+        }
+        // Only the last HISTORY_DICTIONARY_MAX bytes can be used, a longer file is cut at the front.
+        long size = (fseek(file, 0, SEEK_END) == 0) ? ftell(file) : -1;
+        char *loaded = (size > 0) ? malloc(HISTORY_DICTIONARY_MAX) : NULL;
+        size_t length = 0;
+        if (loaded != NULL && fseek(file, (size > HISTORY_DICTIONARY_MAX) ? size - HISTORY_DICTIONARY_MAX : 0, SEEK_SET) == 0) {
+            length = fread(loaded, 1, HISTORY_DICTIONARY_MAX, file);
+        }
+        fclose(file);
+        if (length == 0) {
+            free(loaded);
+            return -1;
+        }
+        dictionary = loaded;
+        dictionary_length = length;
+    }
+    dictionary_id = (uint32_t)adler32(adler32(0L, Z_NULL, 0), (const Bytef *)dictionary, (uInt)dictionary_length);
+    return 0;
+}
+/*
+    Compresses data into a new frame, leaving reserve bytes free in front of the stream for the caller's header.
+    *compressed is the length of the stream. Returns NULL if allocation or compression failed.
+*/
+static struct frame *compress_block(const char *data, size_t length, size_t reserve, size_t *compressed) {
+    // One compressor per thread, deflateInit is far too expensive to run per page.
+    static __thread z_stream *deflater;
+    if (deflater == NULL) {
+        if ((deflater = calloc(1, sizeof(z_stream))) == NULL) {
+            return NULL;
+        }
+        if (deflateInit2(deflater, Z_DEFAULT_COMPRESSION, Z_DEFLATED, MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            free(deflater);
+            deflater = NULL;
+            return NULL;
+        }
+    }
+    deflateReset(deflater);
+    if (deflateSetDictionary(deflater, (const Bytef *)dictionary, (uInt)dictionary_length) != Z_OK) {
+        return NULL;
+    }
+    size_t bound = deflateBound(deflater, length);
+    struct frame *frame = frame_alloc(reserve + bound);
+    if (frame == NULL) {
+        return NULL;
+    }
+    deflater->next_in = (Bytef *)data;
+    deflater->avail_in = (uInt)length;
+    deflater->next_out = (Bytef *)frame->data + reserve;
+    deflater->avail_out = (uInt)bound;
+    if (deflate(deflater, Z_FINISH) != Z_STREAM_END) {
+        frame_release(frame);
+        return NULL;
+    }
+    *compressed = bound - deflater->avail_out;
+    return frame;
+}
+struct frame *history_block_encode_lines(const struct frame *lines) {
+    size_t messages = 0;
+    for (const char *c = lines->data, *end = lines->data + lines->length; (c = memchr(c, '\n', end - c)) != NULL; c++) {
+        messages++;
+    }
+    // The header's length isn't known before compressing, reserve room for the longest one and move it up afterwards.
+    char header[160];
+    size_t compressed;
+    struct frame *frame = compress_block(lines->data, lines->length, sizeof(header), &compressed);
+    if (frame == NULL) {
+        return NULL;
+    }
+    int header_length = snprintf(header, sizeof(header),
+                                 "{\"history_block\":{\"encoding\":\"deflate\",\"dictionary\":%u,\"messages\":%zu,\"bytes\":%zu}}\n",
+                                 dictionary_id, messages, compressed);
+    memmove(frame->data + header_length, frame->data + sizeof(header), compressed);
+    memcpy(frame->data, header, header_length);
+    frame->length = header_length + compressed;
+    return frame;
+}
+struct frame *history_block_encode_binary(const struct frame *binary) {
+    size_t messages = 0;
+    for (size_t offset = 0; offset < binary->length; messages++) {
+        uint64_t length;
+        int used = varint_decode((const uint8_t *)binary->data + offset, binary->length - offset, &length);
+        if (used <= 0) {
+            break;
+        }
+        offset += used + length;
+    }
+    size_t compressed;
+    struct frame *stream = compress_block(binary->data, binary->length, 0, &compressed);
+    if (stream == NULL) {
+        return NULL;
+    }
+    struct binary_message block = {BINARY_HISTORY_BLOCK, HISTORY_BLOCK_DEFLATE, 0, dictionary_id, (int64_t)messages, 0,
+                                   "", 0, stream->data, compressed};
+    struct frame *frame = binary_encode_message(&block);
+    frame_release(stream);
+    return frame;
+}
@@ -0,0 +1,32 @@
+#ifndef HISTORY_BLOCK_H
+#define HISTORY_BLOCK_H
+
+#include "outbound.h"
+#include <stdint.h>
+
+#define HISTORY_BLOCK_MIN 512           // Pages shorter than this go out as they are, compressing them saves next to nothing
+#define HISTORY_DICTIONARY_MAX 32768    // Largest preset dictionary deflate can use (its window)
+
+/*
+    Compressed history replay, for clients that put "compress": "deflate" in their username handshake.
+    A history page is sent as one block: a zlib stream (RFC 1950) of exactly the bytes the page would have been
+    sent as otherwise, compressed with a preset dictionary of text that is frequent in chat history (the JSON keys
+    and the most common words). Clients pass the same dictionary to inflateSetDictionary when inflate asks for it,
+    the stream's DICTID (and the block header) carry its Adler-32 so a mismatch is noticed.
+
+    Newline-delimited clients get the block as a header line followed by the raw stream:
+        {"history_block":{"encoding":"deflate","dictionary":<adler32>,"messages":<count>,"bytes":<length>}}\n<length bytes>
+    Binary clients get one BINARY_HISTORY_BLOCK message (see binary_protocol.h) whose payload is the stream of the
+    page's binary messages. Browsers already compress every message with permessage-deflate and don't ask for blocks.
+
+    A block is a frame encoding (ENCODING_HISTORY_BLOCK) of the page, so every client sent the same page frame shares
+    one compression pass; the history ring hands out the same frame for the join page until a new message arrives.
+*/
+
+// Loads the dictionary from path, or uses the built-in one if path is NULL. Returns -1 if the file couldn't be read.
+int history_block_init(const char *path);
+// Encoders for frame_encoded(): compress a newline-delimited page, or one in binary messages, into a block.
+struct frame *history_block_encode_lines(const struct frame *lines);
+struct frame *history_block_encode_binary(const struct frame *binary);
+
+#endif
@@ -0,0 +1,122 @@
+#include "history_reader.h"
+#include "memory_pool.h"
+#include "metrics.h"
+#include "spsc_queue.h"
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+
+/*
+    - queues: One SPSC queue per shard, the reader thread is the only consumer of all of them.
+    - wake_fd: eventfd the shards write to after submitting a job.
+    - wake_pending: Set by the producer that wrote wake_fd, cleared by the reader before it drains.
+*/
+static struct spsc_queue *queues;
+static int num_queues;
+static int wake_fd;
+static atomic_bool wake_pending;
+static history_job_done job_done;
+static pthread_t reader;
+
+static void *history_reader(void *arg);
+
+void history_reader_init(int producers, history_job_done done) {
+    num_queues = producers;
+    job_done = done;
+    queues = calloc(producers, sizeof(struct spsc_queue));
+    if (queues == NULL || (wake_fd = eventfd(0, EFD_NONBLOCK)) < 0) {
+        perror("history_reader_init");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < producers; i++) {
+        if (spsc_init(&queues[i], HISTORY_READER_QUEUE_SIZE) != 0) {
+            perror("spsc_init");
+            exit(EXIT_FAILURE);
+        }
+    }
+    atomic_init(&wake_pending, false);
+    if (pthread_create(&reader, NULL, history_reader, NULL) != 0) {
+        perror("pthread_create");
+        exit(EXIT_FAILURE);
+    }
+}
+bool history_reader_submit(struct history_job *job) {
+    if (!spsc_push(&queues[job->producer], job)) {
+        return false;
+    }
+    if (!atomic_exchange(&wake_pending, true)) {
+        uint64_t one = 1;
+        if (write(wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            perror("eventfd write");
+        }
+    }
+    return true;
+}
+// Collects the rows of a page into one buffer, each followed by the frame delimiter.
+struct page_buffer {
+    char *data;
+    size_t length;
+    size_t capacity;
+    bool failed;
+};
+static void collect_row(void *context, const char *json, size_t length) {
+    struct page_buffer *page = context;
+    if (page->length + length + 1 > page->capacity) {
+        size_t capacity = (page->capacity > 0) ? page->capacity * 2 : 4096;
+        while (capacity < page->length + length + 1) {
+            capacity *= 2;
+        }
+        char *grown = realloc(page->data, capacity);
+        if (grown == NULL) {
+            page->failed = true;
+            return;
+        }
+        page->data = grown;
+        page->capacity = capacity;
+    }
+    memcpy(page->data + page->length, json, length);
+    page->data[page->length + length] = '\n';
+    page->length += length + 1;
+}
+static void read_page(struct history_job *job) {
+    uint64_t started = metrics_now();
+    struct page_buffer page = {NULL, 0, 0, false};
+    job->failed = !send_chat_history(&job->request, collect_row, &page) || page.failed;
+    job->page = NULL;
+    if (!job->failed && page.length > 0 && (job->page = frame_create(page.data, page.length)) == NULL) {
+        job->failed = true;
+    }
+    free(page.data);
+    metrics_record(STAGE_HISTORY, started);
+}
+static void *history_reader(void *arg) {
+    (void)arg;
+    if (memory_pool_thread_init() != 0) {
+        perror("memory_pool_thread_init");
+        exit(EXIT_FAILURE);
+    }
+    metrics_thread_init("history");
+    while (true) {
+        struct pollfd pfd = {wake_fd, POLLIN, 0};
+        poll(&pfd, 1, -1);
+        uint64_t count;
+        while (read(wake_fd, &count, sizeof(count)) < 0 && errno == EINTR) {
+        }
+        // Cleared before draining, so a job submitted meanwhile always results in another wakeup.
+        atomic_store(&wake_pending, false);
+
+        // Round robin, one page per shard at a time, so one shard scrolling back can't starve the others.
+        bool progress = true;
+        while (progress) {
+            progress = false;
+            for (int i = 0; i < num_queues; i++) {
+                struct history_job *job = spsc_pop(&queues[i]);
+                if (job != NULL) {
+                    read_page(job);
+                    job_done(job);
+                    progress = true;
+                }
+            }
+        }
+    }
+    return NULL;
+}
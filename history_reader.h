@@ -0,0 +1,39 @@
+#ifndef HISTORY_READER_H
+#define HISTORY_READER_H
+
+#include "database.h"
+#include "outbound.h"
+#include <stdint.h>
+
+#define HISTORY_READER_QUEUE_SIZE 1024 // History pages one shard can have waiting for the reader thread
+
+/*
+    History pages the in-memory ring doesn't cover are read from storage by a thread of its own, so a client
+    scrolling far back never holds up the shard it is on while the query waits for a pooled connection or the
+    database. A shard submits a job and goes on with its clients, the reader runs the query, collects the rows
+    into one page frame and hands the finished job back through the done callback.
+    - producer: The shard that submitted the job, each one has its own queue to the reader.
+    - client/connection: Who asked, opaque to the reader. The shard checks the connection is still the same
+      before it sends the page, the client's slot may have been reused meanwhile.
+    - request: The page asked for.
+    - page: The rows, newline-delimited and oldest first, NULL if there are none. Set by the reader.
+    - failed: Set by the reader if the query failed.
+*/
+struct history_job {
+    int producer;
+    void *client;
+    uint64_t connection;
+    struct history_request request;
+    struct frame *page;
+    bool failed;
+};
+
+// Called on the reader thread with every finished job, in the order each producer submitted them.
+typedef void (*history_job_done)(struct history_job *job);
+
+// Starts the reader thread. producers is the number of shards, each gets its own single-producer queue.
+void history_reader_init(int producers, history_job_done done);
+// Queues a job, called from the shard that owns it. Returns false if the queue is full, the job isn't taken then.
+bool history_reader_submit(struct history_job *job);
+
+#endif
@@ -0,0 +1,183 @@
+#include "history_ring.h"
+
+int history_ring_init(struct history_ring *ring, size_t bytes, size_t entries) {
+    memset(ring, 0, sizeof(*ring));
+    ring->data = malloc(bytes);
+    ring->entries = calloc(entries, sizeof(struct ring_entry));
+    if (ring->data == NULL || ring->entries == NULL) {
+        free(ring->data);
+        free(ring->entries);
+        return -1;
+    }
+    pthread_mutex_init(&ring->lock, NULL);
+    ring->capacity = bytes;
+    ring->max_entries = entries;
+    ring->next_id = 1;
+    ring->complete = true;
+    return 0;
+}
+static struct ring_entry *entry_at(struct history_ring *ring, uint64_t index) {
+    return &ring->entries[index % ring->max_entries];
+}
+// Copies bytes into the byte ring at the write position, splitting the copy where the ring wraps.
+static void write_bytes(struct history_ring *ring, const char *bytes, size_t length) {
+    size_t offset = ring->write_position % ring->capacity;
+    size_t first_part = (length < ring->capacity - offset) ? length : ring->capacity - offset;
+    memcpy(ring->data + offset, bytes, first_part);
+    memcpy(ring->data, bytes + first_part, length - first_part);
+    ring->write_position += length;
+}
+// Copies stored bytes out of the ring, the counterpart of write_bytes.
+static void read_bytes(struct history_ring *ring, uint64_t position, char *out, size_t length) {
+    size_t offset = position % ring->capacity;
+    size_t first_part = (length < ring->capacity - offset) ? length : ring->capacity - offset;
+    memcpy(out, ring->data + offset, first_part);
+    memcpy(out + first_part, ring->data, length - first_part);
+}
+// Evicts the oldest entries until a message of the given length and one more index slot fit. Lock held.
+static void make_room(struct history_ring *ring, size_t length) {
+    while (ring->count > 0 && (ring->count == ring->max_entries ||
+                               ring->write_position + length - entry_at(ring, ring->first)->position > ring->capacity)) {
+        ring->first++;
+        ring->count--;
+        ring->complete = false;
+    }
+}
+// Stores the pieces of one line as a new entry. Lock held, the total length must fit in the ring.
+static void store(struct history_ring *ring, long long id, const char *parts[], const size_t lengths[], int num_parts, size_t length) {
+    make_room(ring, length);
+    struct ring_entry *entry = entry_at(ring, ring->first + ring->count);
+    entry->id = id;
+    entry->position = ring->write_position;
+    entry->length = length;
+    for (int i = 0; i < num_parts; i++) {
+        write_bytes(ring, parts[i], lengths[i]);
+    }
+    ring->count++;
+}
+void history_ring_load(struct history_ring *ring, long long id, const char *json, size_t length) {
+    const char *parts[2] = {json, "\n"};
+    size_t lengths[2] = {length, 1};
+    pthread_mutex_lock(&ring->lock);
+    if (length + 1 <= ring->capacity) {
+        store(ring, id, parts, lengths, 2, length + 1);
+    }
+    if (id >= ring->next_id) {
+        ring->next_id = id + 1;
+    }
+    pthread_mutex_unlock(&ring->lock);
+}
+void history_ring_loaded(struct history_ring *ring, bool everything) {
+    pthread_mutex_lock(&ring->lock);
+    ring->complete = ring->complete && everything;
+    pthread_mutex_unlock(&ring->lock);
+}
+struct frame *history_ring_append(struct history_ring *ring, const char *body, size_t body_length, long long *id) {
+    char prefix[32];
+    pthread_mutex_lock(&ring->lock);
+    // The id is taken under the lock that also orders the ring, so ring order and id order always agree.
+    long long new_id = (*id == 0) ? ring->next_id : *id;
+    if (new_id < ring->next_id) {
+        pthread_mutex_unlock(&ring->lock);
+        return NULL;
+    }
+    int prefix_length = snprintf(prefix, sizeof(prefix), "{\"id\":%lld,", new_id);
+    const char *parts[3] = {prefix, body, "\n"};
+    size_t lengths[3] = {(size_t)prefix_length, body_length, 1};
+    size_t length = prefix_length + body_length + 1;
+
+    // The id and the entry are only taken once the frame exists, a message that can't be sent mustn't be replayed.
+    struct frame *frame = frame_alloc(length);
+    if (frame == NULL) {
+        pthread_mutex_unlock(&ring->lock);
+        return NULL;
+    }
+    char *out = frame->data;
+    for (int i = 0; i < 3; i++) {
+        memcpy(out, parts[i], lengths[i]);
+        out += lengths[i];
+    }
+    *id = new_id;
+    ring->next_id = new_id + 1;
+    if (length <= ring->capacity) {
+        store(ring, *id, parts, lengths, 3, length);
+    } else {
+        // Too large to keep in memory, older pages come from the database from here on.
+        make_room(ring, ring->capacity);
+    }
+    pthread_mutex_unlock(&ring->lock);
+    return frame;
+}
+// Index of the first entry whose id is greater than id. Lock held.
+static uint64_t first_after(struct history_ring *ring, long long id) {
+    uint64_t low = ring->first, high = ring->first + ring->count;
+    while (low < high) {
+        uint64_t middle = low + (high - low) / 2;
+        if (entry_at(ring, middle)->id <= id) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+bool history_ring_replay(struct history_ring *ring, const struct history_request *request, struct frame **frame) {
+    pthread_mutex_lock(&ring->lock);
+    uint64_t begin = ring->first, end = ring->first + ring->count; // The page is [begin, end)
+    long long oldest = (ring->count > 0) ? entry_at(ring, ring->first)->id : ring->next_id;
+    bool served = true;
+
+    switch (request->mode) {
+    case HISTORY_BEFORE:
+        end = first_after(ring, request->id - 1);
+        if (end - ring->first >= (uint64_t)request->limit) {
+            begin = end - request->limit;
+        } else if (!ring->complete) { // Part of the page is older than the ring
+            served = false;
+        }
+        break;
+    case HISTORY_AFTER:
+        if (request->id + 1 < oldest && !ring->complete) { // Messages right after id were already evicted
+            served = false;
+        }
+        begin = first_after(ring, request->id);
+        if (end - begin > (uint64_t)request->limit) {
+            end = begin + request->limit;
+        }
+        break;
+    default:
+        if (end - begin < (uint64_t)request->limit && !ring->complete) {
+            served = false;
+        } else if (end - begin > (uint64_t)request->limit) {
+            begin = end - request->limit;
+        }
+        break;
+    }
+
+    *frame = NULL;
+    bool newest = (request->mode == HISTORY_LAST && served);
+    if (newest && ring->last_page != NULL && ring->last_page_limit == request->limit && ring->last_page_id == ring->next_id) {
+        frame_retain(ring->last_page);
+        *frame = ring->last_page;
+    } else if (served && begin < end) {
+        // The page is one contiguous run of the byte ring, copy it out in one go.
+        struct ring_entry *last = entry_at(ring, end - 1);
+        uint64_t position = entry_at(ring, begin)->position;
+        size_t length = last->position + last->length - position;
+        *frame = frame_alloc(length);
+        if (*frame != NULL) {
+            read_bytes(ring, position, (*frame)->data, length);
+            if (newest) {
+                if (ring->last_page != NULL) {
+                    frame_release(ring->last_page);
+                }
+                frame_retain(*frame);
+                ring->last_page = *frame;
+                ring->last_page_limit = request->limit;
+                ring->last_page_id = ring->next_id;
+            }
+        }
+    }
+    pthread_mutex_unlock(&ring->lock);
+    return served;
+}
@@ -0,0 +1,67 @@
+#ifndef HISTORY_RING_H
+#define HISTORY_RING_H
+
+#include "database.h"
+#include "outbound.h"
+#include <stdint.h>
+
+#define HISTORY_RING_ENTRIES 1024        // Most recent messages kept in memory
+#define HISTORY_RING_BYTES (1024 * 1024) // Bytes of encoded messages kept in memory
+
+/*
+    The most recent messages of a room, kept already encoded (one JSON line each, frame delimiter included)
+    back to back in one byte ring. Replaying the newest N messages is therefore one or two memcpy's of
+    contiguous memory into a single frame, no database round trip and no per-message work.
+    The ring is also where message ids are handed out, so the ring order and the id order are the same.
+    - data/capacity: The byte ring. Positions are counted from the start and never wrap, the slot is position % capacity.
+    - entries/max_entries: Index ring with the id, position and length of every stored message, oldest first.
+    - first/count: Index (never wrapping) of the oldest entry and the number of entries.
+    - write_position: Where the next message goes.
+    - next_id: Id given to the next appended message.
+    - complete: True while the ring holds every message there is (nothing was ever evicted and the
+      database had no more at startup), so requests reaching past the oldest entry don't need the database.
+    - last_page/last_page_limit/last_page_id: The newest HISTORY_LAST page handed out, its limit and the next_id it
+      was built at. Joins until the next message get this same frame, and with it its encodings (see history_block.h).
+*/
+struct ring_entry {
+    long long id;
+    uint64_t position;
+    size_t length;
+};
+struct history_ring {
+    pthread_mutex_t lock;
+    char *data;
+    size_t capacity;
+    struct ring_entry *entries;
+    size_t max_entries;
+    uint64_t first;
+    uint64_t count;
+    uint64_t write_position;
+    long long next_id;
+    bool complete;
+    struct frame *last_page;
+    int last_page_limit;
+    long long last_page_id;
+};
+
+int history_ring_init(struct history_ring *ring, size_t bytes, size_t entries); // returns 0 on success, -1 if allocation failed
+// Startup: stores a message read from the database (a JSON object without delimiter), oldest first.
+void history_ring_load(struct history_ring *ring, long long id, const char *json, size_t length);
+// Startup: called after loading, with whether the database returned fewer messages than the ring can hold.
+void history_ring_loaded(struct history_ring *ring, bool everything);
+/*
+    Gives a new message the next id and stores it. body is the encoded message without its opening '{',
+    the ring writes {"id":<id>, in front of it and the delimiter after it.
+    Returns a frame with the stored line, ready to broadcast, and the id in *id. Returns NULL without taking an
+    id or storing anything if the frame couldn't be allocated.
+    In a federation the relay hub hands out ids instead (see relay.h): a non-zero *id is used as the message's id,
+    ids continue from there, and NULL is returned if it isn't newer than every id the ring has seen.
+*/
+struct frame *history_ring_append(struct history_ring *ring, const char *body, size_t body_length, long long *id);
+/*
+    Answers a history page from memory. Returns false if the page reaches past what the ring holds, the
+    caller then has to ask the database. On true, *frame is the whole page in one frame, or NULL if the page is empty.
+*/
+bool history_ring_replay(struct history_ring *ring, const struct history_request *request, struct frame **frame);
+
+#endif
@@ -0,0 +1,192 @@
+#include "memory_pool.h"
+#include <cJSON.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define MAX_POOL_THREADS 128 // Threads whose counters alloc_stats_total can see
+#define ARENA_ALIGN 16       // Alignment of every arena block, enough for any type cJSON stores
+
+// One block of arena memory, chunks of a scope that outgrew the first one are chained to it through prev.
+struct arena_chunk {
+    struct arena_chunk *prev;
+    size_t size;
+    size_t used;
+    _Alignas(ARENA_ALIGN) char data[];
+};
+// A free slab block, the link lives in the block itself.
+struct slab_block {
+    struct slab_block *next;
+};
+/*
+    Everything one thread allocates from.
+    - chunk: Newest arena chunk, the oldest one is kept across scopes so a scope normally costs no malloc.
+    - depth: Open arena scopes, cJSON only allocates from the arena while it is above 0.
+    - free_lists, free_counts: Recycled slab blocks per size class.
+*/
+struct thread_pool {
+    struct arena_chunk *chunk;
+    int depth;
+    struct slab_block *free_lists[SLAB_CLASSES];
+    int free_counts[SLAB_CLASSES];
+    struct alloc_stats stats;
+};
+
+static __thread struct thread_pool *self;
+static struct thread_pool *threads[MAX_POOL_THREADS];
+static int thread_count;
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void count(atomic_ullong *counter) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + 1, memory_order_relaxed);
+}
+static struct arena_chunk *chunk_create(struct arena_chunk *prev, size_t size) {
+    struct arena_chunk *chunk = malloc(sizeof(struct arena_chunk) + size);
+    if (chunk != NULL) {
+        chunk->prev = prev;
+        chunk->size = size;
+        chunk->used = 0;
+    }
+    return chunk;
+}
+static void *arena_alloc(struct thread_pool *pool, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    struct arena_chunk *chunk = pool->chunk;
+    if (chunk->size - chunk->used < size) {
+        if ((chunk = chunk_create(chunk, (size > ARENA_CHUNK_SIZE) ? size : ARENA_CHUNK_SIZE)) == NULL) {
+            return NULL;
+        }
+        count(&pool->stats.heap_allocations);
+        pool->chunk = chunk;
+    }
+    void *block = chunk->data + chunk->used;
+    chunk->used += size;
+    count(&pool->stats.arena_allocations);
+    return block;
+}
+static int arena_owns(const struct thread_pool *pool, const void *block) {
+    for (const struct arena_chunk *chunk = pool->chunk; chunk != NULL; chunk = chunk->prev) {
+        if ((const char *)block >= chunk->data && (const char *)block < chunk->data + chunk->size) {
+            return 1;
+        }
+    }
+    return 0;
+}
+static void *hook_malloc(size_t size) {
+    struct thread_pool *pool = self;
+    if (pool != NULL && pool->depth > 0) {
+        return arena_alloc(pool, size);
+    }
+    if (pool != NULL) {
+        count(&pool->stats.heap_allocations);
+    }
+    return malloc(size);
+}
+static void hook_free(void *block) {
+    // Arena blocks are reclaimed by arena_end, including ones freed after their scope's inner scopes ended.
+    if (block != NULL && (self == NULL || !arena_owns(self, block))) {
+        free(block);
+    }
+}
+void memory_pool_init(void) {
+    cJSON_Hooks hooks = {hook_malloc, hook_free};
+    cJSON_InitHooks(&hooks);
+}
+int memory_pool_thread_init(void) {
+    struct thread_pool *pool = calloc(1, sizeof(struct thread_pool));
+    if (pool == NULL || (pool->chunk = chunk_create(NULL, ARENA_CHUNK_SIZE)) == NULL) {
+        free(pool);
+        return -1;
+    }
+    pthread_mutex_lock(&threads_lock);
+    if (thread_count < MAX_POOL_THREADS) {
+        threads[thread_count++] = pool;
+    }
+    pthread_mutex_unlock(&threads_lock);
+    self = pool;
+    return 0;
+}
+struct arena_mark arena_begin(void) {
+    struct arena_mark mark = {NULL, 0};
+    if (self != NULL) {
+        self->depth++;
+        mark.chunk = self->chunk;
+        mark.used = self->chunk->used;
+    }
+    return mark;
+}
+void arena_end(struct arena_mark mark) {
+    struct thread_pool *pool = self;
+    if (pool == NULL) {
+        return;
+    }
+    // Chunks the scope added go back to malloc, the one it started in is rewound.
+    while (pool->chunk != mark.chunk) {
+        struct arena_chunk *chunk = pool->chunk;
+        pool->chunk = chunk->prev;
+        free(chunk);
+    }
+    pool->chunk->used = mark.used;
+    pool->depth--;
+}
+// Index of the smallest class that holds size bytes, SLAB_CLASSES if it is bigger than every class.
+static int slab_class(size_t size) {
+    int class = 0;
+    for (size_t class_size = SLAB_MIN_SIZE; class_size < size; class_size <<= 1) {
+        if (++class == SLAB_CLASSES) {
+            break;
+        }
+    }
+    return class;
+}
+void *slab_alloc(size_t size) {
+    struct thread_pool *pool = self;
+    int class = slab_class(size);
+    if (pool != NULL && class < SLAB_CLASSES && pool->free_lists[class] != NULL) {
+        struct slab_block *block = pool->free_lists[class];
+        pool->free_lists[class] = block->next;
+        pool->free_counts[class]--;
+        count(&pool->stats.slab_hits);
+        return block;
+    }
+    if (pool != NULL) {
+        count(&pool->stats.heap_allocations);
+    }
+    // Always the full class size, even on threads without lists: the block may be freed into one elsewhere.
+    return malloc((class < SLAB_CLASSES) ? (size_t)SLAB_MIN_SIZE << class : size);
+}
+void slab_free(void *block, size_t size) {
+    struct thread_pool *pool = self;
+    int class = slab_class(size);
+    if (block == NULL) {
+        return;
+    }
+    if (class == SLAB_CLASSES || pool == NULL || pool->free_counts[class] == SLAB_CACHE_LIMIT) {
+        free(block);
+        return;
+    }
+    struct slab_block *free_block = block;
+    free_block->next = pool->free_lists[class];
+    pool->free_lists[class] = free_block;
+    pool->free_counts[class]++;
+}
+void alloc_stats_message(void) {
+    if (self != NULL) {
+        count(&self->stats.messages);
+    }
+}
+void alloc_stats_total(struct alloc_stats *total) {
+    unsigned long long messages = 0, heap = 0, arena = 0, hits = 0;
+    pthread_mutex_lock(&threads_lock);
+    for (int i = 0; i < thread_count; i++) {
+        messages += atomic_load_explicit(&threads[i]->stats.messages, memory_order_relaxed);
+        heap += atomic_load_explicit(&threads[i]->stats.heap_allocations, memory_order_relaxed);
+        arena += atomic_load_explicit(&threads[i]->stats.arena_allocations, memory_order_relaxed);
+        hits += atomic_load_explicit(&threads[i]->stats.slab_hits, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&threads_lock);
+    atomic_init(&total->messages, messages);
+    atomic_init(&total->heap_allocations, heap);
+    atomic_init(&total->arena_allocations, arena);
+    atomic_init(&total->slab_hits, hits);
+}
@@ -0,0 +1,61 @@
+#ifndef MEMORY_POOL_H
+#define MEMORY_POOL_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+/*
+    Allocation on the per-message path without going through malloc for every object.
+    - Arena: Every reactor thread owns a bump allocator that cJSON allocates from (installed with cJSON_InitHooks)
+      while the thread is inside an arena scope. Freeing an arena block does nothing, the scope's end hands
+      everything back at once. Outside a scope, and on threads without an arena, cJSON uses malloc as before.
+    - Slabs: Blocks of a few fixed sizes (frames, read buffers, outbound rings) are recycled through a free list
+      per thread and size class. A block may be freed on another thread than the one that allocated it, it then
+      joins the freeing thread's list. Each list holds at most SLAB_CACHE_LIMIT blocks, the rest go back to free().
+*/
+#define ARENA_CHUNK_SIZE (64 * 1024) // Bytes an arena allocates at a time, a bigger request gets a chunk of its own
+#define SLAB_MIN_SIZE 64             // Smallest size class, each next class is twice as big
+#define SLAB_CLASSES 7               // 64 bytes up to SLAB_MAX_SIZE
+#define SLAB_MAX_SIZE (SLAB_MIN_SIZE << (SLAB_CLASSES - 1))
+#define SLAB_CACHE_LIMIT 256         // Free blocks a thread keeps per size class
+
+/*
+    Allocation counters of one thread, only written by that thread. They are atomics so other threads may read
+    them while they change, updates are plain relaxed loads and stores without a locked instruction.
+    - messages: Client messages handled, what the others are divided by.
+    - heap_allocations: Blocks taken from malloc (arena chunks, slab misses, blocks too big for a slab, cJSON outside a scope).
+    - arena_allocations: Blocks handed out by the arena.
+    - slab_hits: Blocks reused from a slab free list.
+*/
+struct alloc_stats {
+    atomic_ullong messages;
+    atomic_ullong heap_allocations;
+    atomic_ullong arena_allocations;
+    atomic_ullong slab_hits;
+};
+
+// Where an arena scope started, returned by arena_begin and given back to arena_end.
+struct arena_mark {
+    void *chunk;
+    size_t used;
+};
+
+void memory_pool_init(void);        // installs the cJSON hooks, call before anything uses cJSON
+int memory_pool_thread_init(void);  // gives the calling thread an arena and slab lists, returns -1 if allocation failed
+
+/*
+    cJSON objects created between arena_begin and the matching arena_end come from the calling thread's arena
+    and are gone after arena_end, so nothing may keep them past it. Scopes nest.
+*/
+struct arena_mark arena_begin(void);
+void arena_end(struct arena_mark mark);
+
+// Allocates at least size bytes, from the calling thread's slab list when size fits a class. NULL if allocation failed.
+void *slab_alloc(size_t size);
+// Returns a block from slab_alloc, size must be what it was asked for.
+void slab_free(void *block, size_t size);
+
+void alloc_stats_message(void);                  // counts one handled message on the calling thread
+void alloc_stats_total(struct alloc_stats *total); // sums the counters of every thread
+
+#endif
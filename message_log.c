@@ -0,0 +1,547 @@
+#include "message_log.h"
+#include "storage.h"
+#include <dirent.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <zlib.h>
+
+#define LOG_ALIGN 8                 // Alignment of every record in a segment
+#define LOG_SEGMENT_SUFFIX ".log"   // Segment files are <first id, 20 digits>.log
+#define LOG_USERNAMES "usernames.log"
+
+/*
+    One segment file, mapped for its whole size.
+    - first_id: Its file name, the id of its first record.
+    - end: Bytes holding records. Readers never look past it, the appending thread writes past it and then moves it.
+    - last_ms: stored_ms of its newest record, the retention job drops the segment once that expired.
+*/
+struct log_segment {
+    long long first_id;
+    int fd;
+    char *map;
+    size_t end;
+    long long last_ms;
+};
+/*
+    Entry of the sparse index.
+    - max_id: Highest id of this record and every record before it. Ids are appended in increasing order, except for
+      a message whose shard handed it to the writer thread after a newer one was already stored, so seeks go by this.
+    - ordinal: Number of the record, counted from the first record the log ever had.
+    - segment/offset: Where the record is, segment is a position in segments.
+*/
+struct index_entry {
+    long long max_id;
+    long long ordinal;
+    int segment;
+    size_t offset;
+};
+struct log_cursor {
+    int segment;
+    size_t offset;
+};
+
+/*
+    - lock: Guards the segment list, the index and every segment's end. Readers hold it while they stream a page,
+      the appending thread only takes it to publish records it already wrote, and the retention job to drop segments.
+    - append_lock: Serializes the writer thread's appends against the retention job, which changes the segment list
+      appends read without lock. synced and last_checksum belong to it.
+    - first_ordinal/next_ordinal: The log holds records [first_ordinal, next_ordinal).
+*/
+static char directory[PATH_MAX];
+static struct log_segment **segments;
+static int segment_count;
+static int segment_capacity;
+static struct index_entry *entries;
+static size_t entry_count;
+static size_t entry_capacity;
+static long long first_ordinal;
+static long long next_ordinal;
+static long long max_id;
+static pthread_rwlock_t lock;
+static pthread_mutex_t append_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t synced;
+static uint32_t last_checksum; // Checksum of the newest record in the newest segment, the next one continues it
+static int usernames_fd = -1;
+static int retention_days;
+static bool archive_expired;
+
+static size_t record_size(uint32_t length) {
+    return (sizeof(struct log_record) + length + LOG_ALIGN - 1) & ~(size_t)(LOG_ALIGN - 1);
+}
+static uint32_t record_checksum(const struct log_record *record, uint32_t previous) {
+    uLong crc = crc32(previous, (const Bytef *)&record->id, sizeof(record->id) + sizeof(record->stored_ms));
+    return (uint32_t)crc32(crc, (const Bytef *)record->json, record->length);
+}
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+static void segment_path(char *path, size_t size, long long first_id) {
+    snprintf(path, size, "%s/%020lld%s", directory, first_id, LOG_SEGMENT_SUFFIX);
+}
+// Opens (or creates) the segment file starting at first_id and maps it. Returns NULL if that failed.
+static struct log_segment *segment_open(long long first_id) {
+    char path[PATH_MAX + 32];
+    segment_path(path, sizeof(path), first_id);
+    struct log_segment *segment = calloc(1, sizeof(struct log_segment));
+    if (segment == NULL) {
+        return NULL;
+    }
+    segment->first_id = first_id;
+    if ((segment->fd = open(path, O_RDWR | O_CREAT, 0644)) < 0 || ftruncate(segment->fd, LOG_SEGMENT_SIZE) != 0) {
+        fprintf(stderr, "Failed to open log segment %s: %s\n", path, strerror(errno));
+        if (segment->fd >= 0) {
+            close(segment->fd);
+        }
+        free(segment);
+        return NULL;
+    }
+    segment->map = mmap(NULL, LOG_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, segment->fd, 0);
+    if (segment->map == MAP_FAILED) {
+        fprintf(stderr, "Failed to map log segment %s: %s\n", path, strerror(errno));
+        close(segment->fd);
+        free(segment);
+        return NULL;
+    }
+    return segment;
+}
+static void segment_close(struct log_segment *segment) {
+    munmap(segment->map, LOG_SEGMENT_SIZE);
+    close(segment->fd);
+    free(segment);
+}
+// Makes room for one more segment and one more index entry.
+static bool reserve(void) {
+    if (segment_count == segment_capacity) {
+        int capacity = segment_capacity ? segment_capacity * 2 : 16;
+        struct log_segment **grown = realloc(segments, capacity * sizeof(struct log_segment *));
+        if (grown == NULL) {
+            return false;
+        }
+        segments = grown;
+        segment_capacity = capacity;
+    }
+    if (entry_count == entry_capacity) {
+        size_t capacity = entry_capacity ? entry_capacity * 2 : 1024;
+        struct index_entry *grown = realloc(entries, capacity * sizeof(struct index_entry));
+        if (grown == NULL) {
+            return false;
+        }
+        entries = grown;
+        entry_capacity = capacity;
+    }
+    return true;
+}
+// Accounts for a record that was written at offset of the newest segment, under the write lock (or before there are readers).
+static void publish(const struct log_record *record, size_t offset) {
+    struct log_segment *segment = segments[segment_count - 1];
+    if (record->id > max_id) {
+        max_id = record->id;
+    }
+    if (offset == 0 || next_ordinal % LOG_INDEX_INTERVAL == 0) {
+        entries[entry_count++] = (struct index_entry){max_id, next_ordinal, segment_count - 1, offset};
+    }
+    next_ordinal++;
+    segment->end = offset + record_size(record->length);
+    segment->last_ms = record->stored_ms;
+}
+// Reads the records of a segment found at startup, up to the first one that is missing or torn, and leaves the
+// checksum of the last one in chain. Returns false if it has none.
+static bool segment_recover(struct log_segment *segment, uint32_t *chain) {
+    size_t offset = 0;
+    uint32_t last = 0;
+    while (offset + sizeof(struct log_record) <= LOG_SEGMENT_SIZE) {
+        const struct log_record *record = (const struct log_record *)(segment->map + offset);
+        if (record->length == 0 || offset + record_size(record->length) > LOG_SEGMENT_SIZE ||
+            record_checksum(record, last) != record->checksum) {
+            break;
+        }
+        if (!reserve()) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        publish(record, offset);
+        last = record->checksum;
+        offset += record_size(record->length);
+    }
+    // Whatever a crash left behind the end fails the checksum chain anyway, it is cleared so the next start finds a clean end.
+    size_t torn = offset;
+    while (torn + sizeof(struct log_record) <= LOG_SEGMENT_SIZE) {
+        uint32_t length = ((const struct log_record *)(segment->map + torn))->length;
+        if (length == 0 || torn + record_size(length) > LOG_SEGMENT_SIZE) {
+            break;
+        }
+        torn += record_size(length);
+    }
+    if (torn > offset) {
+        fprintf(stderr, "Log segment %020lld ends in a torn record, clearing %zu byte(s)\n", segment->first_id, torn - offset);
+        memset(segment->map + offset, 0, torn - offset);
+        msync(segment->map, torn, MS_SYNC);
+    }
+    *chain = last;
+    return offset > 0;
+}
+static int segment_name_filter(const struct dirent *entry) {
+    size_t length = strlen(entry->d_name);
+    return length == 20 + strlen(LOG_SEGMENT_SUFFIX) && strcmp(entry->d_name + 20, LOG_SEGMENT_SUFFIX) == 0 &&
+           strspn(entry->d_name, "0123456789") == 20;
+}
+static void log_open(int pool_size, const char *path) {
+    (void)pool_size;
+    snprintf(directory, sizeof(directory), "%s", path);
+    if (mkdir(directory, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Failed to create log directory %s: %s\n", directory, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    // Appends get the lock ahead of readers waiting for it, a stream of history pages can't hold the writer back.
+    pthread_rwlockattr_t attributes;
+    pthread_rwlockattr_init(&attributes);
+    pthread_rwlockattr_setkind_np(&attributes, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&lock, &attributes);
+    pthread_rwlockattr_destroy(&attributes);
+
+    // Zero-padded names sort in id order.
+    struct dirent **names;
+    int count = scandir(directory, &names, segment_name_filter, alphasort);
+    if (count < 0) {
+        fprintf(stderr, "Failed to read log directory %s: %s\n", directory, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < count; i++) {
+        long long first_id = strtoll(names[i]->d_name, NULL, 10);
+        free(names[i]);
+        struct log_segment *segment = segment_open(first_id);
+        if (segment == NULL || !reserve()) {
+            exit(EXIT_FAILURE);
+        }
+        segments[segment_count++] = segment;
+        uint32_t chain;
+        if (segment_recover(segment, &chain)) {
+            last_checksum = chain;
+        } else {
+            // Nothing in it survived, the next append starts a segment of its own.
+            char file[PATH_MAX + 32];
+            segment_path(file, sizeof(file), first_id);
+            segment_close(segments[--segment_count]);
+            unlink(file);
+        }
+    }
+    free(names);
+    if (segment_count > 0) {
+        synced = segments[segment_count - 1]->end;
+    }
+
+    char file[PATH_MAX + 32];
+    snprintf(file, sizeof(file), "%s/%s", directory, LOG_USERNAMES);
+    if ((usernames_fd = open(file, O_RDWR | O_CREAT | O_APPEND, 0644)) < 0) {
+        fprintf(stderr, "Failed to open %s: %s\n", file, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    printf("Opened the message log in %s: %d segment(s), %lld message(s)\n", directory, segment_count, next_ordinal - first_ordinal);
+}
+// Writes the part of the newest segment that isn't on disk yet. Called with append_lock held.
+static void sync_segment(void) {
+    if (segment_count == 0) {
+        return;
+    }
+    struct log_segment *segment = segments[segment_count - 1];
+    long page = sysconf(_SC_PAGESIZE);
+    size_t from = synced & ~(size_t)(page - 1);
+    if (segment->end > synced && msync(segment->map + from, segment->end - from, MS_SYNC) != 0) {
+        perror("msync");
+    }
+    synced = segment->end;
+}
+// Appends one message, the caller syncs. Called with append_lock held. Returns false if it couldn't be stored.
+static bool append(long long id, const char *time, const char *username, const char *message) {
+    cJSON *message_obj = cJSON_CreateObject();
+    cJSON_AddNumberToObject(message_obj, "id", (double)id);
+    cJSON_AddStringToObject(message_obj, "timestamp", time);
+    cJSON_AddStringToObject(message_obj, "username", username);
+    cJSON_AddStringToObject(message_obj, "message", message);
+    char *json_str = cJSON_PrintUnformatted(message_obj);
+    cJSON_Delete(message_obj);
+    if (json_str == NULL) {
+        return false;
+    }
+    size_t length = strlen(json_str);
+    size_t size = record_size(length);
+    if (size > LOG_SEGMENT_SIZE) {
+        cJSON_free(json_str);
+        return false;
+    }
+
+    // The newest segment is only written by the appending thread past its end, no lock needed for that.
+    struct log_segment *segment = (segment_count > 0) ? segments[segment_count - 1] : NULL;
+    bool rotate = (segment == NULL || segment->end + size > LOG_SEGMENT_SIZE);
+    size_t offset = 0;
+    if (rotate) {
+        sync_segment(); // Everything before the new segment is on disk once it exists
+        // Named after its first id, unless that message arrived late: names have to sort in log order.
+        if ((segment = segment_open((id > max_id) ? id : max_id + 1)) == NULL) {
+            cJSON_free(json_str);
+            return false;
+        }
+    } else {
+        offset = segment->end;
+    }
+    struct log_record *record = (struct log_record *)(segment->map + offset);
+    record->id = id;
+    record->stored_ms = now_ms();
+    memcpy(record->json, json_str, length);
+    record->length = (uint32_t)length;
+    record->checksum = record_checksum(record, rotate ? 0 : last_checksum);
+    cJSON_free(json_str);
+
+    // The arrays only grow under the write lock, readers hold pointers into them.
+    pthread_rwlock_wrlock(&lock);
+    bool reserved = reserve();
+    if (reserved) {
+        if (rotate) {
+            segments[segment_count++] = segment;
+            synced = 0;
+        }
+        publish(record, offset);
+        last_checksum = record->checksum;
+    }
+    pthread_rwlock_unlock(&lock);
+    if (!reserved && rotate) {
+        char file[PATH_MAX + 32];
+        segment_path(file, sizeof(file), segment->first_id);
+        segment_close(segment);
+        unlink(file);
+    }
+    return reserved;
+}
+static void log_insert_message(long long id, const char *room, const char *time, const char *username, const char *message) {
+    (void)room;
+    pthread_mutex_lock(&append_lock);
+    if (!append(id, time, username, message)) {
+        fprintf(stderr, "Failed to append message %lld to the log\n", id);
+    }
+    sync_segment();
+    pthread_mutex_unlock(&append_lock);
+}
+static int compare_ids(const void *a, const void *b) {
+    long long x = (*(const struct stored_message **)a)->id, y = (*(const struct stored_message **)b)->id;
+    return (x > y) - (x < y);
+}
+// Appends a batch in id order and syncs it once, the log's version of one transaction.
+static bool log_insert_messages(const struct stored_message **messages, int count) {
+    // The writer thread collects from every shard in turn, sorting puts the batch back in id order.
+    qsort(messages, count, sizeof(struct stored_message *), compare_ids);
+    pthread_mutex_lock(&append_lock);
+    for (int i = 0; i < count; i++) {
+        if (!append(messages[i]->id, messages[i]->timestamp, messages[i]->username, messages[i]->content)) {
+            fprintf(stderr, "Failed to append message %lld to the log\n", messages[i]->id);
+        }
+    }
+    sync_segment();
+    pthread_mutex_unlock(&append_lock);
+    // A message that couldn't be appended would fail again on its own, retrying the batch would store the others twice.
+    return true;
+}
+// Index of the entry a seek starts from: the last one whose key is below the target, or the first one.
+static size_t index_seek(long long key, bool by_ordinal) {
+    size_t low = 0, high = entry_count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if ((by_ordinal ? entries[middle].ordinal <= key : entries[middle].max_id < key)) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return (low > 0) ? low - 1 : 0;
+}
+static const struct log_record *cursor_record(const struct log_cursor *cursor) {
+    struct log_segment *segment = segments[cursor->segment];
+    return (cursor->offset < segment->end) ? (const struct log_record *)(segment->map + cursor->offset) : NULL;
+}
+static void cursor_next(struct log_cursor *cursor) {
+    cursor->offset += record_size(cursor_record(cursor)->length);
+    if (cursor->offset >= segments[cursor->segment]->end && cursor->segment + 1 < segment_count) {
+        cursor->segment++;
+        cursor->offset = 0;
+    }
+}
+// Ordinal of the first record at or after which an id of at least id was appended, next_ordinal if there is none.
+static long long locate(long long id) {
+    if (entry_count == 0 || entries[0].max_id >= id) {
+        return first_ordinal;
+    }
+    const struct index_entry *entry = &entries[index_seek(id, false)];
+    struct log_cursor cursor = {entry->segment, entry->offset};
+    long long ordinal = entry->ordinal, highest = entry->max_id;
+    while (highest < id && ++ordinal < next_ordinal) {
+        cursor_next(&cursor);
+        const struct log_record *record = cursor_record(&cursor);
+        if (record->id > highest) {
+            highest = record->id;
+        }
+    }
+    return ordinal;
+}
+// Cursor on the record with the given ordinal, which has to be in the log.
+static struct log_cursor seek(long long ordinal) {
+    const struct index_entry *entry = &entries[index_seek(ordinal, true)];
+    struct log_cursor cursor = {entry->segment, entry->offset};
+    for (long long skip = ordinal - entry->ordinal; skip > 0; skip--) {
+        cursor_next(&cursor);
+    }
+    return cursor;
+}
+// Streams a page straight out of the mapped segments. Pages are cut by log position, a message that reached the
+// log late is left out of the page it fell behind instead of being moved there.
+static bool log_send_chat_history(const struct history_request *request, history_callback emit, void *context) {
+    pthread_rwlock_rdlock(&lock);
+    long long from, to; // The page is the records [from, to)
+    switch (request->mode) {
+    case HISTORY_BEFORE:
+        to = locate(request->id);
+        from = (to - request->limit > first_ordinal) ? to - request->limit : first_ordinal;
+        break;
+    case HISTORY_AFTER:
+        from = locate(request->id + 1);
+        to = (next_ordinal - from > request->limit) ? from + request->limit : next_ordinal;
+        break;
+    default:
+        to = next_ordinal;
+        from = (to - request->limit > first_ordinal) ? to - request->limit : first_ordinal;
+        break;
+    }
+    if (from < to) {
+        struct log_cursor cursor = seek(from);
+        for (long long ordinal = from; ordinal < to; ordinal++) {
+            const struct log_record *record = cursor_record(&cursor);
+            bool outside = (request->mode == HISTORY_BEFORE && record->id >= request->id) ||
+                           (request->mode == HISTORY_AFTER && record->id <= request->id);
+            if (!outside) {
+                emit(context, record->json, record->length);
+            }
+            if (ordinal + 1 < to) {
+                cursor_next(&cursor);
+            }
+        }
+    }
+    pthread_rwlock_unlock(&lock);
+    return true;
+}
+static bool write_username(const char *username) {
+    uint32_t length = (uint32_t)strlen(username);
+    struct iovec parts[2] = {{&length, sizeof(length)}, {(void *)username, length}};
+    return writev(usernames_fd, parts, 2) == (ssize_t)(sizeof(length) + length);
+}
+static void log_insert_username(const char *username) {
+    if (!write_username(username) || fdatasync(usernames_fd) != 0) {
+        perror("Failed to store username");
+    }
+}
+static bool log_insert_usernames(const char **usernames, int count) {
+    bool ok = true;
+    for (int i = 0; i < count && ok; i++) {
+        ok = write_username(usernames[i]);
+    }
+    if (!ok || fdatasync(usernames_fd) != 0) {
+        perror("Failed to store usernames");
+        return false;
+    }
+    return true;
+}
+// Reads usernames.log from the start. A name cut off by a crash ends it and is cut from the file.
+static bool log_load_usernames(username_callback each, void *context) {
+    FILE *file = fdopen(dup(usernames_fd), "r");
+    if (file == NULL) {
+        perror("fdopen");
+        return false;
+    }
+    char *name = NULL;
+    uint32_t length;
+    off_t valid = 0;
+    while (fread(&length, sizeof(length), 1, file) == 1) {
+        char *grown = realloc(name, length + 1);
+        if (grown == NULL || fread(grown, 1, length, file) != length) {
+            name = (grown != NULL) ? grown : name;
+            break;
+        }
+        name = grown;
+        name[length] = '\0';
+        each(context, name);
+        valid += sizeof(length) + length;
+    }
+    free(name);
+    fclose(file);
+    if (ftruncate(usernames_fd, valid) != 0) {
+        perror("ftruncate");
+        return false;
+    }
+    return true;
+}
+// Drops (or renames to archive-*.log) the oldest segments whose newest message is older than the retention period.
+// The newest segment always stays, it is the one being appended to.
+static void expire_segments(void) {
+    long long cutoff = now_ms() - (long long)retention_days * 86400 * 1000;
+    pthread_mutex_lock(&append_lock); // Appends read the segment list without the rwlock
+    pthread_rwlock_wrlock(&lock);
+    int expired = 0;
+    while (expired < segment_count - 1 && segments[expired]->last_ms < cutoff) {
+        expired++;
+    }
+    if (expired > 0) {
+        size_t dropped = 0;
+        while (dropped < entry_count && entries[dropped].segment < expired) {
+            dropped++;
+        }
+        first_ordinal = entries[dropped].ordinal; // The first record of a segment always has an entry
+        memmove(entries, entries + dropped, (entry_count - dropped) * sizeof(struct index_entry));
+        entry_count -= dropped;
+        for (size_t i = 0; i < entry_count; i++) {
+            entries[i].segment -= expired;
+        }
+        for (int i = 0; i < expired; i++) {
+            char file[PATH_MAX + 32], archive[PATH_MAX + 64];
+            segment_path(file, sizeof(file), segments[i]->first_id);
+            snprintf(archive, sizeof(archive), "%s/archive-%020lld%s", directory, segments[i]->first_id, LOG_SEGMENT_SUFFIX);
+            if (archive_expired ? rename(file, archive) : unlink(file)) {
+                perror(file);
+            }
+            segment_close(segments[i]);
+        }
+        memmove(segments, segments + expired, (segment_count - expired) * sizeof(struct log_segment *));
+        segment_count -= expired;
+    }
+    pthread_rwlock_unlock(&lock);
+    pthread_mutex_unlock(&append_lock);
+    if (expired > 0) {
+        printf("Message log: %s %d expired segment(s)\n", archive_expired ? "archived" : "dropped", expired);
+    }
+}
+static void *log_maintenance(void *arg) {
+    (void)arg;
+    while (true) {
+        expire_segments();
+        sleep(LOG_MAINTENANCE_INTERVAL);
+    }
+    return NULL;
+}
+static void log_maintenance_start(int days, bool archive) {
+    if (days <= 0) {
+        return;
+    }
+    retention_days = days;
+    archive_expired = archive;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, log_maintenance, NULL) != 0) {
+        perror("pthread_create");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(thread);
+}
+
+const struct storage_backend log_storage = {
+    "log", false, log_open, log_maintenance_start, log_send_chat_history, log_insert_message,
+    log_insert_messages, log_insert_username, log_insert_usernames, log_load_usernames,
+};
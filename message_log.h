@@ -0,0 +1,38 @@
+#ifndef MESSAGE_LOG_H
+#define MESSAGE_LOG_H
+
+#include <stdint.h>
+
+#define DEFAULT_LOG_DIR "chat_log"          // Directory of the embedded log without --log-dir
+#define LOG_SEGMENT_SIZE (64 * 1024 * 1024) // Bytes of one segment file, a new one is started when a record doesn't fit
+#define LOG_INDEX_INTERVAL 64               // Records between two entries of the sparse index
+#define LOG_MAINTENANCE_INTERVAL 3600       // Seconds between two runs of the retention job
+
+/*
+    Embedded storage backend (--storage=log, registered as log_storage in storage.h): every message is appended to
+    a log of fixed-size segment files in one directory, each mapped into memory for as long as the server runs.
+
+    A segment is named after the id of its first message (00000000000000000042.log) and holds records back to back,
+    each 8-byte aligned. A record carries the message as the finished JSON history row, so history pages are handed
+    to the caller straight out of the mapped pages without building anything. The unused rest of a segment is
+    zeros, a record length of 0 marks where the segment ends. Writes are made durable with one msync per batch of
+    the writer thread. Every record's checksum continues the one of the record before it, so at startup each
+    segment is scanned up to the first record that doesn't continue the chain: a write torn by a crash, or a
+    leftover of one, never passes for a record.
+
+    Messages are found through a sparse index kept in memory: the first record of every segment and every
+    LOG_INDEX_INTERVAL-th record get an entry with their position, so a seek is a binary search plus a scan of at
+    most LOG_INDEX_INTERVAL records. Each segment also remembers when its newest record was written, the retention
+    job drops (or archives) whole segments once that expired. The log holds the one room the server has.
+
+    Usernames go to usernames.log in the same directory, each one a 32-bit length followed by the name.
+*/
+struct log_record {
+    uint32_t length;   // Bytes of json, 0 if there is no record here
+    uint32_t checksum; // CRC-32 of id, stored_ms and json, started from the previous record's checksum (0 for the first)
+    int64_t id;
+    int64_t stored_ms; // Wall clock time in milliseconds when the record was appended
+    char json[];       // The history row, not null-terminated
+};
+
+#endif
@@ -0,0 +1,229 @@
+#define _GNU_SOURCE // open_memstream
+#include "metrics.h"
+#include "memory_pool.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+struct metrics_histogram {
+    atomic_ullong counts[METRICS_BUCKETS];
+    atomic_ullong sum; // Nanoseconds over all samples
+};
+// Everything one thread records, only written by that thread.
+struct metrics_slot {
+    char name[32];
+    atomic_ullong counters[METRIC_COUNTERS];
+    struct metrics_histogram stages[METRIC_STAGES];
+};
+
+static const char *stage_names[METRIC_STAGES] = {"accept", "handshake", "recv", "parse", "fanout", "flush", "insert", "history"};
+static const struct {
+    const char *name;
+    const char *help;
+} counter_info[METRIC_COUNTERS] = {
+    {"chat_connections_accepted_total", "Client connections accepted."},
+    {"chat_connections_closed_total", "Client connections closed."},
+    {"chat_messages_received_total", "Client messages handled."},
+    {"chat_broadcasts_total", "Chat messages posted to the room."},
+    {"chat_received_bytes_total", "Bytes read from client sockets."},
+    {"chat_sent_bytes_total", "Bytes written to client sockets."},
+    {"chat_slow_consumer_evictions_total", "Clients disconnected as slow consumers."},
+    {"chat_stored_messages_total", "Messages handed to the database."},
+    {"chat_unstored_writes_total", "Messages and usernames not stored because the writer queue was full."},
+    {"chat_throttled_clients_total", "Times a client ran out of rate limit tokens and stopped being read."},
+};
+
+static __thread struct metrics_slot *self;
+static struct metrics_slot *slots[METRICS_MAX_THREADS];
+static int slot_count;
+static pthread_mutex_t slots_lock = PTHREAD_MUTEX_INITIALIZER;
+static int admin_fd;
+static metrics_gauges extra_gauges;
+
+static void add(atomic_ullong *value, uint64_t amount) {
+    atomic_store_explicit(value, atomic_load_explicit(value, memory_order_relaxed) + amount, memory_order_relaxed);
+}
+int metrics_thread_init(const char *name) {
+    struct metrics_slot *slot = calloc(1, sizeof(struct metrics_slot));
+    if (slot == NULL) {
+        return -1;
+    }
+    snprintf(slot->name, sizeof(slot->name), "%s", name);
+    pthread_mutex_lock(&slots_lock);
+    bool registered = slot_count < METRICS_MAX_THREADS;
+    if (registered) {
+        slots[slot_count++] = slot;
+    }
+    pthread_mutex_unlock(&slots_lock);
+    if (!registered) {
+        free(slot);
+        return -1;
+    }
+    self = slot;
+    return 0;
+}
+uint64_t metrics_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+static int bucket_of(uint64_t value) {
+    if (value < METRICS_SUB_BUCKETS) {
+        return (int)value;
+    }
+    int power = 63 - __builtin_clzll(value);
+    int bucket = (power - 3) * METRICS_SUB_BUCKETS + (int)((value >> (power - 4)) & (METRICS_SUB_BUCKETS - 1));
+    return (bucket < METRICS_BUCKETS) ? bucket : METRICS_BUCKETS - 1;
+}
+// Highest value that falls into a bucket, what quantiles are reported as.
+static uint64_t bucket_limit(int bucket) {
+    if (bucket < METRICS_SUB_BUCKETS) {
+        return (uint64_t)bucket;
+    }
+    int power = bucket / METRICS_SUB_BUCKETS + 3;
+    uint64_t sub = bucket % METRICS_SUB_BUCKETS;
+    return ((METRICS_SUB_BUCKETS + sub + 1) << (power - 4)) - 1;
+}
+void metrics_record(enum metric_stage stage, uint64_t started) {
+    struct metrics_slot *slot = self;
+    if (slot == NULL) {
+        return;
+    }
+    uint64_t elapsed = metrics_now() - started;
+    add(&slot->stages[stage].counts[bucket_of(elapsed)], 1);
+    add(&slot->stages[stage].sum, elapsed);
+}
+void metrics_add(enum metric_counter counter, uint64_t value) {
+    if (self != NULL) {
+        add(&self->counters[counter], value);
+    }
+}
+
+// Writes every metric in the Prometheus text exposition format.
+static void render(FILE *out) {
+    // Slots are never removed, the ones registered by now stay valid without the lock.
+    pthread_mutex_lock(&slots_lock);
+    int count = slot_count;
+    pthread_mutex_unlock(&slots_lock);
+
+    for (int c = 0; c < METRIC_COUNTERS; c++) {
+        fprintf(out, "# HELP %s %s\n# TYPE %s counter\n", counter_info[c].name, counter_info[c].help, counter_info[c].name);
+        for (int i = 0; i < count; i++) {
+            fprintf(out, "%s{thread=\"%s\"} %llu\n", counter_info[c].name, slots[i]->name,
+                    atomic_load_explicit(&slots[i]->counters[c], memory_order_relaxed));
+        }
+    }
+
+    // Stages are merged over all threads and summarized as quantiles, the fine buckets would be too many series.
+    static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+    static unsigned long long merged[METRICS_BUCKETS];
+    fprintf(out, "# HELP chat_stage_seconds Time spent in each stage of the message path.\n# TYPE chat_stage_seconds summary\n");
+    for (int s = 0; s < METRIC_STAGES; s++) {
+        unsigned long long total = 0, sum = 0;
+        memset(merged, 0, sizeof(merged));
+        for (int i = 0; i < count; i++) {
+            for (int b = 0; b < METRICS_BUCKETS; b++) {
+                merged[b] += atomic_load_explicit(&slots[i]->stages[s].counts[b], memory_order_relaxed);
+            }
+            sum += atomic_load_explicit(&slots[i]->stages[s].sum, memory_order_relaxed);
+        }
+        for (int b = 0; b < METRICS_BUCKETS; b++) {
+            total += merged[b];
+        }
+        for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+            unsigned long long rank = (unsigned long long)(quantiles[q] * total + 0.5), seen = 0;
+            uint64_t value = 0;
+            for (int b = 0; b < METRICS_BUCKETS && total > 0; b++) {
+                seen += merged[b];
+                if (seen >= rank && seen > 0) {
+                    value = bucket_limit(b);
+                    break;
+                }
+            }
+            fprintf(out, "chat_stage_seconds{stage=\"%s\",quantile=\"%g\"} %.9f\n", stage_names[s], quantiles[q], value / 1e9);
+        }
+        fprintf(out, "chat_stage_seconds_sum{stage=\"%s\"} %.9f\n", stage_names[s], sum / 1e9);
+        fprintf(out, "chat_stage_seconds_count{stage=\"%s\"} %llu\n", stage_names[s], total);
+    }
+
+    struct alloc_stats allocations;
+    alloc_stats_total(&allocations);
+    fprintf(out, "# HELP chat_heap_allocations_total Blocks the reactors took from malloc.\n# TYPE chat_heap_allocations_total counter\n");
+    fprintf(out, "chat_heap_allocations_total %llu\n", (unsigned long long)allocations.heap_allocations);
+    fprintf(out, "# HELP chat_arena_allocations_total Blocks handed out by the reactors' arenas.\n# TYPE chat_arena_allocations_total counter\n");
+    fprintf(out, "chat_arena_allocations_total %llu\n", (unsigned long long)allocations.arena_allocations);
+    fprintf(out, "# HELP chat_slab_hits_total Blocks reused from the slab pools.\n# TYPE chat_slab_hits_total counter\n");
+    fprintf(out, "chat_slab_hits_total %llu\n", (unsigned long long)allocations.slab_hits);
+
+    if (extra_gauges != NULL) {
+        extra_gauges(out);
+    }
+}
+// Answers every connection with the current metrics, whatever it asked for. One scrape at a time is plenty.
+static void *admin_thread(void *arg) {
+    (void)arg;
+    while (true) {
+        int fd = accept(admin_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EINTR) {
+                perror("admin accept");
+            }
+            continue;
+        }
+        // Read (and ignore) the request, a scraper may wait for us to do so before it reads the response.
+        struct timeval timeout = {1, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        char request[1024];
+        while (recv(fd, request, sizeof(request), 0) == (ssize_t)sizeof(request)) {
+        }
+
+        char *body = NULL;
+        size_t length = 0;
+        FILE *out = open_memstream(&body, &length);
+        if (out != NULL) {
+            render(out);
+            fclose(out);
+            char header[128];
+            int header_length = snprintf(header, sizeof(header),
+                                         "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", length);
+            if (send(fd, header, header_length, MSG_NOSIGNAL) == header_length) {
+                for (size_t sent = 0; sent < length;) {
+                    ssize_t written = send(fd, body + sent, length - sent, MSG_NOSIGNAL);
+                    if (written <= 0) {
+                        break;
+                    }
+                    sent += written;
+                }
+            }
+            free(body);
+        }
+        close(fd);
+    }
+    return NULL;
+}
+int metrics_serve(int port, metrics_gauges gauges) {
+    struct sockaddr_in address;
+    int opt = 1;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK); // Local only, the metrics aren't meant for the outside
+    address.sin_port = htons(port);
+    if ((admin_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0 || setsockopt(admin_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) ||
+        bind(admin_fd, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(admin_fd, 16) != 0) {
+        return -1;
+    }
+    extra_gauges = gauges;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, admin_thread, NULL) != 0) {
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
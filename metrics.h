@@ -0,0 +1,67 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+    Counters and latency histograms of the hot path, served in the Prometheus text format on a local admin port.
+    Every thread that records registers a slot of its own and only ever writes that slot, with relaxed loads and
+    stores instead of locked read-modify-write instructions. The admin thread sums the slots when it is scraped,
+    so a scrape may see a thread's counter a few increments behind but never a torn value.
+*/
+#define METRICS_MAX_THREADS 128 // Threads that can register a slot, later ones record nothing
+#define METRICS_SUB_BUCKETS 16  // Linear sub-buckets per power of two, values are kept to about 6%
+#define METRICS_MAX_POWER 36    // Largest power of two in ns a bucket starts at (about 68 seconds)
+#define METRICS_BUCKETS ((METRICS_MAX_POWER - 2) * METRICS_SUB_BUCKETS)
+
+/*
+    Stages timed in nanoseconds, one histogram each.
+    - STAGE_ACCEPT: Setting up one accepted connection.
+    - STAGE_HANDSHAKE: Handling the username handshake (claim, admission, queueing the join history).
+    - STAGE_RECV: One read of a client socket into its read buffer.
+    - STAGE_PARSE: Decoding one client message (JSON or binary).
+    - STAGE_FANOUT: Queueing a broadcast for the members of one shard and handing it to the other shards.
+    - STAGE_FLUSH: One writev of a client's outbound queue.
+    - STAGE_INSERT: Storing one batch of messages (insert_messages, or insert_message one by one).
+    - STAGE_HISTORY: One history page read from the database (send_chat_history).
+*/
+enum metric_stage { STAGE_ACCEPT, STAGE_HANDSHAKE, STAGE_RECV, STAGE_PARSE, STAGE_FANOUT, STAGE_FLUSH, STAGE_INSERT, STAGE_HISTORY, METRIC_STAGES };
+
+/*
+    Counters, exported per thread.
+    - COUNTER_ACCEPTED, COUNTER_DISCONNECTED: Connections opened and closed.
+    - COUNTER_MESSAGES: Client messages handled.
+    - COUNTER_BROADCASTS: Chat messages posted to the room.
+    - COUNTER_BYTES_RECEIVED, COUNTER_BYTES_SENT: Bytes read from and written to client sockets.
+    - COUNTER_EVICTIONS: Clients disconnected as slow consumers.
+    - COUNTER_STORED: Messages handed to the database.
+    - COUNTER_UNSTORED: Messages and usernames not stored because the writer thread's queue was full.
+    - COUNTER_THROTTLED: Times a client ran out of --rate-limit tokens and stopped being read.
+*/
+enum metric_counter {
+    COUNTER_ACCEPTED,
+    COUNTER_DISCONNECTED,
+    COUNTER_MESSAGES,
+    COUNTER_BROADCASTS,
+    COUNTER_BYTES_RECEIVED,
+    COUNTER_BYTES_SENT,
+    COUNTER_EVICTIONS,
+    COUNTER_STORED,
+    COUNTER_UNSTORED,
+    COUNTER_THROTTLED,
+    METRIC_COUNTERS
+};
+
+// Called by the admin thread on each scrape to append gauges the metrics module can't know about.
+typedef void (*metrics_gauges)(FILE *out);
+
+int metrics_thread_init(const char *name); // registers the calling thread's slot, returns -1 if there is none left
+uint64_t metrics_now(void);                // CLOCK_MONOTONIC in nanoseconds, what stages are timed with
+void metrics_record(enum metric_stage stage, uint64_t started); // records metrics_now() - started
+void metrics_add(enum metric_counter counter, uint64_t value);
+// Serves the metrics on 127.0.0.1:port from a thread of its own. Returns -1 if the port couldn't be bound.
+int metrics_serve(int port, metrics_gauges gauges);
+
+#endif
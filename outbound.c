@@ -0,0 +1,199 @@
+#include "outbound.h"
+#include "memory_pool.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#define FLUSH_IOVECS 64 // Frames handed to a single writev() call
+
+struct frame *frame_alloc(size_t length) {
+    struct frame *frame = slab_alloc(sizeof(struct frame) + length);
+    if (frame == NULL) {
+        return NULL;
+    }
+    atomic_init(&frame->refs, 1);
+    frame->length = length;
+    frame->capacity = length;
+    for (int i = 0; i < FRAME_ENCODINGS; i++) {
+        atomic_init(&frame->encoded[i], NULL);
+    }
+    return frame;
+}
+struct frame *frame_create(const char *data, size_t length) {
+    struct frame *frame = frame_alloc(length);
+    if (frame != NULL) {
+        memcpy(frame->data, data, length);
+    }
+    return frame;
+}
+struct frame *frame_create_line(const char *data, size_t length) {
+    struct frame *frame = frame_alloc(length + 1);
+    if (frame != NULL) {
+        memcpy(frame->data, data, length);
+        frame->data[length] = '\n';
+    }
+    return frame;
+}
+void frame_retain(struct frame *frame) {
+    atomic_fetch_add_explicit(&frame->refs, 1, memory_order_relaxed);
+}
+void frame_release(struct frame *frame) {
+    // acq_rel: every holder's reads of the frame happen before the final free.
+    if (atomic_fetch_sub_explicit(&frame->refs, 1, memory_order_acq_rel) == 1) {
+        for (int i = 0; i < FRAME_ENCODINGS; i++) {
+            struct frame *encoded = atomic_load_explicit(&frame->encoded[i], memory_order_relaxed);
+            if (encoded != NULL) {
+                frame_release(encoded);
+            }
+        }
+        slab_free(frame, sizeof(struct frame) + frame->capacity);
+    }
+}
+struct frame *frame_encoded(struct frame *frame, enum frame_encoding encoding, frame_encoder encode) {
+    struct frame *encoded = atomic_load_explicit(&frame->encoded[encoding], memory_order_acquire);
+    if (encoded != NULL) {
+        return encoded;
+    }
+    // Shards may race to encode the same frame, the first one to publish its copy wins and the others use it.
+    struct frame *mine = encode(frame);
+    if (mine == NULL) {
+        return NULL;
+    }
+    if (atomic_compare_exchange_strong_explicit(&frame->encoded[encoding], &encoded, mine, memory_order_acq_rel, memory_order_acquire)) {
+        return mine;
+    }
+    frame_release(mine);
+    return encoded;
+}
+void frame_attach_encoding(struct frame *frame, enum frame_encoding encoding, struct frame *encoded) {
+    struct frame *expected = NULL;
+    if (!atomic_compare_exchange_strong_explicit(&frame->encoded[encoding], &expected, encoded, memory_order_acq_rel, memory_order_acquire)) {
+        frame_release(encoded);
+    }
+}
+// Doubles the ring, unrolling it so the oldest frame ends up at index 0.
+static bool grow(struct outbound_queue *queue) {
+    size_t capacity = queue->capacity ? queue->capacity * 2 : 16;
+    struct frame **frames = slab_alloc(capacity * sizeof(struct frame *));
+    if (frames == NULL) {
+        return false;
+    }
+    for (size_t i = 0; i < queue->count; i++) {
+        frames[i] = queue->frames[(queue->head + i) % queue->capacity];
+    }
+    slab_free(queue->frames, queue->capacity * sizeof(struct frame *));
+    queue->frames = frames;
+    queue->capacity = capacity;
+    queue->head = 0;
+    return true;
+}
+// Drops the oldest frame that hasn't been partially written yet, returns false if there is none.
+static bool drop_oldest(struct outbound_queue *queue) {
+    // A partially written head frame has to finish, otherwise the peer would see half a message.
+    size_t skip = (queue->offset > 0) ? 1 : 0;
+    if (queue->count <= skip) {
+        return false;
+    }
+    size_t victim = (queue->head + skip) % queue->capacity;
+    struct frame *frame = queue->frames[victim];
+    queue->bytes -= frame->length;
+    if (skip) { // Move the partial head frame into the freed slot
+        queue->frames[victim] = queue->frames[queue->head];
+    }
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count--;
+    queue->dropped++;
+    frame_release(frame);
+    return true;
+}
+bool outbound_push(struct outbound_queue *queue, struct frame *frame, size_t high_water, enum slow_consumer_policy policy) {
+    if (queue->bytes + frame->length > high_water && queue->count > 0) {
+        if (policy == EVICT) {
+            return false;
+        }
+        while (queue->bytes + frame->length > high_water && drop_oldest(queue)) {
+        }
+    }
+    if (queue->count == queue->capacity && !grow(queue)) {
+        return false;
+    }
+    frame_retain(frame);
+    queue->frames[(queue->head + queue->count) % queue->capacity] = frame;
+    queue->count++;
+    queue->bytes += frame->length;
+    return true;
+}
+bool outbound_push_front(struct outbound_queue *queue, struct frame *frame) {
+    if (queue->count == queue->capacity && !grow(queue)) {
+        return false;
+    }
+    frame_retain(frame);
+    queue->head = (queue->head + queue->capacity - 1) % queue->capacity;
+    queue->frames[queue->head] = frame;
+    queue->count++;
+    queue->bytes += frame->length;
+    return true;
+}
+bool outbound_drop_partial(struct outbound_queue *queue) {
+    if (queue->offset == 0) {
+        return false;
+    }
+    struct frame *frame = queue->frames[queue->head];
+    queue->bytes -= frame->length - queue->offset;
+    queue->offset = 0;
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count--;
+    queue->dropped++;
+    frame_release(frame);
+    return true;
+}
+int outbound_flush(int sockfd, struct outbound_queue *queue) {
+    while (queue->count > 0) {
+        struct iovec iov[FLUSH_IOVECS];
+        int iovcnt = 0;
+        for (size_t i = 0; i < queue->count && iovcnt < FLUSH_IOVECS; i++) {
+            struct frame *frame = queue->frames[(queue->head + i) % queue->capacity];
+            size_t skip = (i == 0) ? queue->offset : 0;
+            iov[iovcnt].iov_base = frame->data + skip;
+            iov[iovcnt].iov_len = frame->length - skip;
+            iovcnt++;
+        }
+
+        ssize_t written = writev(sockfd, iov, iovcnt);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 1 : -1;
+        }
+
+        // Pop every frame that went out completely, remember how far into the next one we got.
+        size_t remaining = (size_t)written;
+        queue->bytes -= remaining;
+        while (remaining > 0) {
+            struct frame *frame = queue->frames[queue->head];
+            size_t left = frame->length - queue->offset;
+            if (remaining < left) {
+                queue->offset += remaining;
+                break;
+            }
+            remaining -= left;
+            queue->offset = 0;
+            queue->head = (queue->head + 1) % queue->capacity;
+            queue->count--;
+            frame_release(frame);
+        }
+        if (queue->offset > 0) { // Short write, the socket buffer is full
+            return 1;
+        }
+    }
+    return 0;
+}
+void outbound_clear(struct outbound_queue *queue) {
+    for (size_t i = 0; i < queue->count; i++) {
+        frame_release(queue->frames[(queue->head + i) % queue->capacity]);
+    }
+    slab_free(queue->frames, queue->capacity * sizeof(struct frame *));
+    memset(queue, 0, sizeof(*queue));
+}
@@ -0,0 +1,79 @@
+#ifndef OUTBOUND_H
+#define OUTBOUND_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+    Other wire formats a frame can be sent in, besides the newline-delimited JSON it is created with.
+    ENCODING_HISTORY_BLOCK is a history page compressed into one block (see history_block.h), of the frame it is
+    attached to: a newline-delimited page, or the ENCODING_BINARY frame of one.
+*/
+enum frame_encoding { ENCODING_WEBSOCKET, ENCODING_WEBSOCKET_DEFLATE, ENCODING_BINARY, ENCODING_HISTORY_BLOCK, FRAME_ENCODINGS };
+
+/*
+    An encoded message, immutable once created. A broadcast is serialized into one frame and every
+    recipient's queue (and every other shard) holds a reference to that same frame instead of a copy.
+    The last release frees it.
+    - encoded: The same message in another wire format, created by the first recipient that needs it and shared
+      by all others, so a broadcast is encoded once per format rather than once per recipient.
+    - capacity: Bytes allocated for data, length may end up lower. Frames come from the slab pools (see memory_pool.h).
+*/
+struct frame {
+    atomic_int refs;
+    size_t length;
+    size_t capacity;
+    _Atomic(struct frame *) encoded[FRAME_ENCODINGS];
+    char data[];
+};
+// Builds a frame in another encoding from a newline-delimited one, NULL if allocation failed.
+typedef struct frame *(*frame_encoder)(const struct frame *frame);
+
+struct frame *frame_alloc(size_t length); // returns a frame holding one reference with length bytes for the caller to fill, NULL if allocation failed
+struct frame *frame_create(const char *data, size_t length); // same, filled with a copy of data
+struct frame *frame_create_line(const char *data, size_t length); // same, with the '\n' frame delimiter appended
+void frame_retain(struct frame *frame);
+void frame_release(struct frame *frame);
+// The frame in another encoding, created with encode on first use. Valid while the caller holds frame, NULL if encoding failed.
+struct frame *frame_encoded(struct frame *frame, enum frame_encoding encoding, frame_encoder encode);
+// Stores an encoding the caller already built, taking over its reference. Does nothing but release it if one is already set.
+void frame_attach_encoding(struct frame *frame, enum frame_encoding encoding, struct frame *encoded);
+
+/*
+    What happens to a client whose queue is over the high-water mark:
+    - DROP_OLDEST: The oldest frames that haven't started going out yet are dropped to make room.
+    - EVICT: The client is disconnected.
+*/
+enum slow_consumer_policy { DROP_OLDEST, EVICT };
+
+/*
+    Per-client FIFO of frames waiting to be written, kept as a ring that grows on demand.
+    - head: Ring index of the oldest frame.
+    - count: Number of queued frames.
+    - offset: Bytes of the head frame that were already written, a partial write resumes from here.
+    - bytes: Unwritten bytes over all queued frames, compared against the high-water mark.
+    - dropped: Frames discarded under DROP_OLDEST over the lifetime of the queue.
+*/
+struct outbound_queue {
+    struct frame **frames;
+    size_t capacity;
+    size_t head;
+    size_t count;
+    size_t offset;
+    size_t bytes;
+    size_t dropped;
+};
+
+// Queues a frame, taking a new reference. Returns false if the client has to be evicted (or on allocation failure).
+bool outbound_push(struct outbound_queue *queue, struct frame *frame, size_t high_water, enum slow_consumer_policy policy);
+// Queues a frame ahead of every other one, taking a new reference. Only while nothing of the head frame was written yet.
+bool outbound_push_front(struct outbound_queue *queue, struct frame *frame);
+// Drops the head frame if part of it was written, so the rest can go out whole on a new connection. Returns whether it did.
+bool outbound_drop_partial(struct outbound_queue *queue);
+// Writes as much as the socket takes with writev. Returns 0 once empty, 1 if the socket is full, -1 on error.
+int outbound_flush(int sockfd, struct outbound_queue *queue);
+// Releases every queued frame and the ring itself.
+void outbound_clear(struct outbound_queue *queue);
+
+#endif
@@ -0,0 +1,181 @@
+#include "persist.h"
+#include "database.h"
+#include "spsc_queue.h"
+#include "metrics.h"
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+
+/*
+    - queues: One SPSC queue per shard, the writer thread is the only consumer of all of them.
+    - wake_fd: eventfd the shards write to once a full batch is waiting, so the writer doesn't sit out the flush interval.
+    - wake_pending: Set by the producer that wrote wake_fd, cleared by the writer before it drains.
+    - pending: Messages queued but not yet picked up by the writer.
+    - name_queues: One SPSC queue per shard for usernames new to the registry, drained on every flush.
+*/
+static struct spsc_queue *queues;
+static struct spsc_queue *name_queues;
+static int num_queues;
+static int batch_size;
+static int flush_interval;
+static int wake_fd;
+static atomic_bool wake_pending;
+static atomic_int pending;
+static pthread_t writer;
+
+static void *persist_writer(void *arg);
+
+void persist_init(int producers, int batch, int flush_interval_ms) {
+    num_queues = producers;
+    batch_size = batch;
+    flush_interval = flush_interval_ms;
+    queues = calloc(producers, sizeof(struct spsc_queue));
+    name_queues = calloc(producers, sizeof(struct spsc_queue));
+    if (queues == NULL || name_queues == NULL || (wake_fd = eventfd(0, EFD_NONBLOCK)) < 0) {
+        perror("persist_init");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < producers; i++) {
+        if (spsc_init(&queues[i], PERSIST_QUEUE_SIZE) != 0 || spsc_init(&name_queues[i], PERSIST_NAME_QUEUE_SIZE) != 0) {
+            perror("spsc_init");
+            exit(EXIT_FAILURE);
+        }
+    }
+    atomic_init(&wake_pending, false);
+    atomic_init(&pending, 0);
+    if (pthread_create(&writer, NULL, persist_writer, NULL) != 0) {
+        perror("pthread_create");
+        exit(EXIT_FAILURE);
+    }
+}
+// Copies the three fields into one allocation, the strings live right after the struct.
+static struct stored_message *copy_message(long long id, const char *time, const char *username, const char *message) {
+    size_t time_len = strlen(time) + 1, username_len = strlen(username) + 1, message_len = strlen(message) + 1;
+    struct stored_message *copy = malloc(sizeof(struct stored_message) + time_len + username_len + message_len);
+    if (copy == NULL) {
+        return NULL;
+    }
+    char *strings = (char *)(copy + 1);
+    copy->id = id;
+    copy->room = DEFAULT_ROOM;
+    copy->timestamp = memcpy(strings, time, time_len);
+    copy->username = memcpy(strings + time_len, username, username_len);
+    copy->content = memcpy(strings + time_len + username_len, message, message_len);
+    return copy;
+}
+bool persist_message(int producer, long long id, const char *time, const char *username, const char *message) {
+    struct stored_message *copy = copy_message(id, time, username, message);
+    if (copy == NULL) {
+        perror("malloc");
+        return false;
+    }
+    if (!spsc_push(&queues[producer], copy)) {
+        // The writer is far behind. Storing the message here would stall the shard on the database exactly when
+        // it is busiest, it was delivered already and only goes missing from the stored history.
+        free(copy);
+        metrics_add(COUNTER_UNSTORED, 1);
+        return false;
+    }
+    // Only wake the writer early once a whole batch is waiting, otherwise the flush interval takes care of it.
+    if (atomic_fetch_add(&pending, 1) + 1 >= batch_size && !atomic_exchange(&wake_pending, true)) {
+        uint64_t one = 1;
+        if (write(wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            perror("eventfd write");
+        }
+    }
+    return true;
+}
+bool persist_username(int producer, const char *username) {
+    char *copy = strdup(username);
+    if (copy == NULL) {
+        perror("strdup");
+        return false;
+    }
+    if (!spsc_push(&name_queues[producer], copy)) {
+        // The writer is far behind, the name stays claimed in the registry but isn't stored (see persist_message).
+        free(copy);
+        metrics_add(COUNTER_UNSTORED, 1);
+        return false;
+    }
+    return true;
+}
+// Stores every queued username, up to batch_size per transaction. Names of a rejected batch are retried one by one.
+static void write_usernames(const char *names[]) {
+    int count;
+    do {
+        count = 0;
+        for (int i = 0; i < num_queues; i++) {
+            char *name;
+            while (count < batch_size && (name = spsc_pop(&name_queues[i])) != NULL) {
+                names[count++] = name;
+            }
+        }
+        if (count > 0 && !insert_usernames(names, count)) {
+            for (int i = 0; i < count; i++) {
+                insert_username(names[i]);
+            }
+        }
+        for (int i = 0; i < count; i++) {
+            free((char *)names[i]);
+        }
+    } while (count == batch_size);
+}
+// Takes up to batch_size messages off the queues, round robin so one busy shard can't starve the others.
+static int collect_batch(struct stored_message *batch[]) {
+    int count = 0;
+    bool progress = true;
+    while (count < batch_size && progress) {
+        progress = false;
+        for (int i = 0; i < num_queues && count < batch_size; i++) {
+            struct stored_message *message = spsc_pop(&queues[i]);
+            if (message != NULL) {
+                batch[count++] = message;
+                progress = true;
+            }
+        }
+    }
+    atomic_fetch_sub(&pending, count);
+    return count;
+}
+// Stores one batch in a single transaction. If the batch is rejected (e.g. one malformed timestamp), the rows are retried one by one.
+static void write_batch(struct stored_message *batch[], int count) {
+    uint64_t started = metrics_now();
+    if (!insert_messages((const struct stored_message **)batch, count)) {
+        for (int i = 0; i < count; i++) {
+            insert_message(batch[i]->id, batch[i]->room, batch[i]->timestamp, batch[i]->username, batch[i]->content);
+        }
+    }
+    metrics_record(STAGE_INSERT, started);
+    metrics_add(COUNTER_STORED, count);
+    for (int i = 0; i < count; i++) {
+        free(batch[i]);
+    }
+}
+static void *persist_writer(void *arg) {
+    (void)arg;
+    metrics_thread_init("writer");
+    struct stored_message **batch = malloc(batch_size * sizeof(struct stored_message *));
+    const char **names = malloc(batch_size * sizeof(char *));
+    if (batch == NULL || names == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    while (true) {
+        // Sleep until a full batch is waiting or the flush interval passed.
+        struct pollfd pfd = {wake_fd, POLLIN, 0};
+        poll(&pfd, 1, flush_interval);
+        uint64_t count;
+        while (read(wake_fd, &count, sizeof(count)) < 0 && errno == EINTR) {
+        }
+        atomic_store(&wake_pending, false);
+
+        int collected;
+        while ((collected = collect_batch(batch)) > 0) {
+            write_batch(batch, collected);
+            if (collected < batch_size) { // Queues are empty, go back to sleep
+                break;
+            }
+        }
+        write_usernames(names);
+    }
+    return NULL;
+}
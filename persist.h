@@ -0,0 +1,25 @@
+#ifndef PERSIST_H
+#define PERSIST_H
+
+#include <stdbool.h>
+
+#define DEFAULT_PERSIST_BATCH_SIZE 512      // Messages written per transaction at most
+#define DEFAULT_PERSIST_FLUSH_INTERVAL 50   // Milliseconds a message may wait before its batch is written
+#define PERSIST_QUEUE_SIZE 65536            // Messages one shard can have waiting for the writer thread
+#define PERSIST_NAME_QUEUE_SIZE 4096        // New usernames one shard can have waiting for the writer thread
+
+/*
+    Write-behind persistence. Shards hand messages to persist_message(), which only copies them into a
+    lock-free queue; a dedicated writer thread drains the queues and stores whole batches in one
+    transaction (group commit), so the event loops never wait for the database.
+*/
+
+// Starts the writer thread. producers is the number of shards, each gets its own single-producer queue.
+void persist_init(int producers, int batch_size, int flush_interval_ms);
+// Queues a message for storage, called from the shard that received it. Returns false if it couldn't be queued,
+// the message is dropped then and counted as unstored, the shard never waits for the database.
+bool persist_message(int producer, long long id, const char *time, const char *username, const char *message);
+// Queues a username that is new to the registry, stored with the next flush. Returns false if it couldn't be stored.
+bool persist_username(int producer, const char *username);
+
+#endif
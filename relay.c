@@ -0,0 +1,565 @@
+#define _GNU_SOURCE
+#include "relay.h"
+#include "memory_pool.h"
+#include "metrics.h"
+#include "spsc_queue.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/*
+    Resolves "unix:/path" or "host:port". Without a host ("port" or ":port") a hub listens on every interface and an
+    instance connects to localhost. Returns -1 if the address can't be resolved.
+*/
+static int resolve(const char *address, bool listening, struct sockaddr_storage *out, socklen_t *length) {
+    memset(out, 0, sizeof(*out));
+    if (strncmp(address, "unix:", 5) == 0) {
+        struct sockaddr_un *un = (struct sockaddr_un *)out;
+        if (strlen(address + 5) >= sizeof(un->sun_path)) {
+            return -1;
+        }
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, address + 5);
+        *length = sizeof(*un);
+        return 0;
+    }
+    char host[256] = "";
+    const char *port = strrchr(address, ':');
+    if (port == NULL) {
+        port = address;
+    } else {
+        size_t host_length = port - address;
+        if (host_length >= sizeof(host)) {
+            return -1;
+        }
+        memcpy(host, address, host_length);
+        host[host_length] = '\0';
+        port++;
+    }
+    struct addrinfo hints, *result;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = listening ? AI_PASSIVE : 0;
+    if (getaddrinfo(host[0] != '\0' ? host : NULL, port, &hints, &result) != 0) {
+        return -1;
+    }
+    memcpy(out, result->ai_addr, result->ai_addrlen);
+    *length = result->ai_addrlen;
+    freeaddrinfo(result);
+    return 0;
+}
+// Makes a bus connection non-blocking. Every message is one small write that should leave at once, so Nagle is off on TCP.
+static void tune_socket(int fd, int family) {
+    int one = 1;
+    if (family != AF_UNIX) {
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+}
+
+/*
+    Instance side.
+    - queues: One SPSC queue per shard with the messages it published, encoded for the bus. The relay thread is the
+      only consumer of all of them.
+    - wake_fd/wake_pending: eventfd the shards write to after publishing, only the first one since the last drain does.
+    - instance: Random number this instance goes by on the bus, the same across reconnects, never 0.
+    - newest: Id of the newest message delivered, where the stream continues after a reconnect. Relay thread only.
+*/
+static struct spsc_queue *queues;
+static int num_queues;
+static int wake_fd;
+static atomic_bool wake_pending;
+static uint32_t instance;
+static long long newest;
+static relay_callback deliver;
+static const char *hub_address;
+static pthread_t relay_thread;
+
+static void *relay_main(void *arg);
+
+void relay_init(const char *address, int producers, long long newest_id, relay_callback callback) {
+    hub_address = address;
+    num_queues = producers;
+    newest = newest_id;
+    deliver = callback;
+    queues = calloc(producers, sizeof(struct spsc_queue));
+    if (queues == NULL || (wake_fd = eventfd(0, EFD_NONBLOCK)) < 0) {
+        perror("relay_init");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < producers; i++) {
+        if (spsc_init(&queues[i], RELAY_QUEUE_SIZE) != 0) {
+            perror("spsc_init");
+            exit(EXIT_FAILURE);
+        }
+    }
+    do {
+        if (getrandom(&instance, sizeof(instance), 0) != sizeof(instance)) {
+            perror("getrandom");
+            exit(EXIT_FAILURE);
+        }
+    } while (instance == 0);
+    atomic_init(&wake_pending, false);
+    // A hub that goes away must show up as a failed write, not kill the process.
+    signal(SIGPIPE, SIG_IGN);
+    if (pthread_create(&relay_thread, NULL, relay_main, NULL) != 0) {
+        perror("pthread_create");
+        exit(EXIT_FAILURE);
+    }
+}
+bool relay_publish(int producer, uint32_t user, int64_t timestamp_ms, const char *time, const char *username, const char *message,
+                   size_t message_length) {
+    // The time string goes in front of the text, its terminator separates the two.
+    size_t time_length = strlen(time) + 1;
+    size_t payload_length = time_length + message_length;
+    struct binary_message published = {RELAY_MESSAGE, 0, instance, user, 0, timestamp_ms, username, strlen(username), NULL, payload_length};
+    // The hub drops a connection that sends an oversized message, refuse it here instead.
+    if (BINARY_HEADER_SIZE + published.name_length + payload_length > MAX_FRAME_SIZE - BINARY_MAX_VARINT) {
+        return false;
+    }
+    if ((published.payload = slab_alloc(payload_length)) == NULL) {
+        return false;
+    }
+    memcpy(published.payload, time, time_length);
+    memcpy(published.payload + time_length, message, message_length);
+    struct frame *frame = binary_encode_message(&published);
+    slab_free(published.payload, payload_length);
+    if (frame == NULL) {
+        return false;
+    }
+    if (!spsc_push(&queues[producer], frame)) {
+        frame_release(frame);
+        return false;
+    }
+    if (!atomic_exchange(&wake_pending, true)) {
+        uint64_t one = 1;
+        if (write(wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            perror("eventfd write");
+        }
+    }
+    return true;
+}
+// Connects to the hub, -1 if it isn't reachable.
+static int connect_hub(void) {
+    struct sockaddr_storage address;
+    socklen_t length;
+    if (resolve(hub_address, false, &address, &length) != 0) {
+        return -1;
+    }
+    int fd = socket(address.ss_family, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&address, length) != 0) {
+        close(fd);
+        return -1;
+    }
+    tune_socket(fd, address.ss_family);
+    return fd;
+}
+// Reads what the hub sent and delivers every complete message. Returns false once the connection is gone.
+static bool receive(int fd, struct read_buffer *input) {
+    while (true) {
+        bool full_read;
+        ssize_t received = read_buffer_fill(fd, input, &full_read);
+        int error = (received < 0) ? errno : 0;
+        if (received == 0 || (received < 0 && error != EAGAIN && error != EWOULDBLOCK && error != EINTR)) {
+            return false;
+        }
+        struct binary_message message;
+        int result;
+        while ((result = binary_next_message(input, &message)) > 0) {
+            // Anything up to newest is a replay of what this instance already has.
+            if (message.type == RELAY_MESSAGE && message.id > newest) {
+                newest = message.id;
+                deliver(&message, message.room == instance);
+            }
+        }
+        if (result < 0) {
+            return false;
+        }
+        if ((received < 0 && error != EINTR) || (received > 0 && !full_read)) {
+            return true;
+        }
+    }
+}
+/*
+    Relay thread: keeps the connection to the hub, forwards what the shards publish and delivers what the hub sends.
+    While the hub is unreachable, published messages wait in the shards' queues, and those already taken off them
+    in outbound.
+*/
+static void *relay_main(void *arg) {
+    (void)arg;
+    if (memory_pool_thread_init() != 0) {
+        perror("memory_pool_thread_init");
+        exit(EXIT_FAILURE);
+    }
+    metrics_thread_init("relay");
+    struct outbound_queue outbound;
+    struct read_buffer input;
+    memset(&outbound, 0, sizeof(outbound));
+    memset(&input, 0, sizeof(input));
+    int fd = -1;
+    bool reported = false;
+
+    while (true) {
+        if (fd < 0) {
+            if ((fd = connect_hub()) < 0) {
+                if (!reported) {
+                    fprintf(stderr, "Relay hub %s is unreachable, retrying every %d second(s)\n", hub_address, RELAY_RECONNECT_INTERVAL);
+                    reported = true;
+                }
+                sleep(RELAY_RECONNECT_INTERVAL);
+                continue;
+            }
+            reported = false;
+            printf("Connected to relay hub %s as instance %u, at message %lld\n", hub_address, instance, newest);
+            // The hub answers with every message after the newest one we have.
+            struct binary_message hello = {RELAY_HELLO, 0, instance, 0, newest, 0, "", 0, "", 0};
+            struct frame *frame = binary_encode_message(&hello);
+            if (frame == NULL || !outbound_push_front(&outbound, frame)) {
+                perror("relay hello");
+                exit(EXIT_FAILURE);
+            }
+            frame_release(frame);
+        }
+
+        // Reset the eventfd before looking at the queues, so a message published while we drain wakes us again.
+        uint64_t count;
+        while (read(wake_fd, &count, sizeof(count)) < 0 && errno == EINTR) {
+        }
+        atomic_store(&wake_pending, false);
+        for (int i = 0; i < num_queues; i++) {
+            struct frame *frame;
+            while ((frame = spsc_pop(&queues[i])) != NULL) {
+                if (!outbound_push(&outbound, frame, SIZE_MAX, DROP_OLDEST)) {
+                    fprintf(stderr, "Relay queue allocation failed, dropping a message\n");
+                }
+                frame_release(frame);
+            }
+        }
+
+        int flushed = outbound_flush(fd, &outbound);
+        bool connected = (flushed >= 0);
+        if (connected) {
+            struct pollfd pfds[2] = {{fd, POLLIN | ((flushed > 0) ? POLLOUT : 0), 0}, {wake_fd, POLLIN, 0}};
+            if (poll(pfds, 2, -1) < 0 && errno != EINTR) {
+                perror("poll");
+            }
+            if (pfds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+                connected = receive(fd, &input);
+            }
+        }
+        if (!connected) {
+            // Messages not written yet go out after the next hello. One written in part may or may not have reached
+            // the hub, it isn't sent twice.
+            fprintf(stderr, "Lost relay hub %s, reconnecting\n", hub_address);
+            if (outbound_drop_partial(&outbound)) {
+                fprintf(stderr, "A message was cut off by the lost connection, it is dropped\n");
+            }
+            close(fd);
+            fd = -1;
+            read_buffer_free(&input);
+        }
+    }
+    return NULL;
+}
+
+/*
+    Hub side, single-threaded.
+    - peer: One connected instance. joined is set once its RELAY_HELLO arrived, only then does it get messages.
+      Peers closed during an iteration go on the closed list and are freed at its end, so pending events stay safe.
+    - peers: Every connected instance, a dense array walked for each message.
+    - sequence: The last sequence number handed out.
+    - reserved/state_fd: Sequence numbers up to reserved are recorded in the state file as possibly handed out.
+    - backlog: The newest RELAY_BACKLOG sequenced messages, encoded, with their ids. first is the index (never
+      wrapping) of the oldest one.
+*/
+struct hub_peer {
+    int fd;
+    bool joined;
+    uint32_t instance;
+    int index;
+    struct read_buffer input;
+    struct outbound_queue outbound;
+    struct hub_peer *next_closed;
+};
+struct relay_hub {
+    int epoll_fd;
+    struct hub_peer **peers;
+    int peer_count;
+    int peer_capacity;
+    struct hub_peer *closed;
+    long long sequence;
+    long long reserved;
+    int state_fd;
+    struct frame *backlog[RELAY_BACKLOG];
+    long long backlog_ids[RELAY_BACKLOG];
+    uint64_t first;
+    uint64_t count;
+};
+
+static void hub_close(struct relay_hub *hub, struct hub_peer *peer) {
+    if (peer->fd < 0) {
+        return;
+    }
+    if (peer->joined) {
+        printf("Instance %u left the relay, %d connection(s) remain\n", peer->instance, hub->peer_count - 1);
+    }
+    close(peer->fd);
+    peer->fd = -1;
+    struct hub_peer *last = hub->peers[--hub->peer_count];
+    hub->peers[peer->index] = last;
+    last->index = peer->index;
+    peer->next_closed = hub->closed;
+    hub->closed = peer;
+}
+static void hub_accept(struct relay_hub *hub, int listener) {
+    while (true) {
+        struct sockaddr_storage address;
+        socklen_t length = sizeof(address);
+        int fd = accept(listener, (struct sockaddr *)&address, &length);
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("accept");
+            }
+            return;
+        }
+        tune_socket(fd, address.ss_family);
+        struct hub_peer *peer = calloc(1, sizeof(struct hub_peer));
+        if (peer != NULL && hub->peer_count == hub->peer_capacity) {
+            int capacity = hub->peer_capacity ? hub->peer_capacity * 2 : 16;
+            struct hub_peer **peers = realloc(hub->peers, capacity * sizeof(struct hub_peer *));
+            if (peers == NULL) {
+                free(peer);
+                peer = NULL;
+            } else {
+                hub->peers = peers;
+                hub->peer_capacity = capacity;
+            }
+        }
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.ptr = peer;
+        if (peer == NULL || epoll_ctl(hub->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+            perror("relay accept");
+            free(peer);
+            close(fd);
+            continue;
+        }
+        peer->fd = fd;
+        peer->index = hub->peer_count;
+        hub->peers[hub->peer_count++] = peer;
+    }
+}
+/*
+    Records that sequence numbers up to sequence + RELAY_SEQUENCE_RESERVE may be handed out, before any of them is.
+    A fixed width number is overwritten in place, so the file never holds a mix of two reservations.
+*/
+static bool hub_reserve(struct relay_hub *hub) {
+    char text[32];
+    long long reserved = hub->sequence + RELAY_SEQUENCE_RESERVE;
+    int length = snprintf(text, sizeof(text), "%020lld\n", reserved);
+    if (pwrite(hub->state_fd, text, length, 0) != length || fdatasync(hub->state_fd) != 0) {
+        perror("relay state");
+        return false;
+    }
+    hub->reserved = reserved;
+    return true;
+}
+// Takes the next sequence number, reserving more once the current reservation is used up. -1 if that failed.
+static long long hub_next_sequence(struct relay_hub *hub) {
+    if (hub->sequence >= hub->reserved && !hub_reserve(hub)) {
+        return -1;
+    }
+    return ++hub->sequence;
+}
+// An instance said which message it has up to: continue the sequence above it and send it everything newer.
+static void hub_join(struct relay_hub *hub, struct hub_peer *peer, const struct binary_message *hello) {
+    peer->joined = true;
+    peer->instance = hello->room;
+    // Only ahead of the state file if it was deleted, or the instance followed another hub.
+    if (hello->id > hub->sequence) {
+        hub->sequence = hello->id;
+        if (hub->sequence >= hub->reserved) {
+            hub_reserve(hub);
+        }
+    }
+    uint64_t index = hub->first;
+    while (index < hub->first + hub->count && hub->backlog_ids[index % RELAY_BACKLOG] <= hello->id) {
+        index++;
+    }
+    if (index == hub->first && hub->count > 0 && hub->backlog_ids[index % RELAY_BACKLOG] > hello->id + 1) {
+        fprintf(stderr, "Instance %u is behind the backlog, it misses messages %lld to %lld\n", peer->instance, (long long)hello->id + 1,
+                hub->backlog_ids[index % RELAY_BACKLOG] - 1);
+    }
+    printf("Instance %u joined the relay at message %lld, %llu to catch up on\n", peer->instance, (long long)hello->id,
+           (unsigned long long)(hub->first + hub->count - index));
+    for (; index < hub->first + hub->count; index++) {
+        // The replay may go past the high-water mark, it is bounded by the backlog.
+        if (!outbound_push(&peer->outbound, hub->backlog[index % RELAY_BACKLOG], SIZE_MAX, DROP_OLDEST)) {
+            hub_close(hub, peer);
+            return;
+        }
+    }
+}
+// Gives a published message the next sequence number, keeps it in the backlog and queues it for every instance.
+static void hub_sequence(struct relay_hub *hub, struct hub_peer *origin, struct binary_message *message) {
+    // Without a reservation on disk the number might be given again after a restart, the message is dropped instead.
+    if ((message->id = hub_next_sequence(hub)) < 0) {
+        fprintf(stderr, "Can't reserve sequence numbers, dropping a message from instance %u\n", origin->instance);
+        return;
+    }
+    message->room = origin->instance;
+    struct frame *frame = binary_encode_message(message);
+    if (frame == NULL) {
+        perror("relay sequence");
+        return;
+    }
+    if (hub->count == RELAY_BACKLOG) {
+        frame_release(hub->backlog[hub->first % RELAY_BACKLOG]);
+        hub->first++;
+        hub->count--;
+    }
+    hub->backlog[(hub->first + hub->count) % RELAY_BACKLOG] = frame; // The backlog keeps the reference we got
+    hub->backlog_ids[(hub->first + hub->count) % RELAY_BACKLOG] = message->id;
+    hub->count++;
+    // Backwards, closing a peer moves the last one into its place.
+    for (int i = hub->peer_count - 1; i >= 0; i--) {
+        struct hub_peer *peer = hub->peers[i];
+        if (peer->joined && !outbound_push(&peer->outbound, frame, RELAY_PEER_HIGH_WATER, EVICT)) {
+            fprintf(stderr, "Instance %u is too far behind, dropping it\n", peer->instance);
+            hub_close(hub, peer);
+        }
+    }
+}
+static void hub_read(struct relay_hub *hub, struct hub_peer *peer) {
+    while (peer->fd >= 0) {
+        bool full_read;
+        ssize_t received = read_buffer_fill(peer->fd, &peer->input, &full_read);
+        int error = (received < 0) ? errno : 0;
+        if (received == 0 || (received < 0 && error != EAGAIN && error != EWOULDBLOCK && error != EINTR)) {
+            hub_close(hub, peer);
+            return;
+        }
+        struct binary_message message;
+        int result = 0;
+        while (peer->fd >= 0 && (result = binary_next_message(&peer->input, &message)) > 0) {
+            if (message.type == RELAY_HELLO && !peer->joined) {
+                hub_join(hub, peer, &message);
+            } else if (message.type == RELAY_MESSAGE && peer->joined) {
+                hub_sequence(hub, peer, &message);
+            } else {
+                result = -1;
+                break;
+            }
+        }
+        if (result < 0) {
+            fprintf(stderr, "Malformed relay message, closing the connection\n");
+            hub_close(hub, peer);
+            return;
+        }
+        if ((received < 0 && error != EINTR) || (received > 0 && !full_read)) {
+            return;
+        }
+    }
+}
+// Opens the state file and continues above the reservation it holds. Returns false if it can't be used.
+static bool hub_load_state(struct relay_hub *hub, const char *state_path) {
+    char text[32] = "";
+    if ((hub->state_fd = open(state_path, O_RDWR | O_CREAT, 0644)) < 0 || pread(hub->state_fd, text, sizeof(text) - 1, 0) < 0) {
+        perror(state_path);
+        return false;
+    }
+    hub->sequence = atoll(text);
+    printf("Relay sequence continues after %lld\n", hub->sequence);
+    return hub_reserve(hub);
+}
+void relay_hub_run(const char *address, const char *state_path) {
+    struct sockaddr_storage listen_address;
+    socklen_t length;
+    if (resolve(address, true, &listen_address, &length) != 0) {
+        fprintf(stderr, "Can't resolve relay address %s\n", address);
+        return;
+    }
+    if (listen_address.ss_family == AF_UNIX) {
+        // A socket file left behind by an earlier hub would make bind fail.
+        unlink(((struct sockaddr_un *)&listen_address)->sun_path);
+    }
+    int one = 1;
+    int listener = socket(listen_address.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (listener < 0 || setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0 ||
+        bind(listener, (struct sockaddr *)&listen_address, length) != 0 || listen(listener, SOMAXCONN) != 0) {
+        perror(address);
+        return;
+    }
+    struct relay_hub *hub = calloc(1, sizeof(struct relay_hub));
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLET;
+    event.data.ptr = NULL;
+    if (hub == NULL || memory_pool_thread_init() != 0 || (hub->epoll_fd = epoll_create1(0)) < 0 ||
+        epoll_ctl(hub->epoll_fd, EPOLL_CTL_ADD, listener, &event) < 0) {
+        perror("relay hub setup");
+        return;
+    }
+    if (!hub_load_state(hub, state_path)) {
+        return;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    printf("Relay hub listening on %s\n", address);
+
+    struct epoll_event events[64];
+    while (true) {
+        int ready = epoll_wait(hub->epoll_fd, events, 64, -1);
+        if (ready < 0) {
+            if (errno != EINTR) {
+                perror("epoll_wait");
+            }
+            continue;
+        }
+        for (int i = 0; i < ready; i++) {
+            struct hub_peer *peer = events[i].data.ptr;
+            if (peer == NULL) {
+                hub_accept(hub, listener);
+            } else if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                hub_close(hub, peer);
+            } else if (events[i].events & (EPOLLIN | EPOLLRDHUP)) {
+                hub_read(hub, peer);
+            }
+        }
+        // Every instance gets what this iteration queued for it in one writev, a full socket continues on EPOLLOUT.
+        for (int i = hub->peer_count - 1; i >= 0; i--) {
+            struct hub_peer *peer = hub->peers[i];
+            if (peer->outbound.count > 0 && outbound_flush(peer->fd, &peer->outbound) < 0) {
+                hub_close(hub, peer);
+            }
+        }
+        while (hub->closed != NULL) {
+            struct hub_peer *peer = hub->closed;
+            hub->closed = peer->next_closed;
+            outbound_clear(&peer->outbound);
+            read_buffer_free(&peer->input);
+            free(peer);
+        }
+    }
+}
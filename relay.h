@@ -0,0 +1,67 @@
+#ifndef RELAY_H
+#define RELAY_H
+
+#include "binary_protocol.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#define RELAY_QUEUE_SIZE 16384                 // Messages one shard can have waiting for the relay thread
+#define RELAY_BACKLOG 16384                    // Sequenced messages the hub keeps for instances that reconnect
+#define RELAY_PEER_HIGH_WATER (64 * 1024 * 1024) // Bytes the hub queues for one instance before dropping it
+#define RELAY_RECONNECT_INTERVAL 1             // Seconds between two attempts to reach the hub
+#define RELAY_SEQUENCE_RESERVE 65536           // Sequence numbers the hub reserves in its state file at a time
+#define DEFAULT_RELAY_STATE "relay_hub.state"  // Where the hub keeps its sequence reservation
+
+/*
+    Federation of several server processes into one room. Every instance connects to a relay hub (--relay), a small
+    process of its own (chat_server --relay-hub) that the instances reach over a Unix domain socket ("unix:/path")
+    or a plain TCP connection ("host:port"). The hub is the one place messages are ordered:
+
+    - An instance doesn't deliver the messages its clients post, it publishes each of them to the hub once.
+    - The hub gives every message the next sequence number and sends it to every instance, its origin included.
+    - Each instance delivers the sequenced stream, in sequence order, to its own clients only. The sequence number
+      is the message id, so ids, history pages and the order clients see are the same on every instance.
+
+    Instances come and go without the others noticing. The hub keeps the last RELAY_BACKLOG messages, an instance
+    says which id it has up to when it (re)connects and gets everything after it.
+
+    Sequence numbers are never handed out twice, even across a hub restart. The instances alone can't guarantee
+    that: one that lags behind may reconnect to a restarted hub before an up to date one does, and the hub would
+    number again from where the lagging one is. So the hub reserves sequence numbers in a state file
+    (--relay-state), RELAY_SEQUENCE_RESERVE at a time, and a restarted hub continues above the last reservation.
+    Ids skip the unused rest of it then. The backlog isn't kept, an instance that was behind when the hub went
+    down misses what it hadn't received yet. Deleting the state file gives up the
+    guarantee, the hub then only continues above the newest id of the instances that have said hello.
+
+    The bus speaks the binary protocol's framing (see binary_protocol.h) with its own message types:
+    - RELAY_HELLO (instance to hub, first message): room is the instance's number, id the newest id it has.
+    - RELAY_MESSAGE: A chat message. room is the origin instance, user the sender's id there, timestamp in epoch
+      milliseconds, name the username and the payload the "time" string the client sent, a '\0', then the text.
+      id is 0 when an instance publishes it and the sequence number once the hub sends it out.
+*/
+enum relay_type { RELAY_HELLO = 1, RELAY_MESSAGE = 2 };
+
+/*
+    Called on the relay thread for every sequenced message, in sequence order. own is set for messages published
+    by this instance. message->name isn't null-terminated, the payload is.
+*/
+typedef void (*relay_callback)(const struct binary_message *message, bool own);
+
+/*
+    Connects to the hub at address from a thread of its own, reconnecting whenever the connection breaks.
+    producers is the number of shards that publish, newest_id the newest message id this instance already has.
+*/
+void relay_init(const char *address, int producers, long long newest_id, relay_callback deliver);
+/*
+    Publishes a message posted by a client of this instance, called from the shard that received it.
+    Returns false if it couldn't be queued for the hub (the relay thread is far behind).
+*/
+bool relay_publish(int producer, uint32_t user, int64_t timestamp_ms, const char *time, const char *username, const char *message,
+                   size_t message_length);
+/*
+    Runs the hub on address until the process is killed, keeping its sequence reservation in state_path.
+    Only returns if the address can't be listened on or the state file can't be used.
+*/
+void relay_hub_run(const char *address, const char *state_path);
+
+#endif
@@ -0,0 +1,161 @@
+#include "schema.h"
+#include "database.h"
+
+#define MIGRATION_LOCK 727001 // pg_advisory_lock key held while migrating
+
+/*
+    Every schema change ever made, in order. Index + 1 is the version a database has once it was applied.
+    Never edit an entry that was released, add a new one.
+*/
+static const char *migrations[] = {
+    // 1: The original tables, plus the Id column history pages seek on.
+    "CREATE TABLE IF NOT EXISTS Messages (Timestamp TIMESTAMP WITH TIME ZONE, Username TEXT PRIMARY KEY,Content TEXT); "
+    "ALTER TABLE Messages ADD COLUMN IF NOT EXISTS Id BIGSERIAL; "
+    "CREATE TABLE IF NOT EXISTS Usernames (Username TEXT PRIMARY KEY);",
+
+    // 2: Messages partitioned by the time the server stored them, one partition per day (created by the maintenance job)
+    //    plus a default partition that catches anything outside them, including the rows moved over from version 1.
+    //    Username is no longer the primary key, so a user can send more than one message. Ids are handed out by the server.
+    //    (Room, Id) serves history pages, a BRIN index on the append-ordered Created column serves time ranges cheaply.
+    "ALTER TABLE Messages RENAME TO messages_v1; "
+    "CREATE TABLE Messages ("
+    "    Id BIGINT NOT NULL,"
+    "    Room TEXT NOT NULL DEFAULT 'main',"
+    "    Created TIMESTAMP WITH TIME ZONE NOT NULL DEFAULT now(),"
+    "    Timestamp TIMESTAMP WITH TIME ZONE,"
+    "    Username TEXT NOT NULL,"
+    "    Content TEXT NOT NULL,"
+    "    PRIMARY KEY (Id, Created)"
+    ") PARTITION BY RANGE (Created); "
+    "CREATE TABLE messages_default PARTITION OF Messages DEFAULT; "
+    "CREATE INDEX messages_room_id_idx ON Messages (Room, Id); "
+    "CREATE INDEX messages_created_idx ON Messages USING BRIN (Created); "
+    "INSERT INTO Messages (Id, Created, Timestamp, Username, Content) "
+    "    SELECT Id, COALESCE(Timestamp, now()), Timestamp, Username, COALESCE(Content, '') FROM messages_v1; "
+    "DROP TABLE messages_v1;",
+};
+
+// Runs one statement (or several separated by ';') and reports whether it succeeded.
+static bool run(PGconn *conn, const char *sql) {
+    PGresult *res = PQexec(conn, sql);
+    bool ok = (PQresultStatus(res) == PGRES_COMMAND_OK || PQresultStatus(res) == PGRES_TUPLES_OK);
+    if (!ok) {
+        fprintf(stderr, "Schema statement failed: %s", PQerrorMessage(conn));
+    }
+    PQclear(res);
+    return ok;
+}
+void migrate_schema(PGconn *conn) {
+    char sql[128];
+    snprintf(sql, sizeof(sql), "SELECT pg_advisory_lock(%d);", MIGRATION_LOCK);
+    if (!run(conn, sql) || !run(conn, "CREATE TABLE IF NOT EXISTS SchemaVersion (Version INT NOT NULL); "
+                                      "INSERT INTO SchemaVersion SELECT 0 WHERE NOT EXISTS (SELECT 1 FROM SchemaVersion);")) {
+        exit(EXIT_FAILURE);
+    }
+
+    PGresult *res = PQexec(conn, "SELECT Version FROM SchemaVersion;");
+    if (PQresultStatus(res) != PGRES_TUPLES_OK || PQntuples(res) != 1) {
+        fprintf(stderr, "Failed to read schema version: %s", PQerrorMessage(conn));
+        exit(EXIT_FAILURE);
+    }
+    int version = atoi(PQgetvalue(res, 0, 0));
+    PQclear(res);
+
+    int latest = sizeof(migrations) / sizeof(migrations[0]);
+    for (; version < latest; version++) {
+        printf("Migrating database schema to version %d\n", version + 1);
+        snprintf(sql, sizeof(sql), "UPDATE SchemaVersion SET Version = %d; COMMIT;", version + 1);
+        if (!run(conn, "BEGIN;") || !run(conn, migrations[version]) || !run(conn, sql)) {
+            run(conn, "ROLLBACK;");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    snprintf(sql, sizeof(sql), "SELECT pg_advisory_unlock(%d);", MIGRATION_LOCK);
+    run(conn, sql);
+}
+
+static int retention;
+static bool archive_expired;
+static pthread_t maintenance;
+
+// Formats the UTC day `days` from now as YYYYMMDD (for names) and YYYY-MM-DD (for partition bounds).
+static void day_from_now(int days, char name[9], char date[11]) {
+    time_t t = time(NULL) + (time_t)days * 86400;
+    struct tm day;
+    gmtime_r(&t, &day);
+    strftime(name, 9, "%Y%m%d", &day);
+    strftime(date, 11, "%Y-%m-%d", &day);
+}
+// Creates the daily partitions from today up to PARTITION_DAYS_AHEAD days ahead.
+static void create_partitions(PGconn *conn) {
+    for (int days = 0; days <= PARTITION_DAYS_AHEAD; days++) {
+        char name[9], from[11], to_name[9], to[11], sql[256];
+        day_from_now(days, name, from);
+        day_from_now(days + 1, to_name, to);
+        snprintf(sql, sizeof(sql),
+                 "CREATE TABLE IF NOT EXISTS messages_%s PARTITION OF Messages FOR VALUES FROM ('%s 00:00:00+00') TO ('%s 00:00:00+00');",
+                 name, from, to);
+        // Fails if the default partition already holds rows of that day, they then simply stay there.
+        run(conn, sql);
+    }
+}
+// Drops (or archives) every daily partition older than the retention period and expired rows of the default partition.
+static void expire_partitions(PGconn *conn) {
+    char cutoff_name[9], cutoff[11], sql[256];
+    day_from_now(-retention, cutoff_name, cutoff);
+
+    // Partition names sort like their dates, so "older than the cutoff" is a string comparison.
+    snprintf(sql, sizeof(sql),
+             "SELECT c.relname FROM pg_inherits i JOIN pg_class c ON c.oid = i.inhrelid JOIN pg_class p ON p.oid = i.inhparent "
+             "WHERE p.relname = 'messages' AND c.relname ~ '^messages_[0-9]{8}$' AND c.relname < 'messages_%s';",
+             cutoff_name);
+    PGresult *res = PQexec(conn, sql);
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        fprintf(stderr, "Failed to list expired partitions: %s", PQerrorMessage(conn));
+        PQclear(res);
+        return;
+    }
+    for (int i = 0; i < PQntuples(res); i++) {
+        const char *partition = PQgetvalue(res, i, 0);
+        if (archive_expired) {
+            snprintf(sql, sizeof(sql), "ALTER TABLE Messages DETACH PARTITION %s; ALTER TABLE %s RENAME TO archive_%s;",
+                     partition, partition, partition);
+        } else {
+            snprintf(sql, sizeof(sql), "DROP TABLE %s;", partition);
+        }
+        if (run(conn, sql)) {
+            printf("%s expired partition %s\n", archive_expired ? "Archived" : "Dropped", partition);
+        }
+    }
+    PQclear(res);
+
+    // The default partition only holds rows from before partitioning (or days a partition couldn't be created for).
+    snprintf(sql, sizeof(sql), "DELETE FROM messages_default WHERE Created < '%s 00:00:00+00';", cutoff);
+    run(conn, sql);
+}
+static void *maintenance_job(void *arg) {
+    (void)arg;
+    while (true) {
+        PGconn *conn = db_checkout();
+        if (retention > 0) {
+            expire_partitions(conn);
+        }
+        create_partitions(conn);
+        db_checkin(conn);
+        sleep(MAINTENANCE_INTERVAL);
+    }
+    return NULL;
+}
+void schema_maintenance_start(int retention_days, bool archive) {
+    retention = retention_days;
+    archive_expired = archive;
+    // Run once before the server takes messages, so today's partition exists from the first insert on.
+    PGconn *conn = db_checkout();
+    create_partitions(conn);
+    db_checkin(conn);
+    if (pthread_create(&maintenance, NULL, maintenance_job, NULL) != 0) {
+        perror("pthread_create");
+        exit(EXIT_FAILURE);
+    }
+}
@@ -0,0 +1,23 @@
+#ifndef SCHEMA_H
+#define SCHEMA_H
+
+#include <libpq-fe.h>
+#include <stdbool.h>
+
+#define PARTITION_DAYS_AHEAD 7        // Daily Messages partitions created in advance
+#define MAINTENANCE_INTERVAL 3600     // Seconds between runs of the partition/retention job
+
+/*
+    Brings the database schema up to date. Migrations are numbered and applied in order, each in its own
+    transaction together with the bump of SchemaVersion, under an advisory lock so several servers starting at
+    once don't race each other. Exits if a migration fails, the statements depend on the current schema.
+*/
+void migrate_schema(PGconn *conn);
+/*
+    Starts the background job that keeps daily partitions of Messages created ahead of time and enforces retention:
+    partitions (and rows in the default partition) older than retention_days are dropped, or detached and kept as
+    archive_messages_YYYYMMDD tables if archive is set. retention_days 0 keeps everything.
+*/
+void schema_maintenance_start(int retention_days, bool archive);
+
+#endif
@@ -1,9 +1,15 @@
-#include "database.h" //Database functions
+#include "server.h"
 
-#define PORT 8080
-#define MAX_CLIENTS 10
-int client_sockets[MAX_CLIENTS];
-pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+struct shard *shards;
+int num_shards;
+struct history_ring recent_history; // The room's newest messages, shared by all shards
+struct server_config config = {0, DEFAULT_OUTBOUND_HIGH_WATER, DROP_OLDEST, DEFAULT_PERSIST_BATCH_SIZE, DEFAULT_PERSIST_FLUSH_INTERVAL, DEFAULT_STORAGE, DEFAULT_LOG_DIR, 0, 0, false,
+                              DEFAULT_ROOM_CAPACITY, DEFAULT_QUEUE_LIMIT, 0, 0, NULL, NULL, NULL, DEFAULT_RELAY_STATE, 0, 0,
+                              DEFAULT_RATE_BURST};
+struct admission_queue admission; // The room's seats and the users waiting for one, across all shards
+struct username_registry usernames; // Every known username and which ones are in use, shared by all shards
+static atomic_int binary_clients; // Clients speaking the binary protocol, broadcasts are only binary encoded while there are any
+static bool precise_waits; // epoll_pwait2 is there and a coalescing window is configured, waits are timed in nanoseconds
 
 void printIPAddress(int port) {
     char hostname[1024];
@@ -15,39 +21,201 @@ void printIPAddress(int port) {
     printf("Server running at IP: %s, Port: %d\n", ip_address, port);
 }
 
-//Attempt at multithreading
-void *handle_client(void *cs);
+//Event loop handlers, each of them runs on the thread of the shard that owns the socket.
+int set_nonblocking(int fd);
+int create_listener(struct sockaddr_in *address, bool resolve_address);
+void *run_shard(void *arg);
+void accept_new_clients(struct shard *shard);
+void handle_client(struct shard *shard, struct client *client);
+void disconnect_client(struct shard *shard, struct client *client);
+void expire_pending_usernames(struct shard *shard);
+void update_queue_positions(struct shard *shard);
+void report_allocations(struct shard *shard);
+void write_room_gauges(FILE *out);
+void broadcast_message(struct shard *shard, struct client *sender, struct frame *frame);
+void drain_inbox(struct shard *shard);
+void flush_client(struct shard *shard, struct client *client);
+void flush_dirty_clients(struct shard *shard);
+void release_closed_clients(struct shard *shard);
+void resume_throttled_clients(struct shard *shard);
+void parse_arguments(int argc, char *argv[]);
+void load_recent_history();
+void load_usernames_registry();
+static void deliver_relayed(const struct binary_message *message, bool own);
+static void history_page_read(struct history_job *job);
+static void wake_shard(struct shard *target);
+static bool epoll_pwait2_supported(void);
 
 int try_bind_alternative_addresses(int server_fd, struct sockaddr_in *address);
 
-int main()
+int main(int argc, char *argv[])
 {
-    pthread_mutex_init(&mutex, NULL);
+    parse_arguments(argc, argv);
+    // cJSON allocates from the reactor threads' arenas while they handle a message, see memory_pool.h.
+    memory_pool_init();
+    // A relay hub only orders and forwards the messages of the federated instances, it has no clients of its own.
+    if (config.relay_hub != NULL)
+    {
+        relay_hub_run(config.relay_hub, config.relay_state);
+        exit(EXIT_FAILURE);
+    }
+    if (history_block_init(config.history_dictionary) != 0)
+    {
+        perror(config.history_dictionary);
+        exit(EXIT_FAILURE);
+    }
     /*
-        - server_fd: This variable represents the file descriptor for the server socket. It is used to accept incoming connections and manage communication with clients.
-        - client_sockets[MAX_CLIENTS]: This array is used to store file descriptors for client sockets. Each element of the array corresponds to a connected client. When a new client connects, its socket descriptor is stored in an available slot in this array.
-        - new_socket: This variable holds the file descriptor for a newly accepted client connection. It is used to communicate with the specific client.
-        - max_sd: This variable tracks the maximum file descriptor value among all active sockets (both server and client sockets). It is used as an argument to the select() function to determine the highest descriptor to check for activity.
-        - activity: This variable stores the return value of the select() function, indicating the number of sockets with activity (readiness for reading) detected.
-        - address: This variable is of type struct sockaddr_in and represents the server's address. It is used for binding the server socket to a specific IP address and port.
-        - readfds: This variable is of type fd_set and represents the set of file descriptors to be monitored for activity by the select() function. It is initialized and updated before each call to select().
-        - buffer[1024]: This array is used to store data received from clients. It serves as a buffer for incoming messages.
-        - opt: This variable is used to set socket options, such as SO_REUSEADDR and SO_REUSEPORT. It allows multiple sockets to bind to the same address and port.
-        - addrlen: This variable of type socklen_t is used to store the size of the address structure (struct sockaddr_in) when calling functions like accept(). It is passed as a pointer to accept() to retrieve the actual size of the client's address structure.
+        - shards: One reactor per core. Each shard owns a listener, an epoll instance and a slice of the clients (see struct shard in server.h).
+        - num_shards: --shards if given, otherwise the number of online cores, capped at MAX_SHARDS.
+        - address: This variable is of type struct sockaddr_in and represents the server's address. The first listener resolves it, the others bind to the same one.
     */
-    int server_fd, new_socket, max_sd, activity;
     struct sockaddr_in address;
-    fd_set readfds;
-    char server_buffer[1024] = {0};
+
+    long cores = (config.shards > 0) ? config.shards : sysconf(_SC_NPROCESSORS_ONLN);
+    num_shards = (cores < 1) ? 1 : (cores > MAX_SHARDS) ? MAX_SHARDS : (int)cores;
+    shards = calloc(num_shards, sizeof(struct shard));
+    if (shards == NULL)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    if (admission_init(&admission, config.room_capacity, config.queue_limit, num_shards) != 0)
+    {
+        perror("admission_init");
+        exit(EXIT_FAILURE);
+    }
+
+    // Only background threads query the database, by default each of them gets a connection of its own.
+    if (storage_init(config.storage, (config.db_pool_size > 0) ? config.db_pool_size : DEFAULT_DB_POOL_SIZE, config.log_dir) != 0)
+    {
+        fprintf(stderr, "Unknown storage %s\n", config.storage);
+        exit(EXIT_FAILURE);
+    }
+    storage_maintenance_start(config.retention_days, config.archive_expired);
+    load_recent_history();
+    load_usernames_registry();
+
+    // sets the socket address structure's family to use IPV4 protocol
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+
+    /*This line sets the port number of the socket to PORT. Before assigning the port number,
+    the htons() function is used to convert the port number from host byte order to network byte order.
+    This conversion is necessary because different systems may use different byte orders (big-endian or little-endian),
+    and network protocols require a consistent byte order for port numbers. By using htons(), the port number is appropriately
+    formatted for use in network communication.*/
+    address.sin_port = htons(PORT);
+
+    for (int i = 0; i < num_shards; i++)
+    {
+        struct shard *shard = &shards[i];
+        shard->id = i;
+        slot_table_init(&shard->clients, sizeof(struct client));
+        shard->server_fd = create_listener(&address, i == 0);
+
+        /*
+        The server socket is non-blocking and registered edge-triggered (EPOLLET): epoll only reports it when new
+        connections arrive, so every notification has to be drained with accept() until it returns EAGAIN.
+        The listening socket is told apart from clients by a NULL data pointer, the wake_fd by a pointer to the shard itself.
+        */
+        struct epoll_event event;
+        if ((shard->epoll_fd = epoll_create1(0)) < 0 || (shard->wake_fd = eventfd(0, EFD_NONBLOCK)) < 0)
+        {
+            perror("epoll setup");
+            exit(EXIT_FAILURE);
+        }
+        event.events = EPOLLIN | EPOLLET;
+        event.data.ptr = NULL;
+        if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, shard->server_fd, &event) < 0)
+        {
+            perror("epoll_ctl");
+            exit(EXIT_FAILURE);
+        }
+        event.data.ptr = shard;
+        if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, shard->wake_fd, &event) < 0)
+        {
+            perror("epoll_ctl");
+            exit(EXIT_FAILURE);
+        }
+        atomic_init(&shard->wake_pending, false);
+        for (int j = 0; j < num_shards; j++)
+        {
+            if (j != i && spsc_init(&shard->inbox[j], SHARD_QUEUE_SIZE) != 0)
+            {
+                perror("spsc_init");
+                exit(EXIT_FAILURE);
+            }
+        }
+        if ((config.relay != NULL && spsc_init(&shard->relay_inbox, SHARD_QUEUE_SIZE) != 0) ||
+            spsc_init(&shard->history_inbox, HISTORY_READER_QUEUE_SIZE) != 0)
+        {
+            perror("spsc_init");
+            exit(EXIT_FAILURE);
+        }
+    }
+    printf("Running %d reactor shard(s)\n", num_shards);
+
+    // Hot path counters and latencies for Prometheus, served by a thread of their own.
+    if (config.admin_port > 0)
+    {
+        if (metrics_serve(config.admin_port, write_room_gauges) != 0)
+        {
+            perror("metrics_serve");
+            exit(EXIT_FAILURE);
+        }
+        printf("Serving metrics on 127.0.0.1:%d\n", config.admin_port);
+    }
+
+    // A coalescing window shorter than a millisecond needs epoll_pwait2, without it the window is rounded up.
+    if (config.coalesce_window_us > 0 && !(precise_waits = epoll_pwait2_supported()))
+    {
+        fprintf(stderr, "epoll_pwait2 isn't supported by this kernel, --coalesce-us is timed in whole milliseconds\n");
+    }
+
+    // History pages older than the ring are read by a thread of their own, the shards never wait for storage.
+    history_reader_init(num_shards, history_page_read);
+
+    // Messages are stored by a background writer thread, one queue per shard (and one for the relay thread) feeds it.
+    persist_init((config.relay != NULL) ? num_shards + 1 : num_shards, config.persist_batch_size, config.persist_flush_interval);
+
+    // Federated: the room's messages come from the relay hub, sequenced, starting after the newest one we loaded.
+    if (config.relay != NULL)
+    {
+        relay_init(config.relay, num_shards, recent_history.next_id - 1, deliver_relayed);
+    }
+
+    // Accept incoming connections and handle chat logic, one thread per shard
+    for (int i = 0; i < num_shards; i++)
+    {
+        if (pthread_create(&shards[i].thread, NULL, run_shard, &shards[i]) != 0)
+        {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < num_shards; i++)
+    {
+        pthread_join(shards[i].thread, NULL);
+    }
+
+    return 0;
+}
+/*
+Creates one non-blocking listening socket. Every shard calls this, SO_REUSEPORT lets all of them bind the
+same address and the kernel load balances incoming connections between them.
+The first call resolves the address with try_bind_alternative_addresses, later calls reuse what it found.
+*/
+int create_listener(struct sockaddr_in *address, bool resolve_address)
+{
+    int server_fd;
     int opt = 1;
-    socklen_t addrlen; // Add socklen_t addrlen;
 
     // Create a master socket
     /*Master socket is the main socket responsible for accepting incoming client requests to the servre
     when a new connection is accepted, a new socket is created to handle it and this master socket stays
     listening(waiting) for another connection
     */
-    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    if ((server_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0)
     {
         perror("socket failed");
         exit(EXIT_FAILURE);
@@ -59,243 +227,1639 @@ int main()
     - SOL_SOCKET: This specifies the level at which the option is defined. SOL_SOCKET indicates that the option is at the socket level.
     - SO_REUSEADDR: This is the socket option you want to set. It enables the reuse of local addresses. When this option is set,
       it allows other sockets to bind to the same port, even if the socket is in a TIME_WAIT state (waiting for packets to expire after closing).
+    - SO_REUSEPORT: Lets every shard bind its own socket to the same address and port.
     - &opt: it's a pointer to the variable opt, which likely has a value of 1 to enable the option.
     */
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)))
+    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) ||
+        setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)))
     {
         perror("setsockopt");
         exit(EXIT_FAILURE);
     }
 
-    // sets the socket address structure's family to use IPV4 protocol
-    address.sin_family = AF_INET;
-
-    /*This line sets the IP address of the socket to INADDR_ANY. When binding a socket to this address,
-    the socket can receive packets destined for any of the IP addresses assigned to the host. It allows the socket to accept connections on any available network interface.*/
-
-    /*This line sets the port number of the socket to PORT. Before assigning the port number,
-    the htons() function is used to convert the port number from host byte order to network byte order.
-    This conversion is necessary because different systems may use different byte orders (big-endian or little-endian),
-    and network protocols require a consistent byte order for port numbers. By using htons(), the port number is appropriately
-    formatted for use in network communication.*/
-    address.sin_port = htons(PORT);
-
     /*
     Overall, this code snippet ensures that the server socket is successfully bound to the specified address and port.
     If the binding operation fails, an error message is printed, and the program exits with a failure status.
     This is crucial for error handling and ensuring that the server can properly initialize and start listening for incoming connections.
     */
-    if (try_bind_alternative_addresses(server_fd, &address) != 0) {
-        printf("Failed to bind to any alternative IP addresses. Exiting.\n");
+    if (resolve_address)
+    {
+        if (try_bind_alternative_addresses(server_fd, address) != 0) {
+            printf("Failed to bind to any alternative IP addresses. Exiting.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    else if (bind(server_fd, (struct sockaddr *)address, sizeof(*address)) != 0)
+    {
+        perror("bind");
         exit(EXIT_FAILURE);
     }
 
     // Listen for incoming connections, this returns the number of connections which will be -1 in case of error, and positive with the number of incoming connections
-    // MAX_CLIENTS is the max length of the queue of pending connections
-    if (listen(server_fd, MAX_CLIENTS) < 0)
+    // SOMAXCONN is the max length of the queue of pending connections, the room capacity is enforced on accept instead
+    if (listen(server_fd, SOMAXCONN) < 0)
     {
         perror("listen");
         exit(EXIT_FAILURE);
     }
-
-    // Accept incoming connections and handle chat logic
-    while (true)
+    return server_fd;
+}
+static void load_history_row(void *context, const char *json, size_t length)
+{
+    int *rows = context;
+    cJSON *row = cJSON_ParseWithLength(json, length);
+    cJSON *id_item = cJSON_GetObjectItem(row, "id");
+    if (cJSON_IsNumber(id_item))
     {
-        /*
-        - FD_ZERO(&readfds): This macro initializes the file descriptor set readfds to be empty. It clears all file descriptors from the set,
-        ensuring that it starts with no sockets registered for monitoring.
-
-        - FD_SET(server_fd, &readfds): This macro adds the server socket (server_fd) to the file descriptor set readfds.
-        It indicates to the select() function that it should monitor the server socket for any activity, such as incoming connections.
-
-        - max_sd = server_fd: This line sets the variable max_sd to the value of the server socket descriptor (server_fd).
-        This variable is typically used to keep track of the maximum socket descriptor value among all sockets being monitored.
-        It's initialized with the server socket descriptor because it's the only socket being monitored at this point.
-        */
-        FD_ZERO(&readfds);
-        FD_SET(server_fd, &readfds);
-        max_sd = server_fd;
+        history_ring_load(&recent_history, (long long)id_item->valuedouble, json, length);
+        (*rows)++;
+    }
+    cJSON_Delete(row);
+}
+/*
+Fills the in-memory ring with the newest messages from the database, which also tells it where message ids continue.
+After this, joins and recent history pages are answered from memory.
+*/
+void load_recent_history()
+{
+    struct history_request request = {DEFAULT_ROOM, HISTORY_LAST, 0, HISTORY_RING_ENTRIES};
+    int rows = 0;
+    if (history_ring_init(&recent_history, HISTORY_RING_BYTES, HISTORY_RING_ENTRIES) != 0)
+    {
+        perror("history_ring_init");
+        exit(EXIT_FAILURE);
+    }
+    if (!send_chat_history(&request, load_history_row, &rows))
+    {
+        // Without knowing the newest id we could hand out ids that are already taken.
+        fprintf(stderr, "Failed to load recent history\n");
+        exit(EXIT_FAILURE);
+    }
+    history_ring_loaded(&recent_history, rows < HISTORY_RING_ENTRIES);
+    printf("Loaded %d recent message(s), next message id is %lld\n", rows, recent_history.next_id);
+}
+static void load_username_row(void *context, const char *username)
+{
+    int *rows = context;
+    if (username_registry_add(&usernames, username))
+    {
+        (*rows)++;
+    }
+}
+// Loads every stored username into the registry, logins are checked against it instead of the database from then on.
+void load_usernames_registry()
+{
+    int rows = 0;
+    if (username_registry_init(&usernames) != 0)
+    {
+        perror("username_registry_init");
+        exit(EXIT_FAILURE);
+    }
+    if (!load_usernames(load_username_row, &rows))
+    {
+        // A registry missing stored names would register them a second time.
+        fprintf(stderr, "Failed to load usernames\n");
+        exit(EXIT_FAILURE);
+    }
+    printf("Loaded %d username(s)\n", rows);
+}
+/*
+Reads the optional settings:
+    --shards=N              Number of reactor threads (default: one per core).
+    --outbound-limit=BYTES  High-water mark of a client's outbound queue.
+    --slow-consumer=drop|evict  What happens to a client over that mark.
+    --batch-size=N          Messages stored per database transaction at most.
+    --flush-interval=MS     Longest time a message waits before it is stored.
+    --storage=postgres|log|memory  Where messages and usernames are stored (default: postgres).
+    --log-dir=PATH          Directory of the embedded message log (default: chat_log).
+    --db-pool=N             Number of database connections (default: 3, the writer, the history reader and the retention job).
+    --retention-days=N      Drop messages older than N days (default: keep everything).
+    --archive-expired       Keep expired days as detached archive_* tables (or archive-* log segments) instead of dropping them.
+    --room-capacity=N       Members in the room at once (default: 10000).
+    --queue-limit=N         Users that may wait for a seat once the room is full (default: 1000).
+    --alloc-report=SECONDS  Print the allocations per client message every SECONDS (default: off).
+    --admin-port=N          Serve metrics in the Prometheus text format on 127.0.0.1:N (default: off).
+    --history-dictionary=FILE  Preset dictionary for compressed history blocks (default: built in).
+    --relay=ADDRESS         Federate with the other instances on the relay hub at unix:PATH or HOST:PORT (default: standalone).
+    --relay-hub=ADDRESS     Run a relay hub on ADDRESS instead of a chat server.
+    --relay-state=FILE      Where the relay hub keeps its sequence reservation (default: relay_hub.state).
+    --coalesce-us=N         Hold a shard's output for up to N microseconds to send it in fewer writes (default: 0, at once).
+    --rate-limit=N          Messages per second a client may post, more are read later (default: unlimited).
+    --rate-burst=N          Messages a client may post at once before the rate limit applies (default: 20).
+*/
+void parse_arguments(int argc, char *argv[])
+{
+    static const struct option options[] = {
+        {"shards", required_argument, NULL, 's'},
+        {"outbound-limit", required_argument, NULL, 'o'},
+        {"slow-consumer", required_argument, NULL, 'c'},
+        {"batch-size", required_argument, NULL, 'b'},
+        {"flush-interval", required_argument, NULL, 'f'},
+        {"storage", required_argument, NULL, 'S'},
+        {"log-dir", required_argument, NULL, 'l'},
+        {"db-pool", required_argument, NULL, 'd'},
+        {"retention-days", required_argument, NULL, 'r'},
+        {"archive-expired", no_argument, NULL, 'a'},
+        {"room-capacity", required_argument, NULL, 'm'},
+        {"queue-limit", required_argument, NULL, 'q'},
+        {"alloc-report", required_argument, NULL, 'A'},
+        {"admin-port", required_argument, NULL, 'P'},
+        {"history-dictionary", required_argument, NULL, 'D'},
+        {"relay", required_argument, NULL, 'R'},
+        {"relay-hub", required_argument, NULL, 'H'},
+        {"relay-state", required_argument, NULL, 'T'},
+        {"coalesce-us", required_argument, NULL, 'C'},
+        {"rate-limit", required_argument, NULL, 'L'},
+        {"rate-burst", required_argument, NULL, 'B'},
+        {NULL, 0, NULL, 0}};
+    int opt;
 
-        // Set client sockets array to associated cs values.
-        for (int i = 0; i < MAX_CLIENTS; i++)
+    while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1)
+    {
+        switch (opt)
         {
-            int sd = client_sockets[i];
-            if (sd > 0)
+        case 's':
+            config.shards = atoi(optarg);
+            break;
+        case 'o':
+            config.outbound_high_water = strtoull(optarg, NULL, 10);
+            break;
+        case 'c':
+            if (strcmp(optarg, "drop") == 0)
+            {
+                config.slow_consumer_policy = DROP_OLDEST;
+            }
+            else if (strcmp(optarg, "evict") == 0)
             {
-                FD_SET(sd, &readfds);
+                config.slow_consumer_policy = EVICT;
             }
-            if (sd > max_sd)
+            else
             {
-                max_sd = sd;
+                fprintf(stderr, "--slow-consumer must be drop or evict\n");
+                exit(EXIT_FAILURE);
             }
+            break;
+        case 'b':
+            config.persist_batch_size = atoi(optarg);
+            break;
+        case 'f':
+            config.persist_flush_interval = atoi(optarg);
+            break;
+        case 'S':
+            config.storage = optarg;
+            break;
+        case 'l':
+            config.log_dir = optarg;
+            break;
+        case 'd':
+            config.db_pool_size = atoi(optarg);
+            break;
+        case 'r':
+            config.retention_days = atoi(optarg);
+            break;
+        case 'a':
+            config.archive_expired = true;
+            break;
+        case 'm':
+            config.room_capacity = atoi(optarg);
+            break;
+        case 'q':
+            config.queue_limit = atoi(optarg);
+            break;
+        case 'A':
+            config.alloc_report_interval = atoi(optarg);
+            break;
+        case 'P':
+            config.admin_port = atoi(optarg);
+            break;
+        case 'D':
+            config.history_dictionary = optarg;
+            break;
+        case 'R':
+            config.relay = optarg;
+            break;
+        case 'H':
+            config.relay_hub = optarg;
+            break;
+        case 'T':
+            config.relay_state = optarg;
+            break;
+        case 'C':
+            config.coalesce_window_us = atoi(optarg);
+            break;
+        case 'L':
+            config.rate_limit = atoi(optarg);
+            break;
+        case 'B':
+            config.rate_burst = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [--shards=N] [--outbound-limit=BYTES] [--slow-consumer=drop|evict] [--batch-size=N] [--flush-interval=MS] [--storage=postgres|log|memory] [--log-dir=PATH] [--db-pool=N] [--retention-days=N] [--archive-expired] [--room-capacity=N] [--queue-limit=N] [--alloc-report=SECONDS] [--admin-port=N] [--history-dictionary=FILE] [--relay=ADDRESS] [--relay-hub=ADDRESS] [--relay-state=FILE] [--coalesce-us=N] [--rate-limit=N] [--rate-burst=N]\n", argv[0]);
+            exit(EXIT_FAILURE);
         }
+    }
+    if (config.persist_batch_size < 1 || config.persist_flush_interval < 1)
+    {
+        fprintf(stderr, "--batch-size and --flush-interval must be positive\n");
+        exit(EXIT_FAILURE);
+    }
+    if (config.room_capacity < 1 || config.queue_limit < 0)
+    {
+        fprintf(stderr, "--room-capacity must be positive and --queue-limit can't be negative\n");
+        exit(EXIT_FAILURE);
+    }
+    if (config.coalesce_window_us < 0 || config.rate_limit < 0 || config.rate_burst < 1)
+    {
+        fprintf(stderr, "--coalesce-us and --rate-limit can't be negative and --rate-burst must be positive\n");
+        exit(EXIT_FAILURE);
+    }
+}
+/*
+Whether epoll_pwait2 (Linux 5.11) is available, tried once on a throwaway epoll instance. Older kernels answer ENOSYS.
+*/
+static bool epoll_pwait2_supported(void)
+{
+    struct epoll_event event;
+    struct timespec no_wait = {0, 0};
+    int epoll_fd = epoll_create1(0);
+    if (epoll_fd < 0)
+    {
+        return false;
+    }
+    bool supported = epoll_pwait2(epoll_fd, &event, 1, &no_wait, NULL) >= 0 || errno != ENOSYS;
+    close(epoll_fd);
+    return supported;
+}
+/*
+Waits for the shard's next events: a second at most for the timers, less while output waits for the coalescing window
+to pass or a throttled client for its next token. epoll_wait counts in milliseconds, so with a window configured the
+wait goes through epoll_pwait2 instead where the kernel has it.
+*/
+static int wait_for_events(struct shard *shard, struct epoll_event *events)
+{
+    uint64_t timeout = 1000000000ULL;
+    if (shard->dirty_count > 0 && config.coalesce_window_us > 0)
+    {
+        uint64_t waited = metrics_now() - shard->dirty_since;
+        uint64_t window = (uint64_t)config.coalesce_window_us * 1000;
+        timeout = (waited < window) ? window - waited : 0;
+    }
+    if (shard->throttled_count > 0 && 1000000000ULL / config.rate_limit < timeout)
+    {
+        timeout = 1000000000ULL / config.rate_limit;
+    }
+    if (precise_waits)
+    {
+        struct timespec wait = {(time_t)(timeout / 1000000000ULL), (long)(timeout % 1000000000ULL)};
+        return epoll_pwait2(shard->epoll_fd, events, MAX_EVENTS, &wait, NULL);
+    }
+    return epoll_wait(shard->epoll_fd, events, MAX_EVENTS, (int)((timeout + 999999) / 1000000));
+}
+// Event loop of a single shard.
+void *run_shard(void *arg)
+{
+    struct shard *shard = arg;
+    struct epoll_event events[MAX_EVENTS];
+    int ready;
 
-        /*When a client is trying to join the server*/
-        // Interested in reading so we passed the readfds and the write,error and timeout are nulls, since timeout is null it will wait infinitely till it catches a read request
-        activity = select(max_sd + 1, &readfds, NULL, NULL, NULL);
-        if ((activity < 0) && (errno != EINTR))
+    if (memory_pool_thread_init() != 0)
+    {
+        perror("memory_pool_thread_init");
+        exit(EXIT_FAILURE);
+    }
+    char thread_name[32];
+    snprintf(thread_name, sizeof(thread_name), "shard%d", shard->id);
+    metrics_thread_init(thread_name);
+
+    while (true)
+    {
+        // Wake up at least once a second so connections that never send a username can be timed out.
+        ready = wait_for_events(shard, events);
+        if (ready < 0)
         {
-            perror("select error");
+            if (errno != EINTR)
+            {
+                perror("epoll_wait");
+            }
+            continue;
         }
 
-        if (FD_ISSET(server_fd, &readfds)) // check if there is any new connection requests
+        for (int i = 0; i < ready; i++)
         {
-            if ((new_socket = accept(server_fd, (struct sockaddr *)&address, &addrlen)) < 0)
+            void *ptr = events[i].data.ptr;
+            if (ptr == NULL) // check if there is any new connection requests
             {
-                perror("accept");
-                exit(EXIT_FAILURE);
+                accept_new_clients(shard);
             }
-
-            printf("New connection, socket fd is %d, IP is: %s, port : %d\n", new_socket, inet_ntoa(address.sin_addr), ntohs(address.sin_port));
-
-            for (int i = 0; i < MAX_CLIENTS; i++)
+            else if (ptr == shard) // other shards queued messages for us
             {
-                if (client_sockets[i] == 0)
-                {
-                    client_sockets[i] = new_socket;
-                    break;
-                }
+                drain_inbox(shard);
+            }
+            else if (events[i].events & (EPOLLERR | EPOLLHUP))
+            {
+                disconnect_client(shard, ptr);
             }
-            // Add new socket to array of client sockets
-            pthread_t thread_id; // Create a new thread for the client
-            if (pthread_create(&thread_id, NULL, handle_client, (void *)&new_socket) != 0)
+            else
             {
-                perror("pthread_create");
-                // Handle thread creation error
+                if (events[i].events & EPOLLOUT) // the socket drained, continue with what's queued
+                {
+                    flush_client(shard, ptr);
+                }
+                if (events[i].events & EPOLLRDHUP)
+                {
+                    ((struct client *)ptr)->peer_closed = true;
+                }
+                if (events[i].events & (EPOLLIN | EPOLLRDHUP))
+                {
+                    handle_client(shard, ptr);
+                }
             }
-            pthread_detach(thread_id);
-            /*Might add it in the handle_client function, but should make sure to use mutexes for synchronization*/
+        }
+        // Timers only have a resolution of a second, there is no point in running them more often.
+        time_t now = time(NULL);
+        if (now != shard->last_tick)
+        {
+            shard->last_tick = now;
+            expire_pending_usernames(shard);
+            update_queue_positions(shard);
+            report_allocations(shard);
+        }
+        resume_throttled_clients(shard);
+        // A coalescing window keeps output back until the first queued frame waited it out, so what arrives meanwhile
+        // goes out in the same writev.
+        if (config.coalesce_window_us == 0 || metrics_now() - shard->dirty_since >= (uint64_t)config.coalesce_window_us * 1000)
+        {
+            flush_dirty_clients(shard);
+        }
+        // A client held back on the dirty list keeps its slot until it was flushed, so the slot isn't reused meanwhile.
+        if (shard->dirty_count == 0)
+        {
+            release_closed_clients(shard);
         }
     }
-
+    return NULL;
+}
+int set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0)
+    {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+// Adds a client to a set, growing it by doubling. Returns -1 if it couldn't grow, the client is then in no set.
+static int set_add(struct client_set *set, struct client *client)
+{
+    if (set->count == set->capacity)
+    {
+        int capacity = (set->capacity > 0) ? set->capacity * 2 : 64;
+        struct client **items = realloc(set->items, capacity * sizeof(struct client *));
+        if (items == NULL)
+        {
+            client->set_index = -1;
+            return -1;
+        }
+        set->items = items;
+        set->capacity = capacity;
+    }
+    client->set_index = set->count;
+    set->items[set->count++] = client;
     return 0;
 }
-void *handle_client(void *cs)
+// Removes a client from a set in O(1), the last client takes its place.
+static void set_remove(struct client_set *set, struct client *client)
+{
+    if (client->set_index < 0)
+    {
+        return;
+    }
+    struct client *last = set->items[--set->count];
+    set->items[client->set_index] = last;
+    last->set_index = client->set_index;
+    client->set_index = -1;
+}
+// The set a client is kept in while it is in its current state.
+static struct client_set *state_set(struct shard *shard, const struct client *client)
+{
+    switch (client->state)
+    {
+    case AWAITING_USERNAME:
+        return &shard->pending;
+    case QUEUED:
+        return &shard->waiting;
+    default:
+        return &shard->members;
+    }
+}
+// Moves a client to another state and the set that goes with it.
+static void set_state(struct shard *shard, struct client *client, enum client_state state)
+{
+    set_remove(state_set(shard, client), client);
+    client->state = state;
+    if (set_add(state_set(shard, client), client) != 0)
+    {
+        perror("realloc");
+        disconnect_client(shard, client);
+    }
+}
+void accept_new_clients(struct shard *shard)
 {
-    int client_socket = *((int *)cs);
-    char client_buffer[1024];
-    ssize_t bytes_received;
-
     struct sockaddr_in address;
-    socklen_t addrlen = sizeof(address);
+    socklen_t addrlen;
+    int new_socket;
+
+    // Edge-triggered: keep accepting until the backlog is empty.
+    while (true)
+    {
+        addrlen = sizeof(address);
+        if ((new_socket = accept4(shard->server_fd, (struct sockaddr *)&address, &addrlen, SOCK_NONBLOCK)) < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+                perror("accept");
+            }
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return;
+        }
+        uint64_t started = metrics_now();
+
+        printf("New connection on shard %d, socket fd is %d, IP is: %s, port : %d\n", shard->id, new_socket, inet_ntoa(address.sin_addr), ntohs(address.sin_port));
 
-    // Receive username (Obligatory) with a timeout
-    char username_buffer[256];
-    memset(username_buffer, 0, sizeof(username_buffer)); // Clear username buffer
+        // Take a free slot for the new client, the room's capacity is only checked once it sent its username.
+        int slot;
+        struct client *client = slot_table_alloc(&shard->clients, &slot);
+        if (client == NULL)
+        {
+            perror("slot_table_alloc");
+            close(new_socket);
+            continue;
+        }
+        memset(client, 0, sizeof(*client));
+        client->socket = new_socket;
+        client->slot = slot;
+        client->state = AWAITING_USERNAME;
+        client->deadline = time(NULL) + USERNAME_TIMEOUT;
+        client->address = address;
+        client->tokens = config.rate_burst;
+        client->tokens_refilled = started;
+        client->throttle_index = -1;
+        client->connection = ++shard->connections;
+        if (set_add(&shard->pending, client) != 0)
+        {
+            perror("realloc");
+            disconnect_client(shard, client);
+            continue;
+        }
 
-    fd_set readfds;
-    struct timeval timeout;
-    timeout.tv_sec = 10; // Set timeout to 30 seconds
-    timeout.tv_usec = 0;
+        // EPOLLOUT is edge-triggered as well, so it only fires when a full socket buffer drains again.
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.ptr = client;
+        if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, new_socket, &event) < 0)
+        {
+            perror("epoll_ctl");
+            disconnect_client(shard, client);
+        }
+        metrics_record(STAGE_ACCEPT, started);
+        metrics_add(COUNTER_ACCEPTED, 1);
+    }
+}
+static void enqueue_frame(struct shard *shard, struct client *client, struct frame *frame);
+static void enqueue_wire(struct shard *shard, struct client *client, struct frame *frame);
+static struct frame *binary_encode_lines(const struct frame *lines);
 
-    FD_ZERO(&readfds);
-    FD_SET(client_socket, &readfds);
+/*
+Reads an optional history page request, sent either with the username or later as {"history": {...}}:
+    {"last": N}               the newest N messages (also what a client gets on join without asking)
+    {"before": ID, "limit": N} the N messages before message ID, to scroll back
+    {"after": ID, "limit": N}  the N messages after message ID, to catch up after a reconnect
+*/
+static void parse_history_request(const cJSON *history_item, struct history_request *request)
+{
+    request->room = DEFAULT_ROOM;
+    request->mode = HISTORY_LAST;
+    request->id = 0;
+    request->limit = DEFAULT_HISTORY_LIMIT;
+    if (history_item == NULL)
+    {
+        return;
+    }
 
-    int activity = select(client_socket + 1, &readfds, NULL, NULL, &timeout);
-    if (activity == -1)
+    cJSON *item;
+    if ((item = cJSON_GetObjectItem(history_item, "before")) != NULL && cJSON_IsNumber(item))
+    {
+        request->mode = HISTORY_BEFORE;
+        request->id = (long long)item->valuedouble;
+    }
+    else if ((item = cJSON_GetObjectItem(history_item, "after")) != NULL && cJSON_IsNumber(item))
+    {
+        request->mode = HISTORY_AFTER;
+        request->id = (long long)item->valuedouble;
+    }
+    if (((item = cJSON_GetObjectItem(history_item, "limit")) != NULL || (item = cJSON_GetObjectItem(history_item, "last")) != NULL) &&
+        cJSON_IsNumber(item))
+    {
+        request->limit = item->valueint;
+    }
+    if (request->limit < 1)
+    {
+        request->limit = 1;
+    }
+    if (request->limit > MAX_HISTORY_LIMIT)
+    {
+        request->limit = MAX_HISTORY_LIMIT;
+    }
+}
+/*
+Queues a whole history page for a client, as one compressed block if it asked for that (and the page is large enough
+to be worth it). The block is cached on the page frame, so clients sent the same frame share one compression pass.
+*/
+static void send_page_frame(struct shard *shard, struct client *client, struct frame *page)
+{
+    if (!client->compress_history || page->length < HISTORY_BLOCK_MIN)
+    {
+        enqueue_frame(shard, client, page);
+        return;
+    }
+    struct frame *block = (client->transport == TRANSPORT_BINARY)
+                              ? frame_encoded(page, ENCODING_BINARY, binary_encode_lines)
+                              : page;
+    if (block != NULL)
     {
-        perror("select");
-        close(client_socket);
-        pthread_exit(NULL);
+        block = (client->transport == TRANSPORT_BINARY) ? frame_encoded(block, ENCODING_HISTORY_BLOCK, history_block_encode_binary)
+                                                        : frame_encoded(block, ENCODING_HISTORY_BLOCK, history_block_encode_lines);
     }
-    else if (activity == 0)
+    if (block == NULL)
     {
-        // Timeout occurred
-        printf("Timeout occurred while waiting for username.\n");
-        close(client_socket);
-        pthread_exit(NULL);
+        perror("history_block_encode");
+        enqueue_frame(shard, client, page);
+        return;
     }
-    else
+    enqueue_wire(shard, client, block);
+}
+// Queues a small control frame such as a queue position for one client.
+static void send_notice(struct shard *shard, struct client *client, const char *json);
+/*
+Answers a history page from the in-memory ring when it covers the page. Older pages are handed to the history reader
+and sent once they come back (see finish_history_page), the client meanwhile gets whatever else is posted.
+*/
+static void send_history_page(struct shard *shard, struct client *client, const struct history_request *request)
+{
+    struct frame *page;
+    if (history_ring_replay(&recent_history, request, &page))
     {
-        // Wait to read the username:
-        if ((bytes_received = recv(client_socket, username_buffer, sizeof(username_buffer) - 1, 0)) <= 0)
+        if (page != NULL)
         {
-            // Failed to receive username or client disconnected
-            printf("Failed to receive username or client disconnected.\n");
-            close(client_socket);
-            pthread_exit(NULL);
+            send_page_frame(shard, client, page);
+            frame_release(page);
         }
-        else
+        return;
+    }
+    struct history_job *job = (shard->history_pending < HISTORY_READER_QUEUE_SIZE) ? malloc(sizeof(struct history_job)) : NULL;
+    if (job != NULL)
+    {
+        job->producer = shard->id;
+        job->client = client;
+        job->connection = client->connection;
+        job->request = *request;
+        if (history_reader_submit(job))
         {
-            // Null-terminate the received data to make it a valid C string
-            username_buffer[bytes_received] = '\0';
-
-            cJSON *root_username = cJSON_Parse(username_buffer);
-            if (root_username == NULL)
-            {
-                // Handle parsing error
-                printf("Failed to receive username or client disconnected.\n");
-                close(client_socket);
-                pthread_exit(NULL);
-            }
-            cJSON *username_item = cJSON_GetObjectItem(root_username, "username");
-            const char *username = username_item->valuestring;
-            printf("Username received: %s\n", username); // might send this as a message to the front-end
-            cJSON_Delete(root_username);
-            // pthread_mutex_lock(&mutex);
-            // insert_username(username);
-            // pthread_mutex_unlock(&mutex);
-            /*if (!insert_username(username))
-            {
-                send a message to the UI in welcome.html telling the client to use another username and goto "again".
-            }*/
-            // Send chat history to the client upon connection
-            send_chat_history(client_socket);
-            // Handle communication with the client
-            while ((bytes_received = recv(client_socket, client_buffer, sizeof(client_buffer), 0)) > 0)
-            {
-                client_buffer[bytes_received] = '\0';
-                cJSON *root_msg = cJSON_Parse(client_buffer);
-
-                // Extract fields from the JSON object
-                cJSON *timestamp_item = cJSON_GetObjectItem(root_msg, "time");
-                const char *timestamp = (timestamp_item != NULL) ? timestamp_item->valuestring : "";
-                cJSON *message_item = cJSON_GetObjectItem(root_msg, "message");
-                const char *message = (message_item != NULL) ? message_item->valuestring : "";
-
-                // Broadcast only the message to other clients
-                for (int j = 0; j < MAX_CLIENTS; j++)
-                {
-                    int dest_sd = client_sockets[j];
-                    if (dest_sd != 0 && dest_sd != client_socket)
-                    {
-                        // send(dest_sd, client_buffer, bytes_received, 0);
-                        send(dest_sd, message, strlen(message), 0);
-                    }
-                }
-                // Message sent to all other clients, now it is safe to insert it into database.
-                pthread_mutex_lock(&mutex);
-                insert_message(timestamp, username, client_buffer);
-                pthread_mutex_unlock(&mutex);
-                // Free cJSON object
-                cJSON_Delete(root_msg);
-            }
-            // Client disconnected
-            // Clean up resources and close the socket
-            getpeername(client_socket, (struct sockaddr *)&address, &addrlen);
-            printf("Client disconnected, ip %s, port %d\n", inet_ntoa(address.sin_addr), ntohs(address.sin_port));
-            close(client_socket);
-            // Remove the client socket from the array
-            for (int i = 0; i < MAX_CLIENTS; i++)
-            {
-                if (client_sockets[i] == client_socket)
-                {
-                    pthread_mutex_lock(&mutex);
-                    client_sockets[i] = 0;
-                    pthread_mutex_unlock(&mutex);
-                    break;
-                }
-            }
-            pthread_exit(NULL);
+            shard->history_pending++;
+            return;
         }
+        free(job);
+    }
+    // The reader is far behind, the client may ask again later.
+    send_notice(shard, client, "{\"error\":\"history_unavailable\"}");
+}
+// Sends a page the reader thread is done with, unless the client that asked for it is gone.
+static void finish_history_page(struct shard *shard, struct history_job *job)
+{
+    struct client *client = job->client;
+    if (client->socket != 0 && client->connection == job->connection)
+    {
+        if (job->failed)
+        {
+            send_notice(shard, client, "{\"error\":\"history_unavailable\"}");
+        }
+        else if (job->page != NULL)
+        {
+            send_page_frame(shard, client, job->page);
+        }
+    }
+    if (job->page != NULL)
+    {
+        frame_release(job->page);
+    }
+    free(job);
+}
+/*
+Reader thread: hands a finished page back to the shard that asked for it. history_pending keeps the jobs in flight
+below the inbox's capacity, so the push can't fail.
+*/
+static void history_page_read(struct history_job *job)
+{
+    struct shard *shard = &shards[job->producer];
+    if (!spsc_push(&shard->history_inbox, job))
+    {
+        fprintf(stderr, "Shard %d history inbox is full\n", shard->id);
+        return;
+    }
+    wake_shard(shard);
+}
+// Queues a small control frame such as a queue position for one client.
+static void send_notice(struct shard *shard, struct client *client, const char *json)
+{
+    struct frame *frame = frame_create_line(json, strlen(json));
+    if (frame != NULL)
+    {
+        enqueue_frame(shard, client, frame);
+        frame_release(frame);
+    }
+}
+// Tells a waiting client its place in the queue, counting itself. Users ahead of it that gave up waiting
+// keep counting until the head of the queue passes them, so it is never lower than the real place.
+static void send_queue_position(struct shard *shard, struct client *client, unsigned long long head)
+{
+    char notice[64];
+    snprintf(notice, sizeof(notice), "{\"queue\":%llu}", client->admission.ticket - head + 1);
+    send_notice(shard, client, notice);
+}
+// Seats a client that got a seat, either right after its handshake or when one freed up while it waited.
+static void admit_client(struct shard *shard, struct client *client)
+{
+    set_state(shard, client, CHATTING);
+    if (client->socket != 0)
+    {
+        printf("%s joined the room\n", client->username);
+        // Send chat history to the client upon joining, the newest DEFAULT_HISTORY_LIMIT messages unless it asked for another page
+        send_history_page(shard, client, &client->join_history);
+    }
+}
+// Parses the username handshake, returns false if the client has to be dropped.
+static bool handle_username(struct shard *shard, struct client *client, const char *username_buffer)
+{
+    cJSON *root_username = cJSON_Parse(username_buffer);
+    cJSON *username_item = cJSON_GetObjectItem(root_username, "username");
+    if (username_item == NULL || username_item->valuestring == NULL)
+    {
+        // Handle parsing error
+        printf("Failed to receive username or client disconnected.\n");
+        cJSON_Delete(root_username);
+        return false;
+    }
+    snprintf(client->username, sizeof(client->username), "%s", username_item->valuestring);
+    printf("Username received: %s\n", client->username); // might send this as a message to the front-end
+
+    // Switch to the binary protocol before anything is sent back, so the notices and the join history already use it.
+    // Browsers stay on JSON, a WebSocket message is already length-delimited.
+    cJSON *protocol_item = cJSON_GetObjectItem(root_username, "protocol");
+    if (client->transport == TRANSPORT_LINES && protocol_item != NULL && protocol_item->valuestring != NULL &&
+        strcmp(protocol_item->valuestring, "binary") == 0)
+    {
+        client->transport = TRANSPORT_BINARY;
+        atomic_fetch_add(&binary_clients, 1);
+    }
+    // History pages as compressed blocks, browsers have permessage-deflate for that.
+    cJSON *compress_item = cJSON_GetObjectItem(root_username, "compress");
+    client->compress_history = client->transport != TRANSPORT_WEBSOCKET && compress_item != NULL &&
+                               compress_item->valuestring != NULL && strcmp(compress_item->valuestring, "deflate") == 0;
+
+    // Claim the name in the registry, one lookup in memory. Names seen for the first time are stored in the background.
+    bool is_new;
+    if ((client->name_entry = username_registry_claim(&usernames, client->username, &is_new)) == NULL)
+    {
+        printf("Username %s is already in use\n", client->username);
+        cJSON_Delete(root_username);
+        send_notice(shard, client, "{\"error\":\"username_taken\"}");
+        flush_client(shard, client);
+        return false;
+    }
+    if (is_new)
+    {
+        persist_username(shard->id, client->username);
+    }
+    parse_history_request(cJSON_GetObjectItem(root_username, "history"), &client->join_history);
+    cJSON_Delete(root_username);
+
+    // Take a seat, or a place in the queue when the room is full.
+    switch (admission_enter(&admission, &client->admission, shard->id))
+    {
+    case ADMISSION_SEATED:
+        admit_client(shard, client);
+        break;
+    case ADMISSION_QUEUED:
+        printf("Room is full, %s is waiting for a seat\n", client->username);
+        set_state(shard, client, QUEUED);
+        if (client->socket != 0)
+        {
+            unsigned long long head = admission_head(&admission);
+            if (shard->waiting.count == 1) // Nobody else on this shard needs to hear about the head's position
+            {
+                shard->queue_head = head;
+            }
+            send_queue_position(shard, client, head);
+        }
+        break;
+    default:
+        printf("Room and queue are full, turning %s away\n", client->username);
+        send_notice(shard, client, "{\"error\":\"room_full\"}");
+        flush_client(shard, client);
+        return false;
+    }
+    return true;
+}
+/*
+Serializes a message once, in the same shape as the chat history, every recipient shares the frame this returns.
+The ring gives the message its id (or takes the one in *id, see history_ring_append), keeps a copy for joins and
+returns the frame with the id in front. NULL if that failed.
+*/
+static struct frame *create_message_frame(long long *id, const char *timestamp, int64_t timestamp_ms, const char *username, uint32_t user,
+                                          const char *message, size_t message_length)
+{
+    cJSON *message_obj = cJSON_CreateObject();
+    cJSON_AddStringToObject(message_obj, "timestamp", timestamp);
+    cJSON_AddStringToObject(message_obj, "username", username);
+    cJSON_AddStringToObject(message_obj, "message", message);
+    char *json_str = cJSON_PrintUnformatted(message_obj);
+    struct frame *frame = (json_str != NULL) ? history_ring_append(&recent_history, json_str + 1, strlen(json_str) - 1, id) : NULL;
+    cJSON_Delete(message_obj);
+    cJSON_free(json_str);
+
+    // Binary clients get the message encoded straight from its fields instead of from the JSON, when there are any.
+    if (frame != NULL && atomic_load(&binary_clients) > 0)
+    {
+        struct binary_message binary = {BINARY_CHAT, 0, 0, user, *id, timestamp_ms, username, strlen(username), (char *)message, message_length};
+        struct frame *encoded = binary_encode_message(&binary);
+        if (encoded != NULL)
+        {
+            frame_attach_encoding(frame, ENCODING_BINARY, encoded);
+        }
+    }
+    return frame;
+}
+// Gives a message its id, broadcasts it to the room and hands it to the writer thread to be stored.
+static void post_message(struct shard *shard, struct client *client, const char *timestamp, int64_t timestamp_ms, const char *message,
+                         size_t message_length)
+{
+    // In a federation the relay hub orders the room, the message is delivered here like everywhere else once it comes back sequenced.
+    if (config.relay != NULL)
+    {
+        if (!relay_publish(shard->id, client->name_entry->id, timestamp_ms, timestamp, client->username, message, message_length))
+        {
+            fprintf(stderr, "Relay queue of shard %d is full, dropping a message from %s\n", shard->id, client->username);
+        }
+        return;
+    }
+    long long id = 0;
+    struct frame *frame = create_message_frame(&id, timestamp, timestamp_ms, client->username, client->name_entry->id, message, message_length);
+
+    // Broadcast the message to other clients
+    if (frame != NULL)
+    {
+        metrics_add(COUNTER_BROADCASTS, 1);
+        broadcast_message(shard, client, frame);
+        frame_release(frame);
+    }
+    // Message queued for all other clients, now hand it to the writer thread to be stored in the database.
+    if (frame != NULL)
+    {
+        persist_message(shard->id, id, timestamp, client->username, message);
+    }
+}
+// Broadcasts one received message to every other client and stores it, or answers a history page request.
+static void handle_message(struct shard *shard, struct client *client, const char *client_buffer)
+{
+    uint64_t started = metrics_now();
+    cJSON *root_msg = cJSON_Parse(client_buffer);
+    metrics_record(STAGE_PARSE, started);
+
+    cJSON *history_item = cJSON_GetObjectItem(root_msg, "history");
+    if (history_item != NULL)
+    {
+        struct history_request request;
+        parse_history_request(history_item, &request);
+        send_history_page(shard, client, &request);
+        cJSON_Delete(root_msg);
+        return;
+    }
+    // Users waiting for a seat may read the history but not talk in the room yet.
+    if (client->state != CHATTING)
+    {
+        cJSON_Delete(root_msg);
+        return;
+    }
+
+    // Extract fields from the JSON object
+    cJSON *timestamp_item = cJSON_GetObjectItem(root_msg, "time");
+    const char *timestamp = (timestamp_item != NULL && timestamp_item->valuestring != NULL) ? timestamp_item->valuestring : "";
+    cJSON *message_item = cJSON_GetObjectItem(root_msg, "message");
+    const char *message = (message_item != NULL && message_item->valuestring != NULL) ? message_item->valuestring : "";
+    post_message(shard, client, timestamp, timestamp_parse(timestamp), message, strlen(message));
+    // Free cJSON object
+    cJSON_Delete(root_msg);
+}
+// Handles one message of a client speaking the binary protocol, no JSON is parsed on the way in.
+static void handle_binary_message(struct shard *shard, struct client *client, struct binary_message *message)
+{
+    if (message->type == BINARY_HISTORY)
+    {
+        uint64_t limit = DEFAULT_HISTORY_LIMIT;
+        if (message->payload_length > 0 && varint_decode((const uint8_t *)message->payload, message->payload_length, &limit) <= 0)
+        {
+            limit = DEFAULT_HISTORY_LIMIT;
+        }
+        struct history_request request = {DEFAULT_ROOM, (message->flags <= HISTORY_AFTER) ? message->flags : HISTORY_LAST, message->id,
+                                          (limit < 1) ? 1 : (limit > MAX_HISTORY_LIMIT) ? MAX_HISTORY_LIMIT : (int)limit};
+        send_history_page(shard, client, &request);
+    }
+    else if (message->type == BINARY_CHAT && client->state == CHATTING)
+    {
+        char timestamp[32];
+        timestamp_format(message->timestamp, timestamp);
+        post_message(shard, client, timestamp, message->timestamp, message->payload, message->payload_length);
+    }
+}
+// Queues bytes that are already in the client's wire format and puts the client on the dirty list, applying the slow consumer policy.
+static void enqueue_wire(struct shard *shard, struct client *client, struct frame *frame)
+{
+    if (!outbound_push(&client->outbound, frame, config.outbound_high_water, config.slow_consumer_policy))
+    {
+        printf("Evicting slow consumer %s, %zu bytes queued\n", client->username, client->outbound.bytes);
+        metrics_add(COUNTER_EVICTIONS, 1);
+        disconnect_client(shard, client);
+        return;
+    }
+    if (!client->flush_pending)
+    {
+        if (shard->dirty_count == shard->dirty_capacity)
+        {
+            int capacity = (shard->dirty_capacity > 0) ? shard->dirty_capacity * 2 : 64;
+            struct client **dirty = realloc(shard->dirty, capacity * sizeof(struct client *));
+            if (dirty == NULL)
+            {
+                return; // The frame stays queued and goes out with the client's next EPOLLOUT
+            }
+            shard->dirty = dirty;
+            shard->dirty_capacity = capacity;
+        }
+        if (shard->dirty_count == 0)
+        {
+            shard->dirty_since = metrics_now();
+        }
+        client->flush_pending = true;
+        shard->dirty[shard->dirty_count++] = client;
+    }
+    // A coalescing window holds output back, but never until the queue runs into the slow consumer policy.
+    if (config.coalesce_window_us > 0 && client->outbound.bytes >= config.outbound_high_water / 2)
+    {
+        flush_client(shard, client);
+    }
+}
+/*
+Encoder for frame_encoded(): translates every JSON line of a frame into a binary message. Broadcasts come with
+their binary encoding already attached (see post_message), so this only runs for notices and history pages.
+*/
+static struct frame *binary_encode_lines(const struct frame *lines)
+{
+    struct arena_mark mark = arena_begin();
+    uint8_t *out = NULL;
+    size_t length = 0, capacity = 0;
+    const char *line = lines->data, *end = lines->data + lines->length;
+    while (line < end)
+    {
+        const char *newline = memchr(line, '\n', end - line);
+        size_t line_length = (newline != NULL) ? (size_t)(newline - line) : (size_t)(end - line);
+        cJSON *root = cJSON_ParseWithLength(line, line_length);
+        line += line_length + 1;
+        if (root == NULL)
+        {
+            continue;
+        }
+
+        struct binary_message message = {BINARY_CHAT, 0, 0, 0, 0, 0, "", 0, "", 0};
+        cJSON *item;
+        if ((item = cJSON_GetObjectItem(root, "queue")) != NULL && cJSON_IsNumber(item))
+        {
+            message.type = BINARY_QUEUE;
+            message.id = (int64_t)item->valuedouble;
+        }
+        else if ((item = cJSON_GetObjectItem(root, "error")) != NULL && item->valuestring != NULL)
+        {
+            message.type = BINARY_ERROR;
+            message.payload = item->valuestring;
+            message.payload_length = strlen(item->valuestring);
+        }
+        else
+        {
+            if ((item = cJSON_GetObjectItem(root, "id")) != NULL && cJSON_IsNumber(item))
+            {
+                message.id = (int64_t)item->valuedouble;
+            }
+            if ((item = cJSON_GetObjectItem(root, "timestamp")) != NULL && item->valuestring != NULL)
+            {
+                message.timestamp = timestamp_parse(item->valuestring);
+            }
+            if ((item = cJSON_GetObjectItem(root, "username")) != NULL && item->valuestring != NULL)
+            {
+                message.name = item->valuestring;
+                message.name_length = strlen(item->valuestring);
+                message.user = username_registry_id(&usernames, item->valuestring);
+            }
+            if ((item = cJSON_GetObjectItem(root, "message")) != NULL && item->valuestring != NULL)
+            {
+                message.payload = item->valuestring;
+                message.payload_length = strlen(item->valuestring);
+            }
+        }
+
+        size_t size = binary_encoded_size(&message);
+        if (length + size > capacity)
+        {
+            size_t new_capacity = (capacity > 0) ? capacity * 2 : 256;
+            while (new_capacity < length + size)
+            {
+                new_capacity *= 2;
+            }
+            uint8_t *grown = realloc(out, new_capacity);
+            if (grown == NULL)
+            {
+                cJSON_Delete(root);
+                free(out);
+                arena_end(mark);
+                return NULL;
+            }
+            out = grown;
+            capacity = new_capacity;
+        }
+        length += binary_encode_into(out + length, &message);
+        cJSON_Delete(root);
+    }
+    struct frame *frame = frame_create((const char *)out, length);
+    free(out);
+    arena_end(mark);
+    return frame;
+}
+// Queues a newline-delimited frame for one client, in WebSocket framing for browsers or binary for binary clients
+// (encoded once per frame, not per client).
+static void enqueue_frame(struct shard *shard, struct client *client, struct frame *frame)
+{
+    if (client->transport == TRANSPORT_WEBSOCKET)
+    {
+        frame = client->websocket->deflate ? frame_encoded(frame, ENCODING_WEBSOCKET_DEFLATE, websocket_encode_deflate)
+                                           : frame_encoded(frame, ENCODING_WEBSOCKET, websocket_encode);
+        if (frame == NULL)
+        {
+            perror("websocket_encode");
+            return;
+        }
+    }
+    else if (client->transport == TRANSPORT_BINARY)
+    {
+        if ((frame = frame_encoded(frame, ENCODING_BINARY, binary_encode_lines)) == NULL)
+        {
+            perror("binary_encode");
+            return;
+        }
+    }
+    enqueue_wire(shard, client, frame);
+}
+// Sends a WebSocket control frame, flushing and closing the connection right after if it is a close.
+static void send_websocket_control(struct shard *shard, struct client *client, enum websocket_opcode opcode, const char *payload, size_t length)
+{
+    struct frame *frame = websocket_control_frame(opcode, payload, length);
+    if (frame != NULL)
+    {
+        enqueue_wire(shard, client, frame);
+        frame_release(frame);
+    }
+    if (opcode == WS_CLOSE)
+    {
+        flush_client(shard, client);
+        disconnect_client(shard, client);
+    }
+}
+/*
+Decides what a new connection speaks from its first byte. For an HTTP Upgrade request this answers the
+WebSocket handshake once the request is complete. Returns false while the transport isn't known yet.
+*/
+static bool detect_transport(struct shard *shard, struct client *client)
+{
+    char *data;
+    if (read_buffer_pending(&client->input, &data) == 0)
+    {
+        return false;
+    }
+    if (data[0] != 'G')
+    {
+        client->transport = TRANSPORT_LINES;
+        return true;
+    }
+
+    char response[512];
+    bool deflate = false;
+    int length = websocket_handshake(&client->input, response, sizeof(response), &deflate);
+    if (length == 0)
+    {
+        return false;
+    }
+    struct frame *frame = frame_create(response, (length < 0) ? -length : length);
+    if (frame != NULL)
+    {
+        enqueue_wire(shard, client, frame);
+        frame_release(frame);
+    }
+    if (length < 0 || (client->websocket = calloc(1, sizeof(struct websocket_state))) == NULL)
+    {
+        printf("Bad WebSocket handshake, dropping client.\n");
+        flush_client(shard, client);
+        disconnect_client(shard, client);
+        return false;
+    }
+    client->websocket->deflate = deflate;
+    client->transport = TRANSPORT_WEBSOCKET;
+    return true;
+}
+/*
+Takes the next complete message off the client's read buffer, null-terminated, whatever transport it came in.
+WebSocket pings and closes are answered here. Returns false once nothing complete is left (or the client was dropped).
+*/
+static bool next_client_message(struct shard *shard, struct client *client, char **message, size_t *length)
+{
+    if (client->transport == TRANSPORT_UNKNOWN && !detect_transport(shard, client))
+    {
+        return false;
+    }
+    if (client->transport == TRANSPORT_LINES)
+    {
+        return read_buffer_next_frame(&client->input, message, length);
+    }
+    while (client->socket != 0)
+    {
+        switch (websocket_next_message(&client->input, client->websocket, message, length))
+        {
+        case WS_MESSAGE:
+            return true;
+        case WS_PING_RECEIVED:
+            send_websocket_control(shard, client, WS_PONG, *message, *length);
+            break;
+        case WS_CLOSE_RECEIVED:
+            // Echo the status code, then close.
+            send_websocket_control(shard, client, WS_CLOSE, *message, (*length < 2) ? *length : 2);
+            return false;
+        case WS_PROTOCOL_ERROR:
+            printf("WebSocket protocol error, dropping client.\n");
+            send_websocket_control(shard, client, WS_CLOSE, "\x03\xea", 2); // 1002 protocol error
+            return false;
+        default:
+            return false;
+        }
+    }
+    return false;
+}
+/*
+Queues a frame for every member of the room on this shard except the sender, given by its user id (0 for none).
+Walks the dense members array, backwards because evicting a slow consumer moves the last member into its place.
+*/
+static void deliver_local(struct shard *shard, uint32_t sender, struct frame *frame)
+{
+    for (int j = shard->members.count - 1; j >= 0; j--)
+    {
+        struct client *dest = shard->members.items[j];
+        if (dest->name_entry->id != sender)
+        {
+            enqueue_frame(shard, dest, frame);
+        }
+    }
+}
+/*
+One sequenced message on its way to the shards, shared by all of them. sender is the user id of the client on this
+instance that posted it, who doesn't get it back, 0 if it was posted on another instance. The last shard to deliver
+it releases the frame.
+*/
+struct relayed_message {
+    atomic_int refs;
+    uint32_t sender;
+    struct frame *frame;
+};
+static void relayed_release(struct relayed_message *relayed)
+{
+    if (atomic_fetch_sub(&relayed->refs, 1) == 1)
+    {
+        frame_release(relayed->frame);
+        free(relayed);
+    }
+}
+// Wakes up another shard, only the first producer since its last drain pays for the eventfd write.
+static void wake_shard(struct shard *target)
+{
+    if (!atomic_exchange(&target->wake_pending, true))
+    {
+        uint64_t one = 1;
+        if (write(target->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        {
+            perror("eventfd write");
+        }
+    }
+}
+/*
+Delivers a frame to the local clients and hands a reference to the same frame to every other shard
+through the single-producer/single-consumer queue this shard owns in their inbox.
+*/
+void broadcast_message(struct shard *shard, struct client *sender, struct frame *frame)
+{
+    uint64_t started = metrics_now();
+    deliver_local(shard, sender->name_entry->id, frame);
+
+    for (int i = 0; i < num_shards; i++)
+    {
+        if (i == shard->id)
+        {
+            continue;
+        }
+        frame_retain(frame); // The receiving shard releases it after delivery
+        if (spsc_push(&shards[i].inbox[shard->id], frame))
+        {
+            wake_shard(&shards[i]);
+        }
+        else
+        {
+            // The other shard is too far behind, it misses this message rather than blocking us.
+            fprintf(stderr, "Shard %d inbox from shard %d is full, dropping message\n", i, shard->id);
+            frame_release(frame);
+        }
+    }
+    metrics_record(STAGE_FANOUT, started);
+}
+// Delivers every message other shards queued for this shard.
+void drain_inbox(struct shard *shard)
+{
+    uint64_t count;
+    // Reset the eventfd counter and allow producers to wake us again before looking at the queues,
+    // so a message pushed while we drain always results in another wakeup.
+    while (read(shard->wake_fd, &count, sizeof(count)) < 0 && errno == EINTR)
+    {
+    }
+    atomic_store(&shard->wake_pending, false);
+
+    // Seat the users that were given a seat freed up on any shard.
+    struct admission_node *node = admission_take_granted(&admission, shard->id);
+    while (node != NULL)
+    {
+        struct admission_node *next = node->next;
+        admit_client(shard, (struct client *)((char *)node - offsetof(struct client, admission)));
+        node = next;
+    }
+
+    for (int i = 0; i < num_shards; i++)
+    {
+        if (i == shard->id)
+        {
+            continue;
+        }
+        struct frame *frame;
+        while ((frame = spsc_pop(&shard->inbox[i])) != NULL)
+        {
+            uint64_t started = metrics_now();
+            deliver_local(shard, 0, frame);
+            metrics_record(STAGE_FANOUT, started);
+            frame_release(frame);
+        }
+    }
+
+    // History pages the reader thread read from storage for this shard's clients.
+    struct history_job *job;
+    while ((job = spsc_pop(&shard->history_inbox)) != NULL)
+    {
+        shard->history_pending--;
+        finish_history_page(shard, job);
+    }
+
+    // In a federation every message of the room arrives here, in the order the relay hub gave them.
+    struct relayed_message *relayed;
+    while (config.relay != NULL && (relayed = spsc_pop(&shard->relay_inbox)) != NULL)
+    {
+        uint64_t started = metrics_now();
+        deliver_local(shard, relayed->sender, relayed->frame);
+        metrics_record(STAGE_FANOUT, started);
+        relayed_release(relayed);
+    }
+}
+/*
+Relay thread: takes a message the relay hub sequenced (see relay.h) into the ring under its sequence number and hands
+it to every shard. A message is stored once, by the instance it was posted on, unless every instance keeps storage of
+its own, then each one stores everything.
+*/
+static void deliver_relayed(const struct binary_message *message, bool own)
+{
+    // The payload is the time string the client sent, its terminator, then the text.
+    size_t timestamp_length = strnlen(message->payload, message->payload_length);
+    if (timestamp_length == message->payload_length)
+    {
+        return;
+    }
+    const char *timestamp = message->payload;
+    const char *text = message->payload + timestamp_length + 1;
+    size_t text_length = message->payload_length - timestamp_length - 1;
+    char username[256];
+    size_t name_length = (message->name_length < sizeof(username)) ? message->name_length : sizeof(username) - 1;
+    memcpy(username, message->name, name_length);
+    username[name_length] = '\0';
+    // User ids are this instance's registry ids. A name first seen on another instance enters the registry like a stored one.
+    uint32_t user = own ? message->user : username_registry_id(&usernames, username);
+    if (user == 0 && username_registry_add(&usernames, username))
+    {
+        user = username_registry_id(&usernames, username);
+    }
+
+    long long id = message->id;
+    struct arena_mark mark = arena_begin();
+    struct frame *frame = create_message_frame(&id, timestamp, message->timestamp, username, user, text, text_length);
+    arena_end(mark);
+    if (frame == NULL)
+    {
+        return;
+    }
+    metrics_add(COUNTER_BROADCASTS, 1);
+    struct relayed_message *relayed = malloc(sizeof(struct relayed_message));
+    if (relayed == NULL)
+    {
+        perror("malloc");
+        frame_release(frame);
+        return;
+    }
+    atomic_init(&relayed->refs, num_shards);
+    relayed->sender = own ? message->user : 0;
+    relayed->frame = frame;
+    for (int i = 0; i < num_shards; i++)
+    {
+        if (spsc_push(&shards[i].relay_inbox, relayed))
+        {
+            wake_shard(&shards[i]);
+        }
+        else
+        {
+            fprintf(stderr, "Shard %d relay inbox is full, dropping message\n", i);
+            relayed_release(relayed);
+        }
+    }
+    if (own || !storage_shared())
+    {
+        persist_message(num_shards, id, timestamp, username, text);
+    }
+}
+// Writes whatever is queued for a client, the rest waits for the next EPOLLOUT.
+void flush_client(struct shard *shard, struct client *client)
+{
+    if (client->socket == 0 || client->outbound.count == 0)
+    {
+        return;
+    }
+    uint64_t started = metrics_now();
+    size_t queued = client->outbound.bytes;
+    int result = outbound_flush(client->socket, &client->outbound);
+    metrics_record(STAGE_FLUSH, started);
+    metrics_add(COUNTER_BYTES_SENT, queued - client->outbound.bytes);
+    if (result < 0)
+    {
+        disconnect_client(shard, client);
+    }
+}
+// Flushes every client that received frames during this event loop iteration.
+void flush_dirty_clients(struct shard *shard)
+{
+    for (int i = 0; i < shard->dirty_count; i++)
+    {
+        struct client *client = shard->dirty[i];
+        client->flush_pending = false;
+        flush_client(shard, client);
+    }
+    shard->dirty_count = 0;
+}
+// Frees the slots of the clients disconnected during this iteration, nothing refers to them anymore.
+void release_closed_clients(struct shard *shard)
+{
+    for (int i = 0; i < shard->closed.count; i++)
+    {
+        slot_table_release(&shard->clients, shard->closed.items[i]->slot);
+    }
+    shard->closed.count = 0;
+}
+/*
+Token bucket of --rate-limit: tops the client's tokens up for the time since the last refill, at most to --rate-burst,
+and tells whether it may send another message right away.
+*/
+static bool has_token(struct client *client)
+{
+    if (config.rate_limit <= 0)
+    {
+        return true;
+    }
+    uint64_t now = metrics_now();
+    client->tokens += (double)(now - client->tokens_refilled) * config.rate_limit / 1e9;
+    if (client->tokens > config.rate_burst)
+    {
+        client->tokens = config.rate_burst;
+    }
+    client->tokens_refilled = now;
+    return client->tokens >= 1;
+}
+/*
+Stops reading from a client that is out of tokens until it has one again (see resume_throttled_clients). Its unread
+messages wait in the read buffer and the socket, so TCP slows the sender down instead of it flooding the fan-out.
+Returns false if the throttled list couldn't grow, the client is then let through.
+*/
+static bool throttle_client(struct shard *shard, struct client *client)
+{
+    if (shard->throttled_count == shard->throttled_capacity)
+    {
+        int capacity = (shard->throttled_capacity > 0) ? shard->throttled_capacity * 2 : 64;
+        struct client **throttled = realloc(shard->throttled, capacity * sizeof(struct client *));
+        if (throttled == NULL)
+        {
+            return false;
+        }
+        shard->throttled = throttled;
+        shard->throttled_capacity = capacity;
+    }
+    client->throttle_index = shard->throttled_count;
+    shard->throttled[shard->throttled_count++] = client;
+    metrics_add(COUNTER_THROTTLED, 1);
+    return true;
+}
+static void unthrottle_client(struct shard *shard, struct client *client)
+{
+    if (client->throttle_index < 0)
+    {
+        return;
+    }
+    struct client *last = shard->throttled[--shard->throttled_count];
+    shard->throttled[client->throttle_index] = last;
+    last->throttle_index = client->throttle_index;
+    client->throttle_index = -1;
+}
+// Whether the next message may be taken off the client's input. The handshake is never held back.
+static bool may_handle_message(struct shard *shard, struct client *client)
+{
+    return client->state == AWAITING_USERNAME || has_token(client) || !throttle_client(shard, client);
+}
+/*
+Handles every complete message in the client's read buffer. Returns false if the client was disconnected or ran out
+of rate limit tokens, nothing more may be read from it then.
+*/
+static bool handle_buffered_messages(struct shard *shard, struct client *client)
+{
+    // Each message comes back null-terminated, a valid C string
+    char *client_buffer;
+    size_t length;
+    while (client->socket != 0 && client->transport != TRANSPORT_BINARY && may_handle_message(shard, client) &&
+           next_client_message(shard, client, &client_buffer, &length))
+    {
+        // Whatever cJSON allocates for the message comes from the arena and is dropped in one go afterwards.
+        struct arena_mark mark = arena_begin();
+        alloc_stats_message();
+        metrics_add(COUNTER_MESSAGES, 1);
+        if (client->state == AWAITING_USERNAME)
+        {
+            uint64_t handshake_started = metrics_now();
+            bool accepted = handle_username(shard, client, client_buffer);
+            metrics_record(STAGE_HANDSHAKE, handshake_started);
+            if (!accepted)
+            {
+                arena_end(mark);
+                disconnect_client(shard, client);
+                return false;
+            }
+        }
+        else
+        {
+            client->tokens -= 1;
+            handle_message(shard, client, client_buffer);
+        }
+        arena_end(mark);
+    }
+    // Once the handshake switched to the binary protocol, the rest of the buffer is length-prefixed messages.
+    struct binary_message message;
+    int result;
+    uint64_t parse_started;
+    while (client->socket != 0 && client->transport == TRANSPORT_BINARY && may_handle_message(shard, client) &&
+           ((void)(parse_started = metrics_now()), (result = binary_next_message(&client->input, &message)) != 0))
+    {
+        metrics_record(STAGE_PARSE, parse_started);
+        // A NUL would cut the text short for the clients that get it as JSON, they'd read another message than binary clients.
+        if (result < 0 || (message.type == BINARY_CHAT && memchr(message.payload, '\0', message.payload_length) != NULL))
+        {
+            printf("Malformed binary message, dropping client.\n");
+            disconnect_client(shard, client);
+            return false;
+        }
+        alloc_stats_message();
+        metrics_add(COUNTER_MESSAGES, 1);
+        client->tokens -= 1;
+        handle_binary_message(shard, client, &message);
+    }
+    return client->socket != 0 && client->throttle_index < 0;
+}
+/*
+Called whenever epoll reports the client socket as readable. Since the socket is edge-triggered,
+everything that is available has to be read now, epoll will not report the same data twice.
+Data is appended to the client's read buffer and every complete frame in it is handled right after the read,
+so a client that pipelines several messages gets them all processed for the cost of one recv().
+*/
+void handle_client(struct shard *shard, struct client *client)
+{
+    ssize_t bytes_received;
+    bool full_read = true;
+
+    // A throttled client is read again once it has a token, see resume_throttled_clients().
+    if (client->throttle_index >= 0)
+    {
+        return;
+    }
+    // A read that didn't fill the buffer emptied the socket, new data will raise a new edge. No edge follows the
+    // FIN though, once the peer shut down its side the socket is read until recv returns 0.
+    while (client->socket != 0 && (full_read || client->peer_closed))
+    {
+        uint64_t started = metrics_now();
+        bytes_received = read_buffer_fill(client->socket, &client->input, &full_read);
+        metrics_record(STAGE_RECV, started);
+        if (bytes_received < 0)
+        {
+            if (errno == EINTR)
+            {
+                full_read = true;
+                continue;
+            }
+            if (errno == EMSGSIZE)
+            {
+                printf("Message longer than %d bytes, dropping client.\n", MAX_FRAME_SIZE);
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                disconnect_client(shard, client);
+                return;
+            }
+            // Drained, wait for the next notification. A buffer with nothing pending goes back to the pool meanwhile.
+            read_buffer_release_idle(&client->input);
+            return;
+        }
+        if (bytes_received == 0)
+        {
+            // Client disconnected
+            disconnect_client(shard, client);
+            return;
+        }
+        metrics_add(COUNTER_BYTES_RECEIVED, bytes_received);
+        if (!handle_buffered_messages(shard, client))
+        {
+            return;
+        }
+    }
+}
+/*
+Lets throttled clients that have a token again continue: first with the messages already in their read buffer, then
+with reading the socket, whose edge was consumed while they were throttled.
+*/
+void resume_throttled_clients(struct shard *shard)
+{
+    // Backwards, resuming a client moves the last one into its place, and one throttled again goes to the end.
+    // Messages handled on the way can drop other clients from the list too, hence the bound check.
+    for (int i = shard->throttled_count - 1; i >= 0; i--)
+    {
+        if (i >= shard->throttled_count)
+        {
+            continue;
+        }
+        struct client *client = shard->throttled[i];
+        if (has_token(client))
+        {
+            unthrottle_client(shard, client);
+            if (handle_buffered_messages(shard, client))
+            {
+                handle_client(shard, client);
+            }
+        }
+    }
+}
+void disconnect_client(struct shard *shard, struct client *client)
+{
+    if (client->socket == 0)
+    {
+        return;
+    }
+    // Clean up resources and close the socket, closing also removes it from the epoll set.
+    printf("Client disconnected, ip %s, port %d\n", inet_ntoa(client->address.sin_addr), ntohs(client->address.sin_port));
+    close(client->socket);
+    // Free the client's seat or place in the queue, along with any frames that never went out
+    outbound_clear(&client->outbound);
+    read_buffer_free(&client->input);
+    if (client->websocket != NULL)
+    {
+        websocket_free(client->websocket);
+        free(client->websocket);
+        client->websocket = NULL;
+    }
+    client->socket = 0;
+    metrics_add(COUNTER_DISCONNECTED, 1);
+    if (client->transport == TRANSPORT_BINARY)
+    {
+        atomic_fetch_sub(&binary_clients, 1);
+    }
+    if (client->name_entry != NULL)
+    {
+        username_registry_release(client->name_entry);
+    }
+    set_remove(state_set(shard, client), client);
+    unthrottle_client(shard, client);
+    struct admission_node *granted = admission_leave(&admission, &client->admission);
+    if (granted != NULL)
+    {
+        // The seat went to the head of the queue, its shard seats it when it drains its inbox.
+        wake_shard(&shards[granted->owner]);
+    }
+    // The slot itself is freed at the end of the iteration, see release_closed_clients().
+    if (set_add(&shard->closed, client) != 0)
+    {
+        perror("realloc"); // The slot is lost, the client is gone either way
+    }
+}
+// Drops every connection that did not send its username within USERNAME_TIMEOUT seconds.
+void expire_pending_usernames(struct shard *shard)
+{
+    time_t now = time(NULL);
+    // Backwards, disconnecting moves the last pending client into the freed place.
+    for (int i = shard->pending.count - 1; i >= 0; i--)
+    {
+        struct client *client = shard->pending.items[i];
+        if (now >= client->deadline)
+        {
+            // Timeout occurred
+            printf("Timeout occurred while waiting for username.\n");
+            disconnect_client(shard, client);
+        }
+    }
+}
+// Tells this shard's waiting clients their new position whenever the head of the queue moved.
+void update_queue_positions(struct shard *shard)
+{
+    if (shard->waiting.count == 0)
+    {
+        return;
+    }
+    unsigned long long head = admission_head(&admission);
+    if (head == shard->queue_head)
+    {
+        return;
+    }
+    shard->queue_head = head;
+    for (int i = 0; i < shard->waiting.count; i++)
+    {
+        send_queue_position(shard, shard->waiting.items[i], head);
+    }
+}
+// Room occupancy for the metrics endpoint, read under the admission lock like every other access to it.
+void write_room_gauges(FILE *out)
+{
+    pthread_mutex_lock(&admission.lock);
+    int seated = admission.seated, waiting = admission.waiting;
+    pthread_mutex_unlock(&admission.lock);
+    fprintf(out, "# HELP chat_room_members Users seated in the room.\n# TYPE chat_room_members gauge\nchat_room_members %d\n", seated);
+    fprintf(out, "# HELP chat_queue_length Users waiting for a seat.\n# TYPE chat_queue_length gauge\nchat_queue_length %d\n", waiting);
+}
+/*
+Prints how many allocations a client message cost on average since the last report, every --alloc-report seconds.
+Shard 0 reports for all of them. A growing heap count means something on the message path went back to malloc.
+*/
+void report_allocations(struct shard *shard)
+{
+    static time_t last_report;
+    static struct alloc_stats last;
+    if (shard->id != 0 || config.alloc_report_interval <= 0 || shard->last_tick - last_report < config.alloc_report_interval)
+    {
+        return;
+    }
+    struct alloc_stats total;
+    alloc_stats_total(&total);
+    unsigned long long messages = total.messages - last.messages;
+    if (last_report != 0 && messages > 0)
+    {
+        printf("Allocations per message: %.2f heap, %.2f arena, %.2f reused from slabs (%llu messages)\n",
+               (double)(total.heap_allocations - last.heap_allocations) / messages,
+               (double)(total.arena_allocations - last.arena_allocations) / messages,
+               (double)(total.slab_hits - last.slab_hits) / messages, messages);
     }
+    last_report = shard->last_tick;
+    last = total;
 }
 int try_bind_alternative_addresses(int server_fd, struct sockaddr_in *address) {
     struct hostent *host_info;
-    struct sockaddr_in *s;
+    struct in_addr *s;
     char hostname[256];
     char ip[256];
-    int num_addresses = 0;
     int i;
 
     // Get the hostname
@@ -312,8 +1876,9 @@ int try_bind_alternative_addresses(int server_fd, struct sockaddr_in *address) {
 
     // Iterate through the list of addresses and attempt to bind
     for (i = 0; host_info->h_addr_list[i] != NULL; i++) {
-        s = (struct sockaddr_in *)host_info->h_addr_list[i];
-        const char *ip_address = inet_ntop(AF_INET, &(s->sin_addr), ip, sizeof(ip));
+        // h_addr_list holds struct in_addr entries for AF_INET hosts
+        s = (struct in_addr *)host_info->h_addr_list[i];
+        const char *ip_address = inet_ntop(AF_INET, s, ip, sizeof(ip));
         if (ip_address == NULL) {
             perror("inet_ntop");
             return -1;
@@ -0,0 +1,219 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "database.h" //Database functions
+#include "storage.h"
+#include "message_log.h"
+#include "spsc_queue.h"
+#include "outbound.h"
+#include "framing.h"
+#include "persist.h"
+#include "history_ring.h"
+#include "slot_table.h"
+#include "admission.h"
+#include "username_registry.h"
+#include "websocket.h"
+#include "binary_protocol.h"
+#include "history_block.h"
+#include "memory_pool.h"
+#include "metrics.h"
+#include "relay.h"
+#include "history_reader.h"
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include <getopt.h>
+
+#define PORT 8080
+#define MAX_EVENTS 64       // Maximum number of ready events handled per epoll_wait() call
+#define USERNAME_TIMEOUT 10 // Seconds a new connection has to send its username
+#define MAX_SHARDS 64       // Upper bound on reactor threads, one per core
+#define SHARD_QUEUE_SIZE 4096 // Messages that can be in flight from one shard to another
+#define DEFAULT_OUTBOUND_HIGH_WATER (256 * 1024) // Bytes queued for one client before it counts as a slow consumer
+#define DEFAULT_DB_POOL_SIZE 3 // Database connections: the writer thread, the history reader and the retention job
+#define DEFAULT_RATE_BURST 20 // Messages a rate-limited client may send back to back before --rate-limit applies
+
+/*
+    Every connection first has to send its username (AWAITING_USERNAME). If the room has a free seat it then
+    receives the chat history and can send messages to the room (CHATTING), otherwise it waits in the
+    admission queue (QUEUED) and is told its position until a seat frees up.
+*/
+enum client_state { AWAITING_USERNAME, QUEUED, CHATTING };
+
+/*
+    How a connection speaks, decided by its first byte: an HTTP Upgrade request starts with 'G' (GET),
+    anything else is the newline-delimited protocol. A newline-delimited client may switch to the binary
+    protocol (see binary_protocol.h) in its username handshake.
+*/
+enum client_transport { TRANSPORT_UNKNOWN, TRANSPORT_LINES, TRANSPORT_WEBSOCKET, TRANSPORT_BINARY };
+
+/*
+    - socket: The client's socket file descriptor, 0 when the slot is free.
+    - state: Where the client is in the handshake (see enum client_state).
+    - deadline: The time by which the username has to arrive, only meaningful while AWAITING_USERNAME.
+    - username: The username the client sent during the handshake.
+    - address: The peer address, kept for logging once the socket is closed.
+    - outbound: Frames waiting to be written to this client, flushed with writev when the socket is writable.
+    - flush_pending: Set while the client is on its shard's dirty list.
+    - input: Bytes received from the client that haven't been handled yet, split into frames on FRAME_DELIMITER.
+    - peer_closed: epoll reported EPOLLRDHUP, the peer shut down its side. The socket is read until EOF then, a short
+      read doesn't mean another edge will follow.
+    - slot: The client's slot number in its shard's client table.
+    - set_index: Position in the shard's client_set for the current state (pending, waiting or members).
+    - admission: The client's seat or place in the admission queue.
+    - join_history: The history page asked for in the handshake, sent once the client is seated.
+    - name_entry: The client's username in the registry, NULL until it claimed one.
+    - transport: The protocol the client speaks, see enum client_transport.
+    - websocket: Framing state of a WebSocket client, NULL for everyone else.
+    - compress_history: The client asked for history pages as compressed blocks (see history_block.h).
+    - tokens/tokens_refilled: The client's token bucket under --rate-limit, the messages it may send right away and
+      when (metrics_now) it was last topped up.
+    - throttle_index: Position in the shard's throttled list while the client is out of tokens, -1 otherwise.
+    - connection: Number of the connection on its shard, tells a history page read for an earlier occupant of the
+      slot apart from one for this client.
+*/
+struct client {
+    int socket;
+    enum client_state state;
+    time_t deadline;
+    char username[256];
+    struct sockaddr_in address;
+    struct outbound_queue outbound;
+    bool flush_pending;
+    struct read_buffer input;
+    bool peer_closed;
+    int slot;
+    int set_index;
+    struct admission_node admission;
+    struct history_request join_history;
+    struct username_entry *name_entry;
+    enum client_transport transport;
+    struct websocket_state *websocket;
+    bool compress_history;
+    double tokens;
+    uint64_t tokens_refilled;
+    int throttle_index;
+    uint64_t connection;
+};
+
+/*
+    Dense array of clients, removal moves the last one into the gap so iterating never skips over free slots.
+    Every client is in exactly one of its shard's sets, picked by its state, and remembers where (set_index).
+*/
+struct client_set {
+    struct client **items;
+    int count;
+    int capacity;
+};
+
+/*
+    One reactor thread. Every shard has its own SO_REUSEPORT listener, so the kernel spreads new
+    connections over the shards, and a client is only ever touched by the shard that accepted it.
+    - server_fd: This shard's listening socket.
+    - epoll_fd: The epoll instance for the listener, the wake_fd and this shard's clients.
+    - wake_fd: eventfd other shards write to after queueing messages in inbox.
+    - wake_pending: Set by the first producer that writes wake_fd, so a burst of messages costs one wakeup.
+    - inbox[MAX_SHARDS]: inbox[i] is only pushed to by shard i and only popped by this shard.
+    - relay_inbox: In a federation (--relay), every message of the room in sequence order, pushed by the relay thread.
+      The shards' own messages come back through it too, inbox stays empty.
+    - history_inbox: History pages the reader thread read from storage for this shard's clients (see history_reader.h).
+    - history_pending: Pages submitted to the reader and not back yet, at most HISTORY_READER_QUEUE_SIZE so neither
+      the reader's queue nor history_inbox can overflow.
+    - connections: Connections accepted so far, numbers the clients (see struct client).
+    - clients: Slots of the clients owned by this shard, taken and freed in O(1).
+    - pending, waiting, members: The clients in the handshake, in the admission queue and in the room. Broadcasts only
+      walk members.
+    - closed: Clients disconnected during the current iteration. Their slots are freed at the end of the first
+      iteration that leaves the dirty list empty, so events and dirty entries still pointing at them stay safe.
+    - dirty: Clients that got new frames during the current event loop iteration. They are flushed once
+      at the end of the iteration, so several messages to the same client go out in one writev.
+      With --coalesce-us they are held back until the first of them has waited that long.
+    - dirty_since: When (metrics_now) the first client got on the dirty list.
+    - throttled: Clients out of rate limit tokens, nothing is read from them until they have one again.
+    - last_tick: Second the timers (username timeouts, queue positions) last ran.
+    - queue_head: Head of the admission queue when the waiting clients were last told their position.
+*/
+struct shard {
+    int id;
+    pthread_t thread;
+    int server_fd;
+    int epoll_fd;
+    int wake_fd;
+    atomic_bool wake_pending;
+    struct spsc_queue inbox[MAX_SHARDS];
+    struct spsc_queue relay_inbox;
+    struct spsc_queue history_inbox;
+    int history_pending;
+    uint64_t connections;
+    struct slot_table clients;
+    struct client_set pending;
+    struct client_set waiting;
+    struct client_set members;
+    struct client_set closed;
+    struct client **dirty;
+    int dirty_count;
+    int dirty_capacity;
+    uint64_t dirty_since;
+    struct client **throttled;
+    int throttled_count;
+    int throttled_capacity;
+    time_t last_tick;
+    unsigned long long queue_head;
+};
+
+/*
+    Runtime settings, filled in from the command line by main().
+    - shards: Number of reactor threads, 0 means one per online core.
+    - outbound_high_water: Bytes that may be queued for one client before slow_consumer_policy applies.
+    - slow_consumer_policy: Whether a client over the high-water mark loses its oldest frames or is disconnected.
+    - persist_batch_size: Most messages the writer thread stores in one transaction.
+    - persist_flush_interval: Milliseconds the writer thread waits for a batch to fill up before storing what it has.
+    - storage: Name of the storage backend (see storage.h).
+    - log_dir: Directory of the embedded message log, used with storage "log".
+    - db_pool_size: Number of pooled database connections, 0 means DEFAULT_DB_POOL_SIZE.
+    - retention_days: Days of messages kept before their daily partition (or log segment) expires, 0 keeps everything.
+    - archive_expired: Keep expired partitions as archive_* tables (or log segments as archive-* files) instead of dropping them.
+    - room_capacity: Members in the room at once, across all shards.
+    - queue_limit: Users that may wait for a seat, anyone beyond that is turned away.
+    - alloc_report_interval: Seconds between reports of the allocations per message, 0 turns them off.
+    - admin_port: Local port the metrics are served on in the Prometheus text format, 0 turns it off.
+    - history_dictionary: File with the preset dictionary for compressed history blocks, NULL for the built-in one.
+    - relay: Address of the relay hub this instance federates through (see relay.h), NULL for a standalone server.
+    - relay_hub: Address to run a relay hub on instead of a chat server, NULL to run a chat server.
+    - relay_state: File the relay hub keeps its sequence reservation in (see relay.h).
+    - coalesce_window_us: Microseconds a shard holds back output so more messages share one writev per client, 0 flushes
+      after every event loop iteration.
+    - rate_limit: Messages per second one client may send, 0 means no limit.
+    - rate_burst: Messages a client may send at once before rate_limit applies.
+*/
+struct server_config {
+    int shards;
+    size_t outbound_high_water;
+    enum slow_consumer_policy slow_consumer_policy;
+    int persist_batch_size;
+    int persist_flush_interval;
+    const char *storage;
+    const char *log_dir;
+    int db_pool_size;
+    int retention_days;
+    bool archive_expired;
+    int room_capacity;
+    int queue_limit;
+    int alloc_report_interval;
+    int admin_port;
+    const char *history_dictionary;
+    const char *relay;
+    const char *relay_hub;
+    const char *relay_state;
+    int coalesce_window_us;
+    int rate_limit;
+    int rate_burst;
+};
+
+extern struct shard *shards;
+extern struct history_ring recent_history;
+extern int num_shards;
+extern struct server_config config;
+extern struct admission_queue admission;
+extern struct username_registry usernames;
+
+#endif
@@ -0,0 +1,43 @@
+#include "slot_table.h"
+#include <stdlib.h>
+#include <string.h>
+
+void slot_table_init(struct slot_table *table, size_t slot_size) {
+    memset(table, 0, sizeof(*table));
+    table->slot_size = slot_size;
+}
+// Adds one chunk of zeroed slots and puts them on the free stack, lowest number on top.
+static int grow(struct slot_table *table) {
+    char **chunks = realloc(table->chunks, (table->chunk_count + 1) * sizeof(char *));
+    if (chunks == NULL) {
+        return -1;
+    }
+    table->chunks = chunks;
+    int *free_slots = realloc(table->free_slots, (table->capacity + SLOT_CHUNK) * sizeof(int));
+    if (free_slots == NULL) {
+        return -1;
+    }
+    table->free_slots = free_slots;
+    if ((table->chunks[table->chunk_count] = calloc(SLOT_CHUNK, table->slot_size)) == NULL) {
+        return -1;
+    }
+    table->chunk_count++;
+    for (int i = SLOT_CHUNK - 1; i >= 0; i--) {
+        table->free_slots[table->free_count++] = table->capacity + i;
+    }
+    table->capacity += SLOT_CHUNK;
+    return 0;
+}
+void *slot_table_alloc(struct slot_table *table, int *slot) {
+    if (table->free_count == 0 && grow(table) != 0) {
+        return NULL;
+    }
+    *slot = table->free_slots[--table->free_count];
+    return slot_table_get(table, *slot);
+}
+void slot_table_release(struct slot_table *table, int slot) {
+    table->free_slots[table->free_count++] = slot;
+}
+void *slot_table_get(const struct slot_table *table, int slot) {
+    return table->chunks[slot / SLOT_CHUNK] + (size_t)(slot % SLOT_CHUNK) * table->slot_size;
+}
@@ -0,0 +1,29 @@
+#ifndef SLOT_TABLE_H
+#define SLOT_TABLE_H
+
+#include <stddef.h>
+
+#define SLOT_CHUNK 1024 // Slots added to a table at a time
+
+/*
+    Growable table of fixed-size slots with O(1) allocation and release through a stack of free slot numbers.
+    - chunks: Slots are allocated SLOT_CHUNK at a time and never move, so pointers to them stay valid
+      (epoll keeps them as event data) while the table grows.
+    - free_slots: Numbers of the slots that are free, the most recently released one on top.
+    New chunks are zeroed, a released slot keeps whatever its owner left in it.
+*/
+struct slot_table {
+    size_t slot_size;
+    char **chunks;
+    int chunk_count;
+    int *free_slots;
+    int free_count;
+    int capacity;
+};
+
+void slot_table_init(struct slot_table *table, size_t slot_size);
+void *slot_table_alloc(struct slot_table *table, int *slot); // returns NULL if the table couldn't grow
+void slot_table_release(struct slot_table *table, int slot);
+void *slot_table_get(const struct slot_table *table, int slot);
+
+#endif
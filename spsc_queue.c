@@ -0,0 +1,44 @@
+#include "spsc_queue.h"
+#include <stdlib.h>
+
+int spsc_init(struct spsc_queue *queue, size_t capacity) {
+    size_t size = 1;
+    while (size < capacity) { // Round up to the next power of two
+        size <<= 1;
+    }
+    queue->slots = calloc(size, sizeof(void *));
+    if (queue->slots == NULL) {
+        return -1;
+    }
+    queue->mask = size - 1;
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->tail, 0);
+    return 0;
+}
+void spsc_destroy(struct spsc_queue *queue) {
+    free(queue->slots);
+    queue->slots = NULL;
+}
+bool spsc_push(struct spsc_queue *queue, void *item) {
+    // Only the producer writes tail, so a relaxed load of our own index is enough.
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+    if (tail - head > queue->mask) { // Full
+        return false;
+    }
+    queue->slots[tail & queue->mask] = item;
+    // Release: the slot write above becomes visible before the consumer sees the new tail.
+    atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+    return true;
+}
+void *spsc_pop(struct spsc_queue *queue) {
+    size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+    if (head == tail) { // Empty
+        return NULL;
+    }
+    void *item = queue->slots[head & queue->mask];
+    // Release: the slot is read before the producer is allowed to reuse it.
+    atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+    return item;
+}
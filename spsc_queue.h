@@ -0,0 +1,27 @@
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+    Bounded lock-free queue with exactly one producer thread and one consumer thread.
+    - head: Next slot to pop, only written by the consumer.
+    - tail: Next slot to push, only written by the producer.
+    Both live on their own cache line so the two threads don't invalidate each other's line on every operation.
+    The capacity is rounded up to a power of two so indices wrap with a mask instead of a division.
+*/
+struct spsc_queue {
+    _Alignas(64) atomic_size_t head;
+    _Alignas(64) atomic_size_t tail;
+    _Alignas(64) size_t mask;
+    void **slots;
+};
+
+int spsc_init(struct spsc_queue *queue, size_t capacity); // returns 0 on success, -1 if allocation failed
+void spsc_destroy(struct spsc_queue *queue);
+bool spsc_push(struct spsc_queue *queue, void *item);     // producer side, returns false if the queue is full
+void *spsc_pop(struct spsc_queue *queue);                 // consumer side, returns NULL if the queue is empty
+
+#endif
@@ -0,0 +1,39 @@
+#include "storage.h"
+
+static const struct storage_backend *backends[] = {&postgres_storage, &log_storage, &memory_storage};
+static const struct storage_backend *backend;
+
+int storage_init(const char *name, int pool_size, const char *path) {
+    for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+        if (strcmp(backends[i]->name, name) == 0) {
+            backend = backends[i];
+            backend->open(pool_size, path);
+            return 0;
+        }
+    }
+    return -1;
+}
+void storage_maintenance_start(int retention_days, bool archive) {
+    backend->maintenance_start(retention_days, archive);
+}
+bool storage_shared(void) {
+    return backend->shared;
+}
+bool send_chat_history(const struct history_request *request, history_callback emit, void *context) {
+    return backend->send_chat_history(request, emit, context);
+}
+void insert_message(long long id, const char *room, const char *time, const char *username, const char *message) {
+    backend->insert_message(id, room, time, username, message);
+}
+bool insert_messages(const struct stored_message **messages, int count) {
+    return backend->insert_messages(messages, count);
+}
+void insert_username(const char *username) {
+    backend->insert_username(username);
+}
+bool insert_usernames(const char **usernames, int count) {
+    return backend->insert_usernames(usernames, count);
+}
+bool load_usernames(username_callback each, void *context) {
+    return backend->load_usernames(each, context);
+}
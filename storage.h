@@ -0,0 +1,42 @@
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include "database.h"
+
+#define DEFAULT_STORAGE "postgres" // Backend used without --storage
+
+/*
+    Where messages and usernames are kept. The storage functions declared in database.h (send_chat_history,
+    insert_message(s), insert_username(s), load_usernames) forward to the backend opened with storage_init, so the
+    rest of the server doesn't know which one it talks to. Every backend streams history rows in the same JSON form.
+    - name: What --storage selects it by.
+    - shared: Every server process that opens it sees the same data (a database server), rather than storage of its
+      own (files, memory). Federated instances (see relay.h) only store the messages posted on a shared one once.
+    - open: Connects to or opens the storage, exits if that fails. pool_size is the number of threads that may call
+      it at once, path the directory of an embedded backend.
+    - maintenance_start: Starts whatever the backend does in the background, with the retention settings.
+    The others implement the function of the same name in database.h.
+*/
+struct storage_backend {
+    const char *name;
+    bool shared;
+    void (*open)(int pool_size, const char *path);
+    void (*maintenance_start)(int retention_days, bool archive);
+    bool (*send_chat_history)(const struct history_request *request, history_callback emit, void *context);
+    void (*insert_message)(long long id, const char *room, const char *time, const char *username, const char *message);
+    bool (*insert_messages)(const struct stored_message **messages, int count);
+    void (*insert_username)(const char *username);
+    bool (*insert_usernames)(const char **usernames, int count);
+    bool (*load_usernames)(username_callback each, void *context);
+};
+
+extern const struct storage_backend postgres_storage; // database.c and schema.c
+extern const struct storage_backend log_storage;      // message_log.c, the embedded append-only log
+extern const struct storage_backend memory_storage;   // database_stub.c, nothing survives a restart
+
+// Opens the backend called name. Returns -1 if there is no such backend.
+int storage_init(const char *name, int pool_size, const char *path);
+void storage_maintenance_start(int retention_days, bool archive);
+bool storage_shared(void); // the opened backend's shared flag
+
+#endif
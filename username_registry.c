@@ -0,0 +1,119 @@
+#include "username_registry.h"
+#include <stdlib.h>
+#include <string.h>
+
+// 64-bit FNV-1a, the top bits pick the shard and the low bits the slot, so both stay independent.
+static uint64_t hash_name(const char *name) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (const unsigned char *p = (const unsigned char *)name; *p != '\0'; p++) {
+        hash = (hash ^ *p) * 1099511628211ULL;
+    }
+    return hash;
+}
+static struct registry_shard *shard_of(struct username_registry *registry, uint64_t hash) {
+    return &registry->shards[(hash >> 58) % REGISTRY_SHARDS];
+}
+int username_registry_init(struct username_registry *registry) {
+    atomic_init(&registry->next_id, 1);
+    for (int i = 0; i < REGISTRY_SHARDS; i++) {
+        struct registry_shard *shard = &registry->shards[i];
+        pthread_mutex_init(&shard->lock, NULL);
+        if ((shard->slots = calloc(REGISTRY_INITIAL_SLOTS, sizeof(struct username_entry *))) == NULL) {
+            return -1;
+        }
+        shard->mask = REGISTRY_INITIAL_SLOTS - 1;
+        shard->count = 0;
+    }
+    return 0;
+}
+// Finds the slot holding the name, or the empty slot where it belongs. Lock held.
+static struct username_entry **find_slot(struct registry_shard *shard, const char *name, uint64_t hash) {
+    size_t i = hash & shard->mask;
+    while (shard->slots[i] != NULL && (shard->slots[i]->hash != hash || strcmp(shard->slots[i]->name, name) != 0)) {
+        i = (i + 1) & shard->mask;
+    }
+    return &shard->slots[i];
+}
+// Doubles the table and reinserts every entry. Lock held.
+static int grow(struct registry_shard *shard) {
+    size_t size = (shard->mask + 1) * 2;
+    struct username_entry **slots = calloc(size, sizeof(struct username_entry *));
+    if (slots == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i <= shard->mask; i++) {
+        struct username_entry *entry = shard->slots[i];
+        if (entry != NULL) {
+            size_t j = entry->hash & (size - 1);
+            while (slots[j] != NULL) {
+                j = (j + 1) & (size - 1);
+            }
+            slots[j] = entry;
+        }
+    }
+    free(shard->slots);
+    shard->slots = slots;
+    shard->mask = size - 1;
+    return 0;
+}
+// Looks the name up and inserts it if it is missing. Lock held. Returns NULL only if memory ran out.
+static struct username_entry *lookup_or_insert(struct username_registry *registry, struct registry_shard *shard, const char *name, uint64_t hash,
+                                               bool *inserted) {
+    struct username_entry **slot = find_slot(shard, name, hash);
+    *inserted = false;
+    if (*slot != NULL) {
+        return *slot;
+    }
+    if ((shard->count + 1) * 2 > shard->mask + 1) {
+        if (grow(shard) != 0) {
+            return NULL;
+        }
+        slot = find_slot(shard, name, hash);
+    }
+    size_t length = strlen(name) + 1;
+    struct username_entry *entry = malloc(sizeof(struct username_entry) + length);
+    if (entry == NULL) {
+        return NULL;
+    }
+    entry->hash = hash;
+    entry->id = atomic_fetch_add(&registry->next_id, 1);
+    atomic_init(&entry->online, false);
+    memcpy(entry->name, name, length);
+    *slot = entry;
+    shard->count++;
+    *inserted = true;
+    return entry;
+}
+bool username_registry_add(struct username_registry *registry, const char *name) {
+    uint64_t hash = hash_name(name);
+    struct registry_shard *shard = shard_of(registry, hash);
+    bool inserted;
+    pthread_mutex_lock(&shard->lock);
+    struct username_entry *entry = lookup_or_insert(registry, shard, name, hash, &inserted);
+    pthread_mutex_unlock(&shard->lock);
+    return entry != NULL;
+}
+struct username_entry *username_registry_claim(struct username_registry *registry, const char *name, bool *is_new) {
+    uint64_t hash = hash_name(name);
+    struct registry_shard *shard = shard_of(registry, hash);
+    pthread_mutex_lock(&shard->lock);
+    struct username_entry *entry = lookup_or_insert(registry, shard, name, hash, is_new);
+    // Checking and setting online happen under the same lock as the lookup, two logins can't both get the name.
+    if (entry != NULL && atomic_exchange(&entry->online, true)) {
+        entry = NULL;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return entry;
+}
+uint32_t username_registry_id(struct username_registry *registry, const char *name) {
+    uint64_t hash = hash_name(name);
+    struct registry_shard *shard = shard_of(registry, hash);
+    pthread_mutex_lock(&shard->lock);
+    struct username_entry *entry = *find_slot(shard, name, hash);
+    uint32_t id = (entry != NULL) ? entry->id : 0;
+    pthread_mutex_unlock(&shard->lock);
+    return id;
+}
+void username_registry_release(struct username_entry *entry) {
+    atomic_store(&entry->online, false);
+}
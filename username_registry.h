@@ -0,0 +1,60 @@
+#ifndef USERNAME_REGISTRY_H
+#define USERNAME_REGISTRY_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define REGISTRY_SHARDS 64          // Independently locked parts of the registry, a name's hash picks one
+#define REGISTRY_INITIAL_SLOTS 1024 // Slots per shard before the first growth, always a power of two
+
+/*
+    One known username. Entries are never freed, every name that was ever used stays in the Usernames table,
+    so a client can keep a pointer to its entry for as long as it is connected.
+    - online: Set while a connected client uses the name, cleared without the lock when it disconnects.
+    - id: Number given to the name when it entered the registry, the user id of the binary protocol.
+      Only stable for the lifetime of the process.
+*/
+struct username_entry {
+    uint64_t hash;
+    uint32_t id;
+    atomic_bool online;
+    char name[];
+};
+
+/*
+    Open-addressing hash table with linear probing, holding pointers to entries. It grows to twice the size
+    once it is half full, so probes stay short.
+*/
+struct registry_shard {
+    pthread_mutex_t lock;
+    struct username_entry **slots;
+    size_t mask;
+    size_t count;
+};
+
+/*
+    Every username the chat knows, loaded from the Usernames table at startup and the authority on them from then on.
+    Logins claim a name with one check-and-insert under a single shard's lock instead of a database round trip;
+    new names are stored in the background by the caller.
+*/
+struct username_registry {
+    struct registry_shard shards[REGISTRY_SHARDS];
+    atomic_uint next_id;
+};
+
+int username_registry_init(struct username_registry *registry); // returns -1 if allocation failed
+// Adds a stored name at startup, not in use by anyone.
+bool username_registry_add(struct username_registry *registry, const char *name);
+/*
+    Claims a name for a connecting client. Returns its entry, or NULL if another connected client uses it (or memory ran out).
+    *is_new is set when the name was never seen before and still has to be stored.
+*/
+struct username_entry *username_registry_claim(struct username_registry *registry, const char *name, bool *is_new);
+// The id of a known name, 0 if the name isn't in the registry.
+uint32_t username_registry_id(struct username_registry *registry, const char *name);
+// Gives a claimed name back when its client disconnects.
+void username_registry_release(struct username_entry *entry);
+
+#endif
@@ -0,0 +1,460 @@
+#define _GNU_SOURCE
+#include "websocket.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#define WEBSOCKET_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11" // Appended to the client's key, RFC 6455 section 1.3
+
+// SHA-1 of a short message, only used to derive Sec-WebSocket-Accept.
+static void sha1(const uint8_t *message, size_t length, uint8_t digest[20]) {
+    uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+    size_t padded = ((length + 8) / 64 + 1) * 64;
+    uint8_t *data = calloc(padded, 1);
+    if (data == NULL) {
+        memset(digest, 0, 20);
+        return;
+    }
+    memcpy(data, message, length);
+    data[length] = 0x80;
+    uint64_t bits = (uint64_t)length * 8;
+    for (int i = 0; i < 8; i++) {
+        data[padded - 1 - i] = (uint8_t)(bits >> (8 * i));
+    }
+    for (size_t block = 0; block < padded; block += 64) {
+        uint32_t w[80];
+        for (int i = 0; i < 16; i++) {
+            const uint8_t *p = data + block + 4 * i;
+            w[i] = (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+        }
+        for (int i = 16; i < 80; i++) {
+            uint32_t x = w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16];
+            w[i] = (x << 1) | (x >> 31);
+        }
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (int i = 0; i < 80; i++) {
+            uint32_t f, k;
+            if (i < 20) {
+                f = (b & c) | (~b & d);
+                k = 0x5A827999;
+            } else if (i < 40) {
+                f = b ^ c ^ d;
+                k = 0x6ED9EBA1;
+            } else if (i < 60) {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8F1BBCDC;
+            } else {
+                f = b ^ c ^ d;
+                k = 0xCA62C1D6;
+            }
+            uint32_t t = ((a << 5) | (a >> 27)) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = (b << 30) | (b >> 2);
+            b = a;
+            a = t;
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+    }
+    free(data);
+    for (int i = 0; i < 5; i++) {
+        digest[4 * i] = (uint8_t)(h[i] >> 24);
+        digest[4 * i + 1] = (uint8_t)(h[i] >> 16);
+        digest[4 * i + 2] = (uint8_t)(h[i] >> 8);
+        digest[4 * i + 3] = (uint8_t)h[i];
+    }
+}
+// Standard base64 with padding, out needs 4 * ((length + 2) / 3) + 1 bytes.
+static void base64(const uint8_t *in, size_t length, char *out) {
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    size_t o = 0;
+    for (size_t i = 0; i < length; i += 3) {
+        uint32_t v = (uint32_t)in[i] << 16;
+        if (i + 1 < length) {
+            v |= (uint32_t)in[i + 1] << 8;
+        }
+        if (i + 2 < length) {
+            v |= in[i + 2];
+        }
+        out[o++] = alphabet[(v >> 18) & 63];
+        out[o++] = alphabet[(v >> 12) & 63];
+        out[o++] = (i + 1 < length) ? alphabet[(v >> 6) & 63] : '=';
+        out[o++] = (i + 2 < length) ? alphabet[v & 63] : '=';
+    }
+    out[o] = '\0';
+}
+// Case-insensitive search for needle in the first length bytes of haystack.
+static bool contains_token(const char *haystack, size_t length, const char *needle) {
+    size_t needle_length = strlen(needle);
+    for (size_t i = 0; i + needle_length <= length; i++) {
+        if (strncasecmp(haystack + i, needle, needle_length) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+int websocket_handshake(struct read_buffer *buffer, char *response, size_t size, bool *deflate) {
+    static const char bad_request[] = "HTTP/1.1 400 Bad Request\r\nConnection: close\r\nContent-Length: 0\r\n\r\n";
+    char *request;
+    size_t pending = read_buffer_pending(buffer, &request);
+    char *end = memmem(request, pending, "\r\n\r\n", 4);
+    if (end == NULL) {
+        if (pending <= WEBSOCKET_MAX_REQUEST) {
+            return 0;
+        }
+        snprintf(response, size, "%s", bad_request);
+        return -(int)strlen(response);
+    }
+    size_t request_length = end - request + 4;
+
+    // Walk the header lines, only the ones the handshake depends on matter.
+    const char *key = NULL, *extensions = NULL;
+    size_t key_length = 0, extensions_length = 0;
+    bool upgrade = false, connection = false, version = false;
+    const char *line = (const char *)memchr(request, '\n', request_length) + 1; // Past the request line
+    while (line < end) {
+        const char *line_end = memchr(line, '\r', end + 2 - line);
+        const char *colon = memchr(line, ':', line_end - line);
+        if (colon != NULL) {
+            const char *value = colon + 1;
+            while (value < line_end && (*value == ' ' || *value == '\t')) {
+                value++;
+            }
+            size_t name_length = colon - line, value_length = line_end - value;
+            if (name_length == 7 && strncasecmp(line, "Upgrade", 7) == 0) {
+                upgrade = contains_token(value, value_length, "websocket");
+            } else if (name_length == 10 && strncasecmp(line, "Connection", 10) == 0) {
+                connection = contains_token(value, value_length, "upgrade");
+            } else if (name_length == 21 && strncasecmp(line, "Sec-WebSocket-Version", 21) == 0) {
+                version = (value_length == 2 && strncmp(value, "13", 2) == 0);
+            } else if (name_length == 17 && strncasecmp(line, "Sec-WebSocket-Key", 17) == 0) {
+                key = value;
+                key_length = value_length;
+            } else if (name_length == 24 && strncasecmp(line, "Sec-WebSocket-Extensions", 24) == 0) {
+                extensions = value;
+                extensions_length = value_length;
+            }
+        }
+        line = line_end + 2;
+    }
+    read_buffer_consume(buffer, request_length);
+
+    if (strncmp(request, "GET ", 4) != 0 || !upgrade || !connection || !version || key == NULL || key_length == 0 || key_length > 64) {
+        snprintf(response, size, "%s", bad_request);
+        return -(int)strlen(response);
+    }
+
+    // Sec-WebSocket-Accept is base64(SHA-1(key + GUID)).
+    uint8_t input[64 + sizeof(WEBSOCKET_GUID)], digest[20];
+    char accept[29];
+    memcpy(input, key, key_length);
+    memcpy(input + key_length, WEBSOCKET_GUID, sizeof(WEBSOCKET_GUID) - 1);
+    sha1(input, key_length + sizeof(WEBSOCKET_GUID) - 1, digest);
+    base64(digest, sizeof(digest), accept);
+
+    // Compression always runs with a full 15 bit window, so an offer that limits the server's window is declined.
+    *deflate = extensions != NULL && contains_token(extensions, extensions_length, "permessage-deflate") &&
+               !contains_token(extensions, extensions_length, "server_max_window_bits");
+    return snprintf(response, size,
+                    "HTTP/1.1 101 Switching Protocols\r\n"
+                    "Upgrade: websocket\r\n"
+                    "Connection: Upgrade\r\n"
+                    "Sec-WebSocket-Accept: %s\r\n"
+                    "%s"
+                    "\r\n",
+                    accept,
+                    *deflate ? "Sec-WebSocket-Extensions: permessage-deflate; server_no_context_takeover; client_no_context_takeover\r\n" : "");
+}
+void websocket_unmask(char *dst, const char *src, size_t length, const uint8_t mask[4]) {
+    // GCC vector extension, compiled to one SSE/NEON XOR per 16 bytes. Loads and stores go through memcpy,
+    // neither side is aligned, and every block is loaded before it is stored so dst may overlap src from below.
+    typedef uint8_t block __attribute__((vector_size(16)));
+    block key;
+    for (int i = 0; i < 16; i++) {
+        key[i] = mask[i & 3];
+    }
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        block data;
+        memcpy(&data, src + i, 16);
+        data ^= key;
+        memcpy(dst + i, &data, 16);
+    }
+    for (; i < length; i++) {
+        dst[i] = src[i] ^ mask[i & 3];
+    }
+}
+// Makes sure buffer holds at least needed bytes. Returns false if that would exceed MAX_FRAME_SIZE (plus the terminator).
+static bool reserve(char **buffer, size_t *capacity, size_t needed) {
+    if (needed <= *capacity) {
+        return true;
+    }
+    if (needed > MAX_FRAME_SIZE + 1) {
+        return false;
+    }
+    size_t grown = (*capacity > 0) ? *capacity : 1024;
+    while (grown < needed) {
+        grown *= 2;
+    }
+    if (grown > MAX_FRAME_SIZE + 1) {
+        grown = MAX_FRAME_SIZE + 1;
+    }
+    char *data = realloc(*buffer, grown);
+    if (data == NULL) {
+        return false;
+    }
+    *buffer = data;
+    *capacity = grown;
+    return true;
+}
+// Decompresses a permessage-deflate payload into ws->inflated. Returns false for corrupt data or more than MAX_FRAME_SIZE bytes.
+static bool inflate_message(struct websocket_state *ws, const char *data, size_t length, size_t *inflated_length) {
+    static const uint8_t tail[4] = {0x00, 0x00, 0xff, 0xff}; // Stripped by the sender, RFC 7692 section 7.2.2
+    if (ws->inflater == NULL) {
+        if ((ws->inflater = calloc(1, sizeof(z_stream))) == NULL) {
+            return false;
+        }
+        if (inflateInit2(ws->inflater, -MAX_WBITS) != Z_OK) {
+            free(ws->inflater);
+            ws->inflater = NULL;
+            return false;
+        }
+    } else {
+        inflateReset(ws->inflater); // client_no_context_takeover, every message starts from an empty window
+    }
+    if (!reserve(&ws->inflated, &ws->inflated_capacity, MAX_FRAME_SIZE + 1)) {
+        return false;
+    }
+    z_stream *z = ws->inflater;
+    z->next_out = (Bytef *)ws->inflated;
+    z->avail_out = MAX_FRAME_SIZE;
+    for (int part = 0; part < 2; part++) {
+        z->next_in = (Bytef *)((part == 0) ? (const uint8_t *)data : tail);
+        z->avail_in = (part == 0) ? length : sizeof(tail);
+        int status = inflate(z, Z_SYNC_FLUSH);
+        if ((status != Z_OK && status != Z_STREAM_END && status != Z_BUF_ERROR) || (z->avail_out == 0 && z->avail_in > 0)) {
+            return false;
+        }
+    }
+    *inflated_length = MAX_FRAME_SIZE - z->avail_out;
+    ws->inflated[*inflated_length] = '\0';
+    return true;
+}
+enum websocket_result websocket_next_message(struct read_buffer *buffer, struct websocket_state *ws, char **payload, size_t *length) {
+    while (true) {
+        char *data;
+        size_t pending = read_buffer_pending(buffer, &data);
+        if (pending < 2) {
+            return WS_NEED_MORE;
+        }
+        uint8_t *header = (uint8_t *)data;
+        bool fin = header[0] & 0x80, rsv1 = header[0] & 0x40;
+        int opcode = header[0] & 0x0F;
+        bool masked = header[1] & 0x80;
+        uint64_t payload_length = header[1] & 0x7F;
+        size_t header_length = 2;
+        if (payload_length == 126) {
+            if (pending < 4) {
+                return WS_NEED_MORE;
+            }
+            payload_length = (uint64_t)header[2] << 8 | header[3];
+            header_length = 4;
+        } else if (payload_length == 127) {
+            if (pending < 10) {
+                return WS_NEED_MORE;
+            }
+            payload_length = 0;
+            for (int i = 0; i < 8; i++) {
+                payload_length = payload_length << 8 | header[2 + i];
+            }
+            header_length = 10;
+        }
+        // Clients must mask every frame, reserved bits other than RSV1 (deflate) must be clear, control frames are short and whole.
+        if (!masked || (header[0] & 0x30) || (rsv1 && !ws->deflate) || payload_length > MAX_FRAME_SIZE - WEBSOCKET_MAX_HEADER ||
+            (opcode >= WS_CLOSE && (!fin || payload_length > 125 || rsv1))) {
+            return WS_PROTOCOL_ERROR;
+        }
+        if (pending < header_length + 4 + payload_length) {
+            return WS_NEED_MORE;
+        }
+        // Copied out, unmasking in place overwrites the header and the mask with it.
+        uint8_t mask[4];
+        memcpy(mask, header + header_length, 4);
+        char *body = data + header_length + 4;
+        read_buffer_consume(buffer, header_length + 4 + payload_length);
+
+        if (opcode >= WS_CLOSE) {
+            // Unmask over the header, which leaves room for the terminator right behind the payload.
+            websocket_unmask(data, body, payload_length, mask);
+            data[payload_length] = '\0';
+            if (opcode == WS_PONG) {
+                continue;
+            }
+            *payload = data;
+            *length = payload_length;
+            return (opcode == WS_PING) ? WS_PING_RECEIVED : WS_CLOSE_RECEIVED;
+        }
+        if (opcode != WS_CONTINUATION && opcode != WS_TEXT && opcode != WS_BINARY) {
+            return WS_PROTOCOL_ERROR;
+        }
+        if ((opcode == WS_CONTINUATION) != ws->fragmented || (opcode == WS_CONTINUATION && rsv1)) {
+            return WS_PROTOCOL_ERROR;
+        }
+
+        char *message;
+        size_t message_length;
+        if (!ws->fragmented && fin) {
+            // The usual case, a whole message in one frame: unmasked in place, no copy.
+            websocket_unmask(data, body, payload_length, mask);
+            message = data;
+            message_length = payload_length;
+            ws->compressed = rsv1;
+        } else {
+            // A fragment, collected until the frame with FIN set.
+            if (opcode != WS_CONTINUATION) {
+                ws->fragmented = true;
+                ws->compressed = rsv1;
+                ws->length = 0;
+            }
+            if (!reserve(&ws->message, &ws->capacity, ws->length + payload_length + 1)) {
+                return WS_PROTOCOL_ERROR;
+            }
+            websocket_unmask(ws->message + ws->length, body, payload_length, mask);
+            ws->length += payload_length;
+            if (!fin) {
+                continue;
+            }
+            ws->fragmented = false;
+            message = ws->message;
+            message_length = ws->length;
+        }
+
+        if (ws->compressed) {
+            if (!inflate_message(ws, message, message_length, &message_length)) {
+                return WS_PROTOCOL_ERROR;
+            }
+            message = ws->inflated;
+        } else {
+            message[message_length] = '\0';
+        }
+        *payload = message;
+        *length = message_length;
+        return WS_MESSAGE;
+    }
+}
+void websocket_free(struct websocket_state *ws) {
+    if (ws->inflater != NULL) {
+        inflateEnd(ws->inflater);
+        free(ws->inflater);
+    }
+    free(ws->message);
+    free(ws->inflated);
+    memset(ws, 0, sizeof(*ws));
+}
+// Writes a server frame header (never masked) and returns its length.
+static size_t write_header(uint8_t *out, uint8_t first_byte, size_t length) {
+    out[0] = first_byte;
+    if (length < 126) {
+        out[1] = (uint8_t)length;
+        return 2;
+    }
+    if (length <= 0xFFFF) {
+        out[1] = 126;
+        out[2] = (uint8_t)(length >> 8);
+        out[3] = (uint8_t)length;
+        return 4;
+    }
+    out[1] = 127;
+    for (int i = 0; i < 8; i++) {
+        out[2 + i] = (uint8_t)((uint64_t)length >> (56 - 8 * i));
+    }
+    return 10;
+}
+static size_t header_size(size_t length) {
+    return (length < 126) ? 2 : (length <= 0xFFFF) ? 4 : 10;
+}
+struct frame *websocket_encode(const struct frame *lines) {
+    // Every line costs its header instead of its '\n'.
+    size_t total = 0;
+    for (const char *line = lines->data, *end = lines->data + lines->length; line < end;) {
+        const char *newline = memchr(line, '\n', end - line);
+        size_t length = (newline != NULL ? newline : end) - line;
+        total += header_size(length) + length;
+        line += length + 1;
+    }
+    struct frame *frame = frame_alloc(total);
+    if (frame == NULL) {
+        return NULL;
+    }
+    uint8_t *out = (uint8_t *)frame->data;
+    for (const char *line = lines->data, *end = lines->data + lines->length; line < end;) {
+        const char *newline = memchr(line, '\n', end - line);
+        size_t length = (newline != NULL ? newline : end) - line;
+        out += write_header(out, 0x80 | WS_TEXT, length);
+        memcpy(out, line, length);
+        out += length;
+        line += length + 1;
+    }
+    return frame;
+}
+struct frame *websocket_encode_deflate(const struct frame *lines) {
+    // One compressor per thread, deflateInit is far too expensive to run per message.
+    static __thread z_stream *deflater;
+    if (deflater == NULL) {
+        if ((deflater = calloc(1, sizeof(z_stream))) == NULL) {
+            return NULL;
+        }
+        if (deflateInit2(deflater, Z_BEST_SPEED, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            free(deflater);
+            deflater = NULL;
+            return NULL;
+        }
+    }
+
+    // Worst case every line grows to deflateBound plus the sync flush, compress into a buffer that size and trim.
+    size_t bound = 0;
+    for (const char *line = lines->data, *end = lines->data + lines->length; line < end;) {
+        const char *newline = memchr(line, '\n', end - line);
+        size_t length = (newline != NULL ? newline : end) - line;
+        bound += WEBSOCKET_MAX_HEADER + deflateBound(deflater, length) + 6;
+        line += length + 1;
+    }
+    struct frame *frame = frame_alloc(bound);
+    if (frame == NULL) {
+        return NULL;
+    }
+    uint8_t *out = (uint8_t *)frame->data;
+    for (const char *line = lines->data, *end = lines->data + lines->length; line < end;) {
+        const char *newline = memchr(line, '\n', end - line);
+        size_t length = (newline != NULL ? newline : end) - line;
+        // Compress behind the longest possible header first, then move the data up behind the real one.
+        uint8_t *compressed = out + 10;
+        deflateReset(deflater); // server_no_context_takeover, every message can be decompressed on its own
+        deflater->next_in = (Bytef *)line;
+        deflater->avail_in = length;
+        deflater->next_out = compressed;
+        deflater->avail_out = (uInt)((uint8_t *)frame->data + bound - compressed);
+        deflate(deflater, Z_SYNC_FLUSH);
+        size_t compressed_length = deflater->next_out - compressed - 4; // Without the 00 00 ff ff tail
+        size_t header_length = write_header(out, 0x80 | 0x40 | WS_TEXT, compressed_length);
+        memmove(out + header_length, compressed, compressed_length);
+        out += header_length + compressed_length;
+        line += length + 1;
+    }
+    frame->length = out - (uint8_t *)frame->data;
+    return frame;
+}
+struct frame *websocket_control_frame(enum websocket_opcode opcode, const char *payload, size_t length) {
+    struct frame *frame = frame_alloc(header_size(length) + length);
+    if (frame == NULL) {
+        return NULL;
+    }
+    size_t header_length = write_header((uint8_t *)frame->data, 0x80 | opcode, length);
+    memcpy(frame->data + header_length, payload, length);
+    return frame;
+}
@@ -0,0 +1,78 @@
+#ifndef WEBSOCKET_H
+#define WEBSOCKET_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <zlib.h>
+#include "framing.h"
+#include "outbound.h"
+
+/*
+    RFC 6455 WebSocket support, so browsers can connect to the same port as native clients.
+    A connection whose first byte is 'G' is taken for an HTTP Upgrade request. After the handshake every
+    client message arrives as a WebSocket text message holding the same JSON object a native client sends
+    as a line, and every outgoing line goes out as one text message.
+    permessage-deflate (RFC 7692) is accepted without context takeover in either direction, so each
+    broadcast is compressed once and the same bytes are sent to every browser that negotiated it.
+*/
+#define WEBSOCKET_MAX_REQUEST 8192 // Longest HTTP Upgrade request accepted
+#define WEBSOCKET_MAX_HEADER 14    // Longest frame header: 2 bytes, 8 bytes of length and a 4 byte mask
+
+enum websocket_opcode {
+    WS_CONTINUATION = 0x0,
+    WS_TEXT = 0x1,
+    WS_BINARY = 0x2,
+    WS_CLOSE = 0x8,
+    WS_PING = 0x9,
+    WS_PONG = 0xA
+};
+
+// What websocket_next_message found in the read buffer.
+enum websocket_result { WS_NEED_MORE, WS_MESSAGE, WS_PING_RECEIVED, WS_CLOSE_RECEIVED, WS_PROTOCOL_ERROR };
+
+/*
+    Per-connection state once the handshake is done.
+    - deflate: permessage-deflate was negotiated.
+    - inflater: Decompresses client messages, created with the first compressed one.
+    - message: Fragments of the message being received, appended as they arrive.
+    - inflated: Output of decompressing a message.
+    - fragmented: A message was started with FIN unset and continuation frames are expected.
+    - compressed: The message being assembled had RSV1 set on its first frame.
+*/
+struct websocket_state {
+    bool deflate;
+    z_stream *inflater;
+    char *message;
+    size_t length;
+    size_t capacity;
+    char *inflated;
+    size_t inflated_capacity;
+    bool fragmented;
+    bool compressed;
+};
+
+/*
+    Answers the Upgrade request at the front of the buffer. Returns 0 while the request is incomplete, otherwise
+    consumes it and returns the length of the HTTP response written to response (a 101, or a 400 with a negative
+    length for requests that aren't valid WebSocket handshakes). *deflate tells whether permessage-deflate was agreed on.
+*/
+int websocket_handshake(struct read_buffer *buffer, char *response, size_t size, bool *deflate);
+/*
+    Takes the next complete message off the buffer, unmasked (and decompressed) and null-terminated.
+    Pings and closes are returned for the caller to answer, pongs are skipped. *payload stays valid until the next
+    read_buffer_fill or call.
+*/
+enum websocket_result websocket_next_message(struct read_buffer *buffer, struct websocket_state *ws, char **payload, size_t *length);
+void websocket_free(struct websocket_state *ws);
+
+// XORs length bytes of src with the 4 byte mask into dst, 16 bytes at a time. dst may lie before src in the same buffer.
+void websocket_unmask(char *dst, const char *src, size_t length, const uint8_t mask[4]);
+
+// Encoders for frame_encoded(): every line of a newline-delimited frame becomes one text message.
+struct frame *websocket_encode(const struct frame *lines);
+struct frame *websocket_encode_deflate(const struct frame *lines);
+// A single unfragmented server frame (pong, close) with the given payload.
+struct frame *websocket_control_frame(enum websocket_opcode opcode, const char *payload, size_t length);
+
+#endif